@@ -0,0 +1,405 @@
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include <carver.hpp>
+
+#include "verify.hpp"
+
+using namespace std;
+
+namespace {
+struct ImageSize {
+    string name;
+    int width;
+    int height;
+};
+
+struct Workload {
+    string name;
+    cv::Mat image;
+};
+
+struct BenchConfig {
+    vector<ImageSize> sizes;
+    vector<string> images;
+    vector<carver::CarveMode> modes;
+    vector<float> amounts;
+    vector<int> threads;
+    int repeat = 3;
+    bool stages = true;
+    bool carves = true;
+};
+
+const vector<ImageSize> knownSizes = {
+    {"vga", 640, 480},
+    {"hd", 1280, 720},
+    {"fhd", 1920, 1080},
+    {"4k", 3840, 2160},
+    {"12mp", 4000, 3000},
+    {"50mp", 8192, 6144},
+};
+
+void usage() {
+    cout << "Usage: carver_bench [OPTION]..." << endl;
+    cout << "Times the carving stages and full carves, writes JSON" << endl;
+    cout << "Optional arguments:" << endl;
+    cout << "--sizes    comma separated synthetic image sizes, names (vga/hd/fhd/" << endl;
+    cout << "           4k/12mp/50mp) or WxH, defaults to vga,hd,fhd,4k" << endl;
+    cout << "--images   comma separated paths of real images to add" << endl;
+    cout << "--modes    comma separated carve modes, defaults to" << endl;
+    cout << "           vertical,horizontal,both" << endl;
+    cout << "--amounts  comma separated carve amounts (0-1), defaults to 0.05" << endl;
+    cout << "--threads  comma separated thread counts, defaults to powers of two" << endl;
+    cout << "           up to all hardware threads" << endl;
+    cout << "--repeat   runs per measurement, the median is reported, defaults to 3" << endl;
+    cout << "--only     run only the stage or carve benchmarks (stages/carves)" << endl;
+    cout << "--verify   instead of timing, check the carver against the serial" << endl;
+    cout << "           reference on the given number of generated images" << endl;
+    cout << "--seed     image generator seed for --verify, defaults to 1" << endl;
+    cout << "-o         output path, defaults to stdout" << endl;
+    cout << "-h         print this help" << endl;
+}
+
+[[noreturn]] void terminate(int exitStatus, string message) {
+    cerr << message << endl;
+    cerr << "Run carver_bench -h for help" << endl;
+    exit(exitStatus);
+}
+
+char* getCmdOption(char ** begin, char ** end, const std::string & option) {
+    char ** itr = std::find(begin, end, option);
+    if (itr != end && ++itr != end)
+    {
+        return *itr;
+    }
+    return nullptr;
+}
+
+vector<string> splitList(const string &list) {
+    vector<string> items;
+    stringstream stream(list);
+    string item;
+    while (getline(stream, item, ',')) {
+        if (!item.empty())
+            items.push_back(item);
+    }
+    return items;
+}
+
+ImageSize parseSize(const string &name) {
+    for (const ImageSize &size : knownSizes) {
+        if (size.name == name)
+            return size;
+    }
+    int width = 0;
+    int height = 0;
+    char separator = 0;
+    stringstream stream(name);
+    if (!(stream >> width >> separator >> height) || separator != 'x' ||
+            width < 8 || height < 8)
+        terminate(1, "Image size " + name + " invalid");
+    return {name, width, height};
+}
+
+BenchConfig parseOptions(int argc, char *argv[]) {
+    BenchConfig config;
+    char **end = argv + argc;
+
+    char* sizesOpt = getCmdOption(argv, end, "--sizes");
+    for (const string &size : splitList(sizesOpt ? sizesOpt
+                                                 : "vga,hd,fhd,4k")) {
+        config.sizes.push_back(parseSize(size));
+    }
+
+    char* imagesOpt = getCmdOption(argv, end, "--images");
+    if (imagesOpt)
+        config.images = splitList(imagesOpt);
+
+    char* modesOpt = getCmdOption(argv, end, "--modes");
+    for (const string &mode : splitList(modesOpt ? modesOpt
+                                                 : "vertical,horizontal,both")) {
+        if (mode == "both")
+            config.modes.push_back(carver::BOTH);
+        else if (mode == "vertical")
+            config.modes.push_back(carver::VERTICAL);
+        else if (mode == "horizontal")
+            config.modes.push_back(carver::HORIZONTAL);
+        else
+            terminate(1, "Carve mode " + mode + " invalid");
+    }
+
+    char* amountsOpt = getCmdOption(argv, end, "--amounts");
+    for (const string &amount : splitList(amountsOpt ? amountsOpt : "0.05")) {
+        float value = strtof(amount.c_str(), nullptr);
+        if (value <= 0.0f || value >= 1.0f)
+            terminate(1, "Carve amount " + amount + " invalid");
+        config.amounts.push_back(value);
+    }
+
+    char* threadsOpt = getCmdOption(argv, end, "--threads");
+    if (threadsOpt) {
+        for (const string &threads : splitList(threadsOpt)) {
+            int value = atoi(threads.c_str());
+            if (value < 1)
+                terminate(1, "Thread count " + threads + " invalid");
+            config.threads.push_back(value);
+        }
+    } else {
+        int hardwareThreads = max(1, static_cast<int>(
+                                      thread::hardware_concurrency()));
+        for (int threads = 1; threads < hardwareThreads; threads *= 2) {
+            config.threads.push_back(threads);
+        }
+        config.threads.push_back(hardwareThreads);
+    }
+
+    char* repeatOpt = getCmdOption(argv, end, "--repeat");
+    if (repeatOpt) {
+        config.repeat = atoi(repeatOpt);
+        if (config.repeat < 1)
+            terminate(1, "Invalid argument for repeat");
+    }
+
+    char* onlyOpt = getCmdOption(argv, end, "--only");
+    if (onlyOpt) {
+        string only(onlyOpt);
+        if (only != "stages" && only != "carves")
+            terminate(1, "Invalid argument for only");
+        config.stages = only == "stages";
+        config.carves = only == "carves";
+    }
+    return config;
+}
+
+/**
+ * @brief syntheticImage creates a reproducible test image: smooth
+ * gradients with blurred noise on top, so that the energy map has both
+ * flat areas and detail like a photograph
+ * @param size image size
+ * @return 8-bit BGR image
+ */
+cv::Mat syntheticImage(const ImageSize &size) {
+    cv::Mat image(size.height, size.width, CV_8UC3);
+    for (int r = 0; r < size.height; r++) {
+        uchar *row = image.ptr(r);
+        for (int c = 0; c < size.width; c++) {
+            row[3 * c] = static_cast<uchar>(255 * c / size.width);
+            row[3 * c + 1] = static_cast<uchar>(255 * r / size.height);
+            row[3 * c + 2] = 128;
+        }
+    }
+
+    cv::Mat noise(size.height, size.width, CV_8UC3);
+    cv::RNG rng(0x5eedcafe);
+    rng.fill(noise, cv::RNG::UNIFORM, 0, 96);
+    cv::GaussianBlur(noise, noise, cv::Size(5, 5), 0);
+    cv::add(image, noise, image);
+    return image;
+}
+
+/**
+ * @brief median times a callable and returns the median of its runs
+ * @param repeat number of runs
+ * @param run callable to time
+ * @return median wall time in seconds
+ */
+template<typename F>
+double median(int repeat, F &&run) {
+    vector<double> seconds;
+    for (int i = 0; i < repeat; i++) {
+        auto start = chrono::steady_clock::now();
+        run();
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        seconds.push_back(elapsed.count());
+    }
+    sort(seconds.begin(), seconds.end());
+    return seconds[seconds.size() / 2];
+}
+
+string modeName(carver::CarveMode mode) {
+    switch (mode) {
+    case carver::VERTICAL:
+        return "vertical";
+    case carver::HORIZONTAL:
+        return "horizontal";
+    default:
+        return "both";
+    }
+}
+
+double megapixels(const cv::Mat &image) {
+    return image.total() / 1e6;
+}
+
+void benchStages(const Workload &workload, const BenchConfig &config,
+                 vector<string> &results) {
+    carver::Carver carver;
+    cv::Mat grayscale;
+    cv::cvtColor(workload.image, grayscale, cv::COLOR_BGR2GRAY);
+    cv::Mat energyMap = carver.calculateEnergy(grayscale);
+    cv::Mat cumulativeEnergyMap = carver.calculateCumulativeEnergy(energyMap);
+    vector<int> seam = carver.calculateLowestEnergyPath(cumulativeEnergyMap);
+
+    vector<pair<string, double>> timings;
+    timings.push_back({"calculateEnergy", median(config.repeat, [&] {
+        carver.calculateEnergy(grayscale);
+    })});
+    timings.push_back({"calculateCumulativeEnergy", median(config.repeat, [&] {
+        carver.calculateCumulativeEnergy(energyMap);
+    })});
+    timings.push_back({"calculateLowestEnergyPath", median(config.repeat, [&] {
+        carver.calculateLowestEnergyPath(cumulativeEnergyMap);
+    })});
+
+    // Removal works in place, time it on fresh copies only
+    vector<cv::Mat> copies(config.repeat);
+    for (cv::Mat &copy : copies) {
+        copy = workload.image.clone();
+    }
+    size_t next = 0;
+    timings.push_back({"removeSeam", median(config.repeat, [&] {
+        carver.removeSeam(copies[next++], seam);
+    })});
+
+    for (auto &timing : timings) {
+        ostringstream json;
+        json << "{\"image\": \"" << workload.name << "\", \"width\": "
+             << workload.image.cols << ", \"height\": " << workload.image.rows
+             << ", \"stage\": \"" << timing.first << "\", \"seconds\": "
+             << timing.second << ", \"mpPerSecond\": "
+             << megapixels(workload.image) / timing.second << "}";
+        results.push_back(json.str());
+    }
+}
+
+void benchCarves(const Workload &workload, const BenchConfig &config,
+                 vector<string> &results, vector<string> &scaling) {
+    for (carver::CarveMode mode : config.modes) {
+        for (float amount : config.amounts) {
+            vector<double> seconds;
+            for (int threads : config.threads) {
+                carver::Carver carver;
+                carver.setThreadCount(threads);
+                carver.setCarveMode(mode);
+                carver.setCarveAmount(amount);
+                carver.setTargetImage(workload.image);
+                cv::Size result = carver.getResultSize();
+                int seams = workload.image.cols - result.width +
+                        workload.image.rows - result.height;
+
+                double time = median(config.repeat, [&] {
+                    carver.carveImage();
+                });
+                seconds.push_back(time);
+
+                ostringstream json;
+                json << "{\"image\": \"" << workload.name
+                     << "\", \"width\": " << workload.image.cols
+                     << ", \"height\": " << workload.image.rows
+                     << ", \"mode\": \"" << modeName(mode)
+                     << "\", \"amount\": " << amount
+                     << ", \"threads\": " << threads
+                     << ", \"seams\": " << seams
+                     << ", \"seconds\": " << time
+                     << ", \"seamsPerSecond\": " << seams / time
+                     << ", \"mpPerSecond\": "
+                     << megapixels(workload.image) / time << "}";
+                results.push_back(json.str());
+                cerr << workload.name << " " << modeName(mode) << " "
+                     << amount << " " << threads << " threads: " << time
+                     << " s" << endl;
+            }
+
+            // Speedup of every thread count over the first one
+            ostringstream json;
+            json << "{\"image\": \"" << workload.name << "\", \"mode\": \""
+                 << modeName(mode) << "\", \"amount\": " << amount
+                 << ", \"threads\": [";
+            for (size_t i = 0; i < config.threads.size(); i++) {
+                json << (i ? ", " : "") << config.threads[i];
+            }
+            json << "], \"speedup\": [";
+            for (size_t i = 0; i < seconds.size(); i++) {
+                json << (i ? ", " : "") << seconds[0] / seconds[i];
+            }
+            json << "]}";
+            scaling.push_back(json.str());
+        }
+    }
+}
+
+void writeArray(ostream &out, const string &name,
+                const vector<string> &items, bool last) {
+    out << "  \"" << name << "\": [";
+    for (size_t i = 0; i < items.size(); i++) {
+        out << (i ? ",\n    " : "\n    ") << items[i];
+    }
+    out << (items.empty() ? "]" : "\n  ]") << (last ? "\n" : ",\n");
+}
+} // namespace
+
+int main(int argc, char *argv[]) {
+    if (find(argv, argv + argc, string("-h")) != argv + argc) {
+        usage();
+        return 0;
+    }
+
+    ofstream file;
+    char* outputOpt = getCmdOption(argv, argv + argc, "-o");
+    if (outputOpt) {
+        file.open(outputOpt);
+        if (!file)
+            terminate(1, string("Could not write ") + outputOpt);
+    }
+    ostream &out = outputOpt ? file : cout;
+
+    char* verifyOpt = getCmdOption(argv, argv + argc, "--verify");
+    if (verifyOpt) {
+        int images = atoi(verifyOpt);
+        if (images < 1)
+            terminate(1, "Invalid argument for verify");
+        char* seedOpt = getCmdOption(argv, argv + argc, "--seed");
+        unsigned seed = seedOpt ? static_cast<unsigned>(atol(seedOpt)) : 1;
+        int failures = verify::run(images, seed, out);
+        if (failures)
+            cerr << failures << " checks failed" << endl;
+        return failures ? 2 : 0;
+    }
+
+    BenchConfig config = parseOptions(argc, argv);
+
+    vector<Workload> workloads;
+    for (const ImageSize &size : config.sizes) {
+        workloads.push_back({size.name, syntheticImage(size)});
+    }
+    for (const string &path : config.images) {
+        cv::Mat image = cv::imread(path, cv::IMREAD_COLOR);
+        if (image.empty())
+            terminate(1, "Image loading failed for " + path);
+        workloads.push_back({path, image});
+    }
+
+    vector<string> stages;
+    vector<string> carves;
+    vector<string> scaling;
+    for (const Workload &workload : workloads) {
+        if (config.stages)
+            benchStages(workload, config, stages);
+        if (config.carves)
+            benchCarves(workload, config, carves, scaling);
+    }
+
+    out.precision(6);
+    out << "{\n  \"hardwareThreads\": " << thread::hardware_concurrency()
+        << ",\n  \"repeat\": " << config.repeat << ",\n";
+    writeArray(out, "stages", stages, false);
+    writeArray(out, "carves", carves, false);
+    writeArray(out, "scaling", scaling, true);
+    out << "}" << endl;
+    return 0;
+}
@@ -0,0 +1,155 @@
+#include "reference.hpp"
+
+
+namespace reference {
+namespace {
+// Upper neighbour offsets in tie preference order. Vertical seams prefer
+// the left neighbour, horizontal seams the lower one, which is the right
+// one on the transposed map.
+int preference(carver::CarveMode direction, int k) {
+    const int vertical[3] = {-1, 0, 1};
+    const int horizontal[3] = {1, 0, -1};
+    return direction == carver::VERTICAL ? vertical[k] : horizontal[k];
+}
+} // namespace
+
+cv::Mat energy(const cv::Mat &grayscale) {
+    cv::Mat blurred, xGradient, yGradient, target;
+    cv::GaussianBlur(grayscale, blurred, cv::Size(5, 5), 0, 0,
+                     cv::BORDER_DEFAULT);
+    cv::Sobel(blurred, xGradient, CV_16S, 1, 0, 3, 1, 0, cv::BORDER_DEFAULT);
+    cv::convertScaleAbs(xGradient, xGradient);
+    cv::Sobel(blurred, yGradient, CV_16S, 0, 1, 3, 1, 0, cv::BORDER_DEFAULT);
+    cv::convertScaleAbs(yGradient, yGradient);
+    cv::addWeighted(xGradient, 0.5, yGradient, 0.5, 0, target);
+    target.convertTo(target, CV_64F, 1.0/255.0);
+    return target;
+}
+
+cv::Mat cumulativeEnergy(const cv::Mat &energyMap,
+                         carver::CarveMode direction) {
+    cv::Mat source = direction == carver::VERTICAL ? energyMap
+                                                   : energyMap.t();
+    cv::Mat target = source.clone();
+    for (int r = 1; r < target.rows; r++) {
+        for (int c = 0; c < target.cols; c++) {
+            double best = target.at<double>(r - 1, c);
+            if (c > 0)
+                best = min(best, target.at<double>(r - 1, c - 1));
+            if (c < target.cols - 1)
+                best = min(best, target.at<double>(r - 1, c + 1));
+            target.at<double>(r, c) += best;
+        }
+    }
+    return target;
+}
+
+vector<int> backtrack(const cv::Mat &cumulativeEnergyMap,
+                      carver::CarveMode direction) {
+    int rows = cumulativeEnergyMap.rows;
+    int cols = cumulativeEnergyMap.cols;
+    vector<int> path(rows);
+
+    // Vertical seams start from the leftmost minimum, horizontal seams
+    // from the lowest one
+    int c = direction == carver::VERTICAL ? 0 : cols - 1;
+    for (int k = 0; k < cols; k++) {
+        int j = direction == carver::VERTICAL ? k : cols - 1 - k;
+        if (cumulativeEnergyMap.at<double>(rows - 1, j) <
+                cumulativeEnergyMap.at<double>(rows - 1, c))
+            c = j;
+    }
+    path[rows - 1] = c;
+
+    for (int r = rows - 2; r >= 0; r--) {
+        int best = -1;
+        for (int k = 0; k < 3; k++) {
+            int j = min(max(c + preference(direction, k), 0), cols - 1);
+            if (best < 0 || cumulativeEnergyMap.at<double>(r, j) <
+                    cumulativeEnergyMap.at<double>(r, best))
+                best = j;
+        }
+        c = best;
+        path[r] = c;
+    }
+    return path;
+}
+
+vector<int> seam(const cv::Mat &energyMap, carver::CarveMode direction) {
+    return backtrack(cumulativeEnergy(energyMap, direction), direction);
+}
+
+cv::Mat removeSeam(const cv::Mat &image, const vector<int> &seam,
+                   carver::CarveMode direction) {
+    cv::Mat source = direction == carver::VERTICAL ? image : image.t();
+    cv::Mat target(source.rows, source.cols - 1, source.type());
+    size_t pixelSize = source.elemSize();
+    for (int r = 0; r < source.rows; r++) {
+        const uchar *from = source.ptr(r);
+        uchar *to = target.ptr(r);
+        for (int c = 0, t = 0; c < source.cols; c++) {
+            if (c == seam[r])
+                continue;
+            memcpy(to + t * pixelSize, from + c * pixelSize, pixelSize);
+            t++;
+        }
+    }
+    return direction == carver::VERTICAL ? target : cv::Mat(target.t());
+}
+
+double seamEnergy(const cv::Mat &energyMap, const vector<int> &seam,
+                  carver::CarveMode direction) {
+    double total = 0;
+    for (size_t i = 0; i < seam.size(); i++) {
+        int line = static_cast<int>(i);
+        total += direction == carver::VERTICAL
+                ? energyMap.at<double>(line, seam[i])
+                : energyMap.at<double>(seam[i], line);
+    }
+    return total;
+}
+
+cv::Mat carve(const cv::Mat &image, carver::CarveMode mode, int count,
+              double &removedEnergy) {
+    cv::Mat target = image.clone();
+    int vIterations = mode == carver::HORIZONTAL ? 0 : count;
+    int hIterations = mode == carver::VERTICAL ? 0 : count;
+    removedEnergy = 0;
+
+    for (int v = 0, h = 0; v < vIterations || h < hIterations;) {
+        cv::Mat grayscale;
+        cv::cvtColor(target, grayscale, cv::COLOR_BGR2GRAY);
+        cv::Mat energyMap = energy(grayscale);
+
+        if (v < vIterations && h < hIterations) {
+            vector<int> verticalSeam = seam(energyMap, carver::VERTICAL);
+            vector<int> horizontalSeam = seam(energyMap, carver::HORIZONTAL);
+            double verticalEnergy = seamEnergy(energyMap, verticalSeam,
+                                               carver::VERTICAL);
+            double horizontalEnergy = seamEnergy(energyMap, horizontalSeam,
+                                                 carver::HORIZONTAL);
+            if (verticalEnergy <= horizontalEnergy) {
+                removedEnergy += verticalEnergy;
+                target = removeSeam(target, verticalSeam, carver::VERTICAL);
+                v++;
+            } else {
+                removedEnergy += horizontalEnergy;
+                target = removeSeam(target, horizontalSeam,
+                                    carver::HORIZONTAL);
+                h++;
+            }
+        } else {
+            carver::CarveMode direction = v < vIterations ? carver::VERTICAL
+                                                          : carver::HORIZONTAL;
+            vector<int> path = seam(energyMap, direction);
+            removedEnergy += seamEnergy(energyMap, path, direction);
+            target = removeSeam(target, path, direction);
+            if (direction == carver::VERTICAL)
+                v++;
+            else
+                h++;
+        }
+    }
+    return target;
+}
+} // namespace reference
@@ -0,0 +1,82 @@
+#ifndef REFERENCE_HPP
+#define REFERENCE_HPP
+
+#include <carver.hpp>
+
+using namespace std;
+namespace reference {
+
+/**
+ * Straightforward serial seam carving used as the ground truth for the
+ * optimised carver. Energies are doubles and recomputed from scratch on
+ * every iteration, horizontal seams are found on the transposed image.
+ * Ties are broken the way the carver documents them.
+ */
+
+/**
+ * @brief energy calculates the energy map of a grayscale image
+ * @param grayscale grayscale image
+ * @return CV_64F energy map
+ */
+cv::Mat energy(const cv::Mat &grayscale);
+
+/**
+ * @brief cumulativeEnergy calculates the cumulative energy map of vertical
+ * seams, or of horizontal seams on the transposed energy map
+ * @param energyMap CV_64F energy map
+ * @param direction seam direction
+ * @return CV_64F cumulative energy map, transposed for horizontal seams
+ */
+cv::Mat cumulativeEnergy(const cv::Mat &energyMap, carver::CarveMode direction);
+
+/**
+ * @brief backtrack finds the lowest energy seam of a cumulative map
+ * @param cumulativeEnergyMap map returned by cumulativeEnergy()
+ * @param direction seam direction
+ * @return seam positions
+ */
+vector<int> backtrack(const cv::Mat &cumulativeEnergyMap,
+                      carver::CarveMode direction);
+
+/**
+ * @brief seam finds the lowest energy seam of an energy map
+ * @param energyMap CV_64F energy map
+ * @param direction seam direction
+ * @return seam positions
+ */
+vector<int> seam(const cv::Mat &energyMap, carver::CarveMode direction);
+
+/**
+ * @brief removeSeam copies an image without the pixels of a seam
+ * @param image source image
+ * @param seam seam positions, only as many as the image has lines are read
+ * @param direction seam direction
+ * @return reduced image
+ */
+cv::Mat removeSeam(const cv::Mat &image, const vector<int> &seam,
+                   carver::CarveMode direction);
+
+/**
+ * @brief seamEnergy sums the energies along a seam
+ * @param energyMap CV_64F energy map
+ * @param seam seam positions
+ * @param direction seam direction
+ * @return total energy
+ */
+double seamEnergy(const cv::Mat &energyMap, const vector<int> &seam,
+                  carver::CarveMode direction);
+
+/**
+ * @brief carve removes seams like Carver::carveImage(). In BOTH mode every
+ * step removes whichever of the vertical and horizontal seams has less
+ * energy, the vertical one on a tie.
+ * @param image source image
+ * @param mode carve mode
+ * @param count seams to remove in each carved direction
+ * @param removedEnergy total energy of the removed seams
+ * @return reduced image
+ */
+cv::Mat carve(const cv::Mat &image, carver::CarveMode mode, int count,
+              double &removedEnergy);
+} // namespace reference
+#endif // REFERENCE_HPP
@@ -0,0 +1,651 @@
+#include "verify.hpp"
+#include "reference.hpp"
+
+#include <energykernel.hpp>
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <sstream>
+
+
+namespace verify {
+namespace {
+/**
+ * @brief The Check struct accumulates the outcome of one kind of check
+ * over all images
+ */
+struct Check {
+    int runs = 0;
+    int failures = 0;
+    double seconds = 0;
+    double referenceSeconds = 0;
+
+    // Approximate checks: energy removed relative to the reference
+    double tolerance = 0;
+    double removedEnergy = 0;
+    double referenceRemovedEnergy = 0;
+    double worstRatio = 0;
+};
+
+struct Verifier {
+    map<string, Check> checks;
+    vector<string> failed;
+
+    void record(const string &check, const string &image, bool passed,
+                const string &detail = "") {
+        Check &c = checks[check];
+        c.runs++;
+        if (!passed) {
+            c.failures++;
+            failed.push_back("{\"check\": \"" + check + "\", \"image\": \"" +
+                             image + "\", \"detail\": \"" + detail + "\"}");
+        }
+    }
+};
+
+template<typename F>
+double timed(F &&run) {
+    auto start = chrono::steady_clock::now();
+    run();
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+bool identical(const cv::Mat &a, const cv::Mat &b) {
+    if (a.size() != b.size() || a.type() != b.type())
+        return false;
+    size_t rowSize = a.cols * a.elemSize();
+    for (int r = 0; r < a.rows; r++) {
+        if (memcmp(a.ptr(r), b.ptr(r), rowSize) != 0)
+            return false;
+    }
+    return true;
+}
+
+bool validSeam(const vector<int> &seam, int length, int width) {
+    if (static_cast<int>(seam.size()) != length)
+        return false;
+    for (int i = 0; i < length; i++) {
+        if (seam[i] < 0 || seam[i] >= width ||
+                (i > 0 && abs(seam[i] - seam[i - 1]) > 1))
+            return false;
+    }
+    return true;
+}
+
+string modeName(carver::CarveMode mode) {
+    switch (mode) {
+    case carver::VERTICAL:
+        return "vertical";
+    case carver::HORIZONTAL:
+        return "horizontal";
+    default:
+        return "both";
+    }
+}
+
+/**
+ * @brief generateImage creates a test image. Noise has few equal
+ * energies, smooth images look like photographs, blocks of flat colour
+ * are full of ties and noisy checkerboards have strong edges everywhere.
+ * @param rng generator
+ * @param kind image kind, 0-3
+ * @param rows image height
+ * @param cols image width
+ * @return 8-bit BGR image
+ */
+cv::Mat generateImage(cv::RNG &rng, int kind, int rows, int cols) {
+    cv::Mat image(rows, cols, CV_8UC3);
+    if (kind == 0) {
+        rng.fill(image, cv::RNG::UNIFORM, 0, 256);
+    } else if (kind == 1) {
+        cv::Mat noise(rows, cols, CV_8UC3);
+        rng.fill(noise, cv::RNG::UNIFORM, 0, 256);
+        cv::GaussianBlur(noise, image, cv::Size(5, 5), 0);
+    } else if (kind == 3) {
+        int square = rng.uniform(3, 7);
+        rng.fill(image, cv::RNG::UNIFORM, 0, 64);
+        for (int r = 0; r < rows; r++) {
+            uchar *row = image.ptr(r);
+            for (int c = 0; c < cols; c++) {
+                if ((r / square + c / square) % 2 == 0)
+                    continue;
+                for (int k = 0; k < 3; k++)
+                    row[3 * c + k] = static_cast<uchar>(255 - row[3 * c + k]);
+            }
+        }
+    } else {
+        int block = rng.uniform(4, 24);
+        for (int r = 0; r < rows; r++) {
+            uchar *row = image.ptr(r);
+            for (int c = 0; c < cols; c++) {
+                uchar value = static_cast<uchar>(
+                            ((r / block) * 7 + (c / block) * 13) % 4 * 64);
+                row[3 * c] = value;
+                row[3 * c + 1] = value;
+                row[3 * c + 2] = value;
+            }
+        }
+    }
+    return image;
+}
+
+/**
+ * @brief generateImage creates a test image of a random size
+ * @param rng generator
+ * @param kind image kind, 0-2
+ * @param large whether the image is at least 256 pixels on each side
+ * @return 8-bit BGR image
+ */
+cv::Mat generateImage(cv::RNG &rng, int kind, bool large) {
+    // Large images are big enough for the pyramid engine to downsample
+    int cols = large ? rng.uniform(256, 640) : rng.uniform(24, 300);
+    int rows = large ? rng.uniform(256, 480) : rng.uniform(24, 200);
+    return generateImage(rng, kind, rows, cols);
+}
+
+void checkStages(Verifier &verifier, const string &name,
+                 const cv::Mat &image) {
+    carver::Carver carver;
+    carver.setThreadCount(4);
+    cv::Mat grayscale;
+    cv::cvtColor(image, grayscale, cv::COLOR_BGR2GRAY);
+
+    cv::Mat energyMap = carver.calculateEnergy(grayscale);
+    cv::Mat referenceEnergy = reference::energy(grayscale);
+    verifier.record("energy", name, identical(energyMap, referenceEnergy));
+
+    // The fused kernel converts BGR pixels itself and hands the grayscale
+    // map back for incremental updates
+    cv::Mat fusedEnergyMap, fusedGrayscale;
+    carver::ThreadPool pool(4);
+    carver::fusedEnergy(image, fusedEnergyMap, CV_64F, &fusedGrayscale,
+                        &pool);
+    verifier.record("fusedEnergy", name,
+                    identical(fusedEnergyMap, referenceEnergy) &&
+                    identical(fusedGrayscale, grayscale));
+
+    // Threaded DP has to give the same map on every run
+    cv::Mat referenceCumulative =
+            reference::cumulativeEnergy(referenceEnergy, carver::VERTICAL);
+    cv::Mat cumulativeEnergyMap;
+    for (int run = 0; run < 3; run++) {
+        cumulativeEnergyMap = carver.calculateCumulativeEnergy(energyMap);
+        verifier.record("cumulativeEnergy", name,
+                        identical(cumulativeEnergyMap, referenceCumulative),
+                        "run " + to_string(run));
+    }
+
+    vector<int> seam = carver.calculateLowestEnergyPath(cumulativeEnergyMap);
+    verifier.record("lowestEnergyPath", name,
+                    seam == reference::backtrack(referenceCumulative,
+                                                 carver::VERTICAL));
+
+    vector<int> horizontalSeam = carver.getSeamToRemove(energyMap,
+                                                        carver::HORIZONTAL);
+    verifier.record("horizontalSeam", name,
+                    horizontalSeam == reference::seam(referenceEnergy,
+                                                      carver::HORIZONTAL));
+
+    cv::Mat copy = image.clone();
+    verifier.record("removeVerticalSeam", name,
+                    identical(carver.removeVerticalSeam(copy, seam),
+                              reference::removeSeam(image, seam,
+                                                    carver::VERTICAL)));
+    copy = image.clone();
+    verifier.record("removeHorizontalSeam", name,
+                    identical(carver.removeHorizontalSeam(copy,
+                                                          horizontalSeam),
+                              reference::removeSeam(image, horizontalSeam,
+                                                    carver::HORIZONTAL)));
+}
+
+struct ExactConfig {
+    string name;
+    int threads;
+    bool incrementalEnergy;
+    bool incrementalCumulativeEnergy;
+    int runs;
+};
+
+void checkExact(Verifier &verifier, const string &name, const cv::Mat &image,
+                int count) {
+    const vector<ExactConfig> configs = {
+        {"serial", 1, true, true, 1},
+        {"threaded", 4, true, true, 3},
+        {"fullRecompute", 4, false, false, 1},
+        {"rollingDp", 4, true, false, 1},
+    };
+
+    for (carver::CarveMode mode : {carver::VERTICAL, carver::HORIZONTAL,
+                                   carver::BOTH}) {
+        double removedEnergy = 0;
+        cv::Mat expected;
+        double referenceSeconds = timed([&] {
+            expected = reference::carve(image, mode, count, removedEnergy);
+        });
+
+        for (const ExactConfig &config : configs) {
+            carver::Carver carver;
+            carver.setThreadCount(config.threads);
+            carver.setIncrementalEnergy(config.incrementalEnergy);
+            carver.setIncrementalCumulativeEnergy(
+                        config.incrementalCumulativeEnergy);
+            carver.setCarveMode(mode);
+            carver.setCarveCount(count);
+            carver.setTargetImage(image);
+
+            string check = config.name + "/" + modeName(mode);
+            for (int run = 0; run < config.runs; run++) {
+                cv::Mat result;
+                double seconds = timed([&] { result = carver.carveImage(); });
+                verifier.checks[check].seconds += seconds;
+                verifier.checks[check].referenceSeconds += referenceSeconds;
+                verifier.record(check, name, identical(result, expected),
+                                "run " + to_string(run));
+            }
+        }
+    }
+}
+
+/**
+ * @brief checkOutOfCore checks out-of-core carves against in-memory carves
+ * with the same energies. BOTH mode removes all vertical seams first, so
+ * it is compared with a vertical carve followed by a horizontal one.
+ */
+void checkOutOfCore(Verifier &verifier, const string &name,
+                    const cv::Mat &image, int count) {
+    for (carver::CarveMode mode : {carver::VERTICAL, carver::HORIZONTAL,
+                                   carver::BOTH}) {
+        carver::Carver inMemory;
+        inMemory.setThreadCount(4);
+        inMemory.setEnergyType(carver::ENERGY_FIXED32);
+        inMemory.setCarveCount(count);
+        cv::Mat expected = image;
+        for (carver::CarveMode step : {carver::VERTICAL,
+                                       carver::HORIZONTAL}) {
+            if (mode != carver::BOTH && mode != step)
+                continue;
+            inMemory.setCarveMode(step);
+            inMemory.setTargetImage(expected);
+            expected = inMemory.carveImage();
+        }
+
+        // A limit this low maps the fewest rows at a time
+        carver::Carver carver;
+        carver.setThreadCount(4);
+        carver.setMemoryLimit(1);
+        carver.setCarveMode(mode);
+        carver.setCarveCount(count);
+        carver.setTargetImage(image);
+        cv::Mat result;
+        string check = "outOfCore/" + modeName(mode);
+        verifier.checks[check].seconds += timed([&] {
+            result = carver.carveImage();
+        });
+        verifier.record(check, name, identical(result, expected));
+    }
+}
+
+struct ApproximateConfig {
+    string name;
+    double tolerance;
+    function<void(carver::Carver &)> setup;
+};
+
+/**
+ * @brief removeStepwise carves seams one at a time through the public API
+ * and sums their energies on the reference energy map
+ * @param carver configured carver
+ * @param image source image
+ * @param direction seam direction
+ * @param count seams to remove
+ * @param removedEnergy total energy of the removed seams
+ * @return false if a seam was not connected
+ */
+bool removeStepwise(carver::Carver &carver, cv::Mat image,
+                    carver::CarveMode direction, int count,
+                    double &removedEnergy) {
+    removedEnergy = 0;
+    for (int s = 0; s < count; s++) {
+        cv::Mat grayscale;
+        cv::cvtColor(image, grayscale, cv::COLOR_BGR2GRAY);
+        cv::Mat energyMap = carver.calculateEnergy(grayscale);
+        vector<int> seam = carver.getSeamToRemove(energyMap, direction);
+
+        bool vertical = direction == carver::VERTICAL;
+        if (!validSeam(seam, vertical ? image.rows : image.cols,
+                       vertical ? image.cols : image.rows))
+            return false;
+        removedEnergy += reference::seamEnergy(reference::energy(grayscale),
+                                               seam, direction);
+        image = reference::removeSeam(image, seam, direction);
+    }
+    return true;
+}
+
+/**
+ * @brief recordApproximate records an approximate carve, which passes if
+ * its seams were connected and it removed at most the tolerance more
+ * energy than the reference
+ */
+void recordApproximate(Verifier &verifier, const string &check,
+                       const string &name, double tolerance, bool connected,
+                       double removedEnergy, double referenceEnergy,
+                       double seconds, double referenceSeconds,
+                       bool matches = true) {
+    // Flat images may have nothing to remove at all
+    double ratio = referenceEnergy > 0
+            ? removedEnergy / referenceEnergy
+            : (removedEnergy > 0 ? numeric_limits<double>::infinity()
+                                 : 1.0);
+    Check &c = verifier.checks[check];
+    c.tolerance = tolerance;
+    c.seconds += seconds;
+    c.referenceSeconds += referenceSeconds;
+    c.removedEnergy += removedEnergy;
+    c.referenceRemovedEnergy += referenceEnergy;
+    c.worstRatio = max(c.worstRatio, ratio);
+    verifier.record(check, name,
+                    connected && matches && ratio <= 1.0 + tolerance,
+                    !connected ? "seam not connected"
+                               : !matches ? "result differs from its seams"
+                                          : "removed energy ratio " +
+                                            to_string(ratio));
+}
+
+const ApproximateConfig fixed32Config = {
+    "energyFixed32", 0.01, [](carver::Carver &carver) {
+        carver.setEnergyType(carver::ENERGY_FIXED32);
+    }};
+const ApproximateConfig fixed16Config = {
+    "energyFixed16", 0.01, [](carver::Carver &carver) {
+        carver.setEnergyType(carver::ENERGY_FIXED16);
+    }};
+
+void checkApproximateConfig(Verifier &verifier, const string &name,
+                            const cv::Mat &image, carver::CarveMode mode,
+                            int count, const ApproximateConfig &config,
+                            double referenceEnergy, double referenceSeconds,
+                            const string &prefix = "") {
+    carver::Carver carver;
+    config.setup(carver);
+    double removedEnergy = 0;
+    bool connected = false;
+    double seconds = timed([&] {
+        connected = removeStepwise(carver, image, mode, count,
+                                   removedEnergy);
+    });
+    recordApproximate(verifier, prefix + config.name + "/" + modeName(mode),
+                      name, config.tolerance, connected, removedEnergy,
+                      referenceEnergy, seconds, referenceSeconds);
+}
+
+/**
+ * @brief replaySeams removes recorded seams one at a time and sums their
+ * energies on the reference energy map
+ * @param image source image
+ * @param seams seams in removal order
+ * @param direction seam direction
+ * @param result target reduced image
+ * @param removedEnergy total energy of the removed seams
+ * @return false if a seam was not connected
+ */
+bool replaySeams(cv::Mat image, const vector<vector<int>> &seams,
+                 carver::CarveMode direction, cv::Mat &result,
+                 double &removedEnergy) {
+    removedEnergy = 0;
+    bool vertical = direction == carver::VERTICAL;
+    for (const vector<int> &seam : seams) {
+        if (!validSeam(seam, vertical ? image.rows : image.cols,
+                       vertical ? image.cols : image.rows))
+            return false;
+        cv::Mat grayscale;
+        cv::cvtColor(image, grayscale, cv::COLOR_BGR2GRAY);
+        removedEnergy += reference::seamEnergy(reference::energy(grayscale),
+                                               seam, direction);
+        image = reference::removeSeam(image, seam, direction);
+    }
+    result = image;
+    return true;
+}
+
+/**
+ * @brief checkApproximateBoth carves in BOTH mode, where a threaded carver
+ * searches the seams of both directions at the same time. The removed
+ * energy is the sum of the recorded seam costs, and a serial carve has to
+ * give the same result.
+ */
+void checkApproximateBoth(Verifier &verifier, const string &name,
+                          const cv::Mat &image, int count,
+                          const ApproximateConfig &config,
+                          double referenceEnergy, double referenceSeconds) {
+    cv::Mat results[2];
+    double removedEnergy = 0;
+    double seconds = 0;
+    for (int threads : {4, 1}) {
+        carver::Carver carver;
+        config.setup(carver);
+        carver.setThreadCount(threads);
+        carver.setSeamRecording(true);
+        carver.setCarveMode(carver::BOTH);
+        carver.setCarveCount(count);
+        carver.setTargetImage(image);
+        cv::Mat &result = results[threads == 1];
+        double elapsed = timed([&] {
+            result = carver.carveImage();
+        });
+        if (threads > 1) {
+            seconds = elapsed;
+            for (const vector<double> &costs :
+                 carver.getCarvedSeams().costs) {
+                for (double cost : costs)
+                    removedEnergy += cost;
+            }
+        }
+    }
+    bool connected = results[0].cols == image.cols - count &&
+            results[0].rows == image.rows - count;
+    recordApproximate(verifier, config.name + "/" + modeName(carver::BOTH),
+                      name, config.tolerance, connected, removedEnergy,
+                      referenceEnergy, seconds, referenceSeconds,
+                      identical(results[0], results[1]));
+}
+
+void checkApproximate(Verifier &verifier, const string &name,
+                      const cv::Mat &image, int count) {
+    const vector<ApproximateConfig> configs = {
+        {"energyFloat", 0.01, [](carver::Carver &carver) {
+             carver.setEnergyType(carver::ENERGY_FLOAT);
+         }},
+        fixed32Config,
+        fixed16Config,
+        {"pyramid", 0.5, [](carver::Carver &carver) {
+             carver.setSeamEngine(carver::ENGINE_PYRAMID);
+         }},
+        {"banded", 0.25, [](carver::Carver &carver) {
+             carver.setSeamEngine(carver::ENGINE_BANDED);
+         }},
+    };
+    // Seams after the first one of a batch have to avoid the earlier ones
+    // and are traced from stale energies, they may cost up to twice as
+    // much as the reference seams
+    const double batchTolerance = 1.0;
+
+    for (carver::CarveMode mode : {carver::VERTICAL, carver::HORIZONTAL}) {
+        double referenceEnergy = 0;
+        double referenceSeconds = timed([&] {
+            reference::carve(image, mode, count, referenceEnergy);
+        });
+
+        for (const ApproximateConfig &config : configs) {
+            checkApproximateConfig(verifier, name, image, mode, count,
+                                   config, referenceEnergy,
+                                   referenceSeconds);
+        }
+
+        // Batches record their seams in an order that removes them one at
+        // a time, replaying them has to give the carved result
+        carver::Carver carver;
+        carver.setSeamBatchSize(4);
+        carver.setSeamRecording(true);
+        carver.setCarveMode(mode);
+        carver.setCarveCount(count);
+        carver.setTargetImage(image);
+        cv::Mat result;
+        double seconds = timed([&] {
+            result = carver.carveImage();
+        });
+        cv::Mat replayed;
+        double removedEnergy = 0;
+        bool connected = replaySeams(
+                    image, carver.getCarvedSeams().seams[mode], mode,
+                    replayed, removedEnergy);
+        recordApproximate(verifier, "batch4/" + modeName(mode), name,
+                          batchTolerance, connected, removedEnergy,
+                          referenceEnergy, seconds, referenceSeconds,
+                          connected && identical(result, replayed));
+    }
+
+    // BOTH mode searches the two directions of an iteration at once,
+    // guides come from an exact carve of the same image
+    carver::Carver guiding;
+    guiding.setSeamRecording(true);
+    guiding.setCarveMode(carver::BOTH);
+    guiding.setCarveCount(count);
+    guiding.setTargetImage(image);
+    guiding.carveImage();
+    const carver::CarvedSeams guides = guiding.getCarvedSeams();
+    const vector<ApproximateConfig> bothConfigs = {
+        configs[3],
+        configs[4],
+        {"guided", 0.25, [&](carver::Carver &carver) {
+             carver.setSeamGuides(guides, 4);
+         }},
+    };
+    double referenceEnergy = 0;
+    double referenceSeconds = timed([&] {
+        reference::carve(image, carver::BOTH, count, referenceEnergy);
+    });
+    for (const ApproximateConfig &config : bothConfigs) {
+        checkApproximateBoth(verifier, name, image, count, config,
+                             referenceEnergy, referenceSeconds);
+    }
+}
+
+/**
+ * @brief checkLong compares fixed-point energies with the reference on a
+ * textured image over a thousand pixels long, where unscaled 16-bit
+ * cumulative energies of strong edges saturate. Vertical seams are
+ * carved from the image, horizontal ones from its transpose.
+ */
+void checkLong(Verifier &verifier, const string &name, const cv::Mat &image,
+               int count) {
+    carver::Carver carver;
+    carver.setEnergyType(carver::ENERGY_FIXED16);
+    cv::Mat grayscale;
+    cv::cvtColor(image, grayscale, cv::COLOR_BGR2GRAY);
+    cv::Mat energyMap = carver.calculateEnergy(grayscale);
+
+    // Energies are shifted down until the cheapest row or column sums to
+    // at most half of the 16-bit range
+    cv::Mat expected;
+    reference::energy(grayscale).convertTo(expected, CV_32S, 255.0);
+    double bound = numeric_limits<double>::max();
+    for (int r = 0; r < image.rows; r++)
+        bound = min(bound, cv::sum(expected.row(r))[0]);
+    double columnBound = numeric_limits<double>::max();
+    for (int c = 0; c < image.cols; c++)
+        columnBound = min(columnBound, cv::sum(expected.col(c))[0]);
+    int shift = 0;
+    while ((static_cast<int64_t>(max(bound, columnBound)) >> shift) > 0x7FFF)
+        shift++;
+    bool matches = energyMap.type() == CV_16U;
+    for (int r = 0; matches && r < image.rows; r++) {
+        for (int c = 0; c < image.cols; c++) {
+            matches = matches && energyMap.at<uint16_t>(r, c) ==
+                    (expected.at<int>(r, c) >> shift);
+        }
+    }
+    verifier.record("long/fixed16Energy", name, matches);
+
+    cv::Mat transposed;
+    cv::transpose(image, transposed);
+    for (carver::CarveMode mode : {carver::VERTICAL, carver::HORIZONTAL}) {
+        const cv::Mat &source = mode == carver::VERTICAL ? image : transposed;
+        double referenceEnergy = 0;
+        double referenceSeconds = timed([&] {
+            reference::carve(source, mode, count, referenceEnergy);
+        });
+        for (const ApproximateConfig &config : {fixed32Config,
+                                                fixed16Config}) {
+            checkApproximateConfig(verifier, name, source, mode, count,
+                                   config, referenceEnergy,
+                                   referenceSeconds, "long/");
+        }
+    }
+}
+} // namespace
+
+int run(int images, unsigned seed, ostream &out) {
+    Verifier verifier;
+    cv::RNG rng(seed);
+    for (int i = 0; i < images; i++) {
+        cv::Mat image = generateImage(rng, i % 3, i % 4 == 3);
+        string name = to_string(i) + ":" + to_string(image.cols) + "x" +
+                to_string(image.rows);
+        int count = max(1, min(8, min(image.cols, image.rows) / 4));
+
+        checkStages(verifier, name, image);
+        checkExact(verifier, name, image, count);
+        checkApproximate(verifier, name, image, count);
+        checkOutOfCore(verifier, name, image, count);
+        cerr << "Verified image " << i + 1 << "/" << images << endl;
+    }
+
+    // Long images are slow to carve with the reference, a few seams of
+    // one per four images are enough to tell saturated seams apart
+    for (int i = 0; i < (images + 3) / 4; i++) {
+        cv::Mat image = generateImage(rng, i % 2 ? 1 : 3,
+                                      rng.uniform(1024, 2048),
+                                      rng.uniform(64, 160));
+        string name = "long" + to_string(i) + ":" + to_string(image.cols) +
+                "x" + to_string(image.rows);
+        checkLong(verifier, name, image, 4);
+        cerr << "Verified long image " << i + 1 << "/" << (images + 3) / 4
+             << endl;
+    }
+
+    int failures = 0;
+    out.precision(6);
+    out << "{\n  \"images\": " << images << ",\n  \"seed\": " << seed
+        << ",\n  \"checks\": [";
+    bool first = true;
+    for (auto &entry : verifier.checks) {
+        const Check &c = entry.second;
+        failures += c.failures;
+        out << (first ? "\n    " : ",\n    ") << "{\"check\": \""
+            << entry.first << "\", \"runs\": " << c.runs
+            << ", \"failures\": " << c.failures;
+        if (c.seconds > 0)
+            out << ", \"seconds\": " << c.seconds;
+        if (c.referenceSeconds > 0)
+            out << ", \"referenceSeconds\": " << c.referenceSeconds;
+        if (c.tolerance > 0)
+            out << ", \"tolerance\": " << c.tolerance
+                << ", \"removedEnergy\": " << c.removedEnergy
+                << ", \"referenceRemovedEnergy\": " << c.referenceRemovedEnergy
+                << ", \"worstRatio\": " << c.worstRatio;
+        out << "}";
+        first = false;
+    }
+    out << "\n  ],\n  \"failed\": [";
+    for (size_t i = 0; i < verifier.failed.size(); i++) {
+        out << (i ? ",\n    " : "\n    ") << verifier.failed[i];
+    }
+    out << (verifier.failed.empty() ? "]" : "\n  ]")
+        << ",\n  \"failures\": " << failures << "\n}" << endl;
+    return failures;
+}
+} // namespace verify
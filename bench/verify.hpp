@@ -0,0 +1,23 @@
+#ifndef VERIFY_HPP
+#define VERIFY_HPP
+
+#include <ostream>
+
+using namespace std;
+namespace verify {
+
+/**
+ * @brief run checks the optimised carver against the serial reference on
+ * generated images and writes the results as a JSON object. The stages
+ * and the exact configurations have to match the reference bit for bit,
+ * threaded runs have to agree with each other. Approximate configurations
+ * have to stay within a stated tolerance of the energy the reference
+ * removes.
+ * @param images number of generated images
+ * @param seed seed of the image generator
+ * @param out target stream for the JSON results
+ * @return number of failed checks
+ */
+int run(int images, unsigned seed, ostream &out);
+} // namespace verify
+#endif // VERIFY_HPP
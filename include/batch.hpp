@@ -0,0 +1,165 @@
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <carver.hpp>
+#include <boundedqueue.hpp>
+
+using namespace std;
+namespace carver {
+
+/**
+ * @brief The BatchJob struct names the input and output file of one image
+ */
+struct BatchJob {
+    string inputPath;
+    string outputPath;
+};
+
+/**
+ * @brief The BatchResult struct summarises a batch run
+ */
+struct BatchResult {
+    int succeeded = 0;
+    // Failed jobs with the reason
+    vector<pair<BatchJob, string>> failures;
+};
+
+/**
+ * @brief The BatchCarver class carves a list of image files through a
+ * bounded pipeline of decode, carve and encode stages. Several images
+ * are carved at once; each one also uses the shared thread pool of its
+ * carver, so idle pool threads help whichever image is running.
+ * @author Joni Lepistö <joni.m.lepisto@gmail.com>
+ */
+class BatchCarver
+{
+public:
+    /**
+     * @brief BatchCarver creates a batch carver
+     * @param prototype carver whose settings are used for every image,
+     * copied once for each carving thread
+     */
+    explicit BatchCarver(const Carver &prototype);
+
+    /**
+     * @brief setVerbosity sets this class to print progress on stdout
+     * @param verbose verbosity state
+     */
+    void setVerbosity(bool verbose);
+
+    /**
+     * @brief setConcurrentImages sets how many images are carved at once
+     * @param concurrentImages number of images in the carve stage
+     */
+    void setConcurrentImages(int concurrentImages) noexcept(false);
+
+    /**
+     * @brief setIoThreadCount sets the number of threads decoding and the
+     * number of threads encoding images
+     * @param ioThreadCount threads per I/O stage
+     */
+    void setIoThreadCount(int ioThreadCount) noexcept(false);
+
+    /**
+     * @brief setQueueSize sets how many decoded or carved images may wait
+     * between two stages, which bounds the memory use of the pipeline
+     * @param queueSize images per queue
+     */
+    void setQueueSize(int queueSize) noexcept(false);
+
+    /**
+     * @brief run carves all jobs and writes the results. Failing jobs do
+     * not stop the batch.
+     * @param jobs jobs to run
+     * @return summary of the run
+     */
+    BatchResult run(const vector<BatchJob> &jobs);
+
+    /**
+     * @brief jobsFromPattern lists the images matching a directory or a
+     * glob pattern, the results are written under the output directory
+     * with their original file names
+     * @param pattern directory or glob pattern such as "photos/IMG_*.jpg"
+     * @param outputDirectory existing output directory
+     * @return jobs sorted by input path
+     */
+    static vector<BatchJob> jobsFromPattern(const string &pattern,
+                                            const string &outputDirectory);
+
+    /**
+     * @brief jobsFromManifest reads jobs from a text file holding one
+     * "input output" path pair per line. Empty lines and lines starting
+     * with # are skipped. A line with only an input path writes the result
+     * under the output directory.
+     * @param manifestPath manifest path
+     * @param outputDirectory output directory for lines without an output
+     * @return jobs in manifest order
+     */
+    static vector<BatchJob> jobsFromManifest(const string &manifestPath,
+                                             const string &outputDirectory)
+        noexcept(false);
+
+private:
+    struct Item {
+        size_t job;
+        cv::Mat image;
+    };
+
+    Carver prototype_;
+    bool verbose_ = false;
+    int concurrentImages_ = 2;
+    int ioThreadCount_ = 2;
+    int queueSize_ = 4;
+
+    mutex resultLock_;
+    atomic<int> finished_;
+
+    /**
+     * @brief decodeStage reads the images of unclaimed jobs until all jobs
+     * have been claimed
+     * @param jobs all jobs
+     * @param next index of the next unclaimed job
+     * @param decoded target queue
+     * @param result batch summary
+     */
+    void decodeStage_(const vector<BatchJob> &jobs, atomic<size_t> &next,
+                      BoundedQueue<Item> &decoded, BatchResult &result);
+
+    /**
+     * @brief carveStage carves decoded images until the decode stage has
+     * finished and its queue is empty
+     * @param jobs all jobs
+     * @param decoded source queue
+     * @param carved target queue
+     * @param result batch summary
+     */
+    void carveStage_(const vector<BatchJob> &jobs, BoundedQueue<Item> &decoded,
+                     BoundedQueue<Item> &carved, BatchResult &result);
+
+    /**
+     * @brief encodeStage writes carved images until the carve stage has
+     * finished and its queue is empty
+     * @param jobs all jobs
+     * @param carved source queue
+     * @param result batch summary
+     */
+    void encodeStage_(const vector<BatchJob> &jobs, BoundedQueue<Item> &carved,
+                      BatchResult &result);
+
+    /**
+     * @brief finish records the outcome of a job
+     * @param jobs all jobs
+     * @param job finished job
+     * @param result batch summary
+     * @param error failure reason, empty on success
+     */
+    void finish_(const vector<BatchJob> &jobs, size_t job, BatchResult &result,
+                 const string &error);
+};
+} // namespace carver
+#endif // BATCH_HPP
@@ -0,0 +1,115 @@
+#ifndef BOUNDEDQUEUE_HPP
+#define BOUNDEDQUEUE_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+using namespace std;
+namespace carver {
+
+/**
+ * @brief The BoundedQueue class is a blocking FIFO queue with a fixed
+ * capacity connecting the stages of a pipeline. Producers block while it
+ * is full and consumers while it is empty. Closing the queue wakes
+ * everyone up: pushes fail from then on and pops fail once the queue has
+ * been drained.
+ * @author Joni Lepistö <joni.m.lepisto@gmail.com>
+ */
+template<typename T>
+class BoundedQueue
+{
+public:
+    /**
+     * @brief BoundedQueue creates an empty queue
+     * @param capacity maximum number of queued items, at least 1
+     */
+    explicit BoundedQueue(size_t capacity)
+        : capacity_(capacity > 0 ? capacity : 1) {}
+
+    BoundedQueue(const BoundedQueue &) = delete;
+    BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+    /**
+     * @brief push appends an item, waiting for room if the queue is full
+     * @param item item to append
+     * @return false if the queue was closed and the item dropped
+     */
+    bool push(T item) {
+        unique_lock<mutex> lock(lock_);
+        notFull_.wait(lock, [this] {
+            return closed_ || items_.size() < capacity_;
+        });
+        if (closed_)
+            return false;
+        items_.push_back(std::move(item));
+        lock.unlock();
+        notEmpty_.notify_one();
+        return true;
+    }
+
+    /**
+     * @brief tryPush appends an item unless the queue is full
+     * @param item item to append
+     * @return false if the queue was full or closed and the item dropped
+     */
+    bool tryPush(T item) {
+        unique_lock<mutex> lock(lock_);
+        if (closed_ || items_.size() >= capacity_)
+            return false;
+        items_.push_back(std::move(item));
+        lock.unlock();
+        notEmpty_.notify_one();
+        return true;
+    }
+
+    /**
+     * @brief pop removes the oldest item, waiting for one if the queue is
+     * empty
+     * @param item target for the removed item
+     * @return false if the queue was closed and is empty
+     */
+    bool pop(T &item) {
+        unique_lock<mutex> lock(lock_);
+        notEmpty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+        if (items_.empty())
+            return false;
+        item = std::move(items_.front());
+        items_.pop_front();
+        lock.unlock();
+        notFull_.notify_one();
+        return true;
+    }
+
+    /**
+     * @brief close stops accepting items, the queued ones can still be
+     * popped
+     */
+    void close() {
+        {
+            lock_guard<mutex> lock(lock_);
+            closed_ = true;
+        }
+        notFull_.notify_all();
+        notEmpty_.notify_all();
+    }
+
+    /**
+     * @brief size returns the number of queued items
+     * @return queue depth
+     */
+    size_t size() const {
+        lock_guard<mutex> lock(lock_);
+        return items_.size();
+    }
+
+private:
+    mutable mutex lock_;
+    condition_variable notFull_;
+    condition_variable notEmpty_;
+    deque<T> items_;
+    size_t capacity_;
+    bool closed_ = false;
+};
+} // namespace carver
+#endif // BOUNDEDQUEUE_HPP
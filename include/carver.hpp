@@ -5,16 +5,170 @@
 #include <opencv2/core/core.hpp>
 
 #include <string>
+#include <cstring>
 #include <iostream>
-#include <future>
+#include <memory>
+#include <limits>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <stdexcept>
 
-#define CONCURRENT
-#define N_THREADS 2
+#include <threadpool.hpp>
+#include <dpkernel.hpp>
+#include <carverstats.hpp>
+#include <workspace.hpp>
 
 using namespace std;
 namespace carver {
 enum CarveMode {VERTICAL, HORIZONTAL, BOTH};
 
+class SeamIndexMap;
+
+/**
+ * @brief EnergyType selects the element type of the energy and
+ * cumulative energy maps. Floating point energies are scaled to 0-1,
+ * fixed-point energies keep the 0-255 gradient magnitude and their sums
+ * saturate. 16-bit energies are shifted down by a power of two when the
+ * cheapest straight line across the image sums to more than half of
+ * their range, which costs a bit of precision per halving. The shift is
+ * picked at the start of a carve, seams growing to more than twice that
+ * line can still saturate. 32-bit sums saturate only on images over 8
+ * million pixels long.
+ */
+enum EnergyType {ENERGY_DOUBLE, ENERGY_FLOAT, ENERGY_FIXED16, ENERGY_FIXED32};
+
+/**
+ * @brief SeamEngine selects how seams are searched. ENGINE_EXACT runs the
+ * cumulative energy DP over the whole energy map. ENGINE_PYRAMID runs it
+ * on a downsampled energy pyramid and refines the seam inside a narrow
+ * band on every finer level, which is approximate but much cheaper on
+ * large images. ENGINE_BANDED runs it only in a band around the previous
+ * seam of the same direction and falls back to the full search when the
+ * band's best seam is clearly worse than the last full search found.
+ */
+enum SeamEngine {ENGINE_EXACT, ENGINE_PYRAMID, ENGINE_BANDED};
+
+/**
+ * @brief The CarvedSeams struct lists the seams removed by a carve in
+ * removal order, indexed by direction. Every seam is given in the
+ * coordinates of the image it was removed from, along with its energy
+ * there.
+ */
+struct CarvedSeams {
+    vector<vector<int>> seams[2];
+    vector<double> costs[2];
+};
+
+/**
+ * @brief The CarveProgress struct describes a running carve
+ */
+struct CarveProgress {
+    // Iterations done and seams left to remove in both directions
+    int iteration = 0;
+    int seamsRemaining = 0;
+    // Seconds since the carve started and estimated until it finishes
+    double elapsed = 0;
+    double remaining = 0;
+    // Seams replaced by a plain resize when carving stopped early, only
+    // set once the carve has finished
+    int resizedSeams = 0;
+};
+
+/**
+ * @brief CarveStop tells why a carve stopped carving before removing all
+ * seams and resized the rest away: STOP_SEAM_COST once a seam was more
+ * expensive than the hybrid threshold, STOP_SEAM_BUDGET once the seam
+ * budget was used up and STOP_TIME when the deadline or the time budget
+ * neared.
+ */
+enum CarveStop {STOP_NONE, STOP_SEAM_COST, STOP_SEAM_BUDGET, STOP_TIME};
+
+/**
+ * @brief The CarveSplit struct tells how the last carve reached its
+ * result size
+ */
+struct CarveSplit {
+    int carvedSeams = 0;
+    int resizedSeams = 0;
+    CarveStop stop = STOP_NONE;
+};
+
+/**
+ * @brief The CancelToken class stops carves from another thread. Copies
+ * share their state: cancelling any of them stops every carve watching
+ * one at its next stage boundary.
+ * @author Joni Lepistö <joni.m.lepisto@gmail.com>
+ */
+class CancelToken
+{
+public:
+    CancelToken() : cancelled_(make_shared<atomic<bool>>(false)) {}
+
+    /**
+     * @brief cancel asks the carves watching this token to stop
+     */
+    void cancel() {
+        *cancelled_ = true;
+    }
+
+    /**
+     * @brief cancelled tells whether the token has been cancelled
+     * @return cancellation state
+     */
+    bool cancelled() const {
+        return *cancelled_;
+    }
+
+private:
+    shared_ptr<atomic<bool>> cancelled_;
+};
+
+/**
+ * @brief The CarveCancelled class is thrown by carves stopped through
+ * their CancelToken
+ */
+class CarveCancelled : public runtime_error
+{
+public:
+    CarveCancelled() : runtime_error("Carve cancelled") {}
+};
+
+/**
+ * @brief The SeamAxis struct maps seam coordinates onto the image for
+ * one seam direction. A seam crosses the image line by line and has a
+ * position on every line: vertical seams have a column on every row,
+ * horizontal seams a row on every column.
+ */
+template<CarveMode direction> struct SeamAxis;
+
+template<> struct SeamAxis<VERTICAL> {
+    // Neighbour preferred on ties, relative to the current position
+    static const int tieOffset = -1;
+
+    static int length(const cv::Mat &m) { return m.rows; }
+    static int width(const cv::Mat &m) { return m.cols; }
+
+    template<typename T>
+    static T &at(cv::Mat &m, int line, int position) {
+        return m.ptr<T>(line)[position];
+    }
+};
+
+template<> struct SeamAxis<HORIZONTAL> {
+    // Ties resolve towards the bottom of the image, which matches vertical
+    // seams on the image rotated clockwise
+    static const int tieOffset = 1;
+
+    static int length(const cv::Mat &m) { return m.cols; }
+    static int width(const cv::Mat &m) { return m.rows; }
+
+    template<typename T>
+    static T &at(cv::Mat &m, int line, int position) {
+        return m.ptr<T>(position)[line];
+    }
+};
+
 /**
  * @brief The Carver class is responsible for all the mathematical
  * operations needed for image carving
@@ -29,15 +183,70 @@ public:
      */
     void setVerbosity(bool verbose);
 
+    /**
+     * @brief setThreadCount gives this carver a private thread pool
+     * @param threadCount total number of threads used for carving,
+     * including the calling thread
+     */
+    void setThreadCount(int threadCount) noexcept(false);
+
+    /**
+     * @brief setThreadPool makes this carver submit its parallel work to
+     * the given pool, which may be shared between carvers
+     * @param threadPool thread pool to use
+     */
+    void setThreadPool(shared_ptr<ThreadPool> threadPool) noexcept(false);
+
     /**
      * @brief imread loads the given image as the carving target
      * @param filepath image path
+     * @param overwrite carve the loaded pixels in place, which saves a
+     * copy but consumes them, see setTargetImage()
      * @return true if image loading succeeded
      */
-    bool loadTargetImage(string filepath);
+    bool loadTargetImage(string filepath, bool overwrite = false);
 
     /**
-     * @brief setCarveMode sets carve mode for the target
+     * @brief decodeTargetImage decodes an encoded image, such as the
+     * contents of a PNG or JPEG file, as the carving target
+     * @param data encoded image
+     * @param size encoded image size in bytes
+     * @param overwrite carve the decoded pixels in place, see
+     * loadTargetImage()
+     * @return true if image decoding succeeded
+     */
+    bool decodeTargetImage(const uchar *data, size_t size,
+                           bool overwrite = false);
+
+    /**
+     * @brief setTargetImage sets an already decoded image as the carving
+     * target. The pixels are shared with the caller, not copied.
+     * @param image 8-bit BGR image
+     * @param overwrite carve the caller's pixels in place instead of a
+     * copy. The image is then consumed by the next carve: its pixels are
+     * overwritten, the result shares its buffer and it has to be set again
+     * before carving again.
+     */
+    void setTargetImage(cv::Mat image, bool overwrite = false)
+        noexcept(false);
+
+    /**
+     * @brief setTargetImage sets a caller-owned pixel buffer as the
+     * carving target without copying it
+     * @param data first pixel of 8-bit BGR pixels
+     * @param cols image width
+     * @param rows image height
+     * @param step bytes between the starts of two rows
+     * @param overwrite carve the caller's pixels in place, see above
+     */
+    void setTargetImage(uchar *data, int cols, int rows, size_t step,
+                        bool overwrite = false) noexcept(false);
+
+    /**
+     * @brief setCarveMode sets carve mode for the target. In BOTH mode
+     * every iteration removes whichever of the minimum energy vertical
+     * and horizontal seams has less energy, ties going to the vertical
+     * one, until a direction has all its seams removed.
      * @param carveMode carve mode to set
      */
     void setCarveMode(CarveMode carveMode) noexcept(false);
@@ -56,6 +265,186 @@ public:
      */
     void setCarveCount(int carveCount) noexcept(false);
 
+    /**
+     * @brief setIncrementalEnergy sets whether the grayscale and energy
+     * maps are kept across iterations and only recomputed around the
+     * removed seam. The result is identical to a full recompute.
+     * @param incrementalEnergy incremental energy state
+     */
+    void setIncrementalEnergy(bool incrementalEnergy);
+
+    /**
+     * @brief setIncrementalCumulativeEnergy sets whether the cumulative
+     * energy map is kept across iterations and only recomputed inside the
+     * removed seam's cone of influence. The result is identical to a full
+     * recompute.
+     * @param incrementalCumulativeEnergy incremental cumulative energy state
+     */
+    void setIncrementalCumulativeEnergy(bool incrementalCumulativeEnergy);
+
+    /**
+     * @brief setEnergyType sets the element type used for the energy and
+     * cumulative energy maps. Smaller types cut memory traffic and fit
+     * more cells in a vector register. 16-bit fixed-point energies lose
+     * precision on long images with strong edges throughout, see
+     * EnergyType, and are best kept to images of a few thousand pixels.
+     * @param energyType energy type
+     */
+    void setEnergyType(EnergyType energyType);
+
+    /**
+     * @brief setSeamEngine sets the seam search engine used by carving and
+     * getSeamToRemove()
+     * @param seamEngine seam engine
+     */
+    void setSeamEngine(SeamEngine seamEngine);
+
+    /**
+     * @brief setBandWidth sets how far ENGINE_BANDED searches from the
+     * previous seam
+     * @param bandWidth positions searched on each side of the previous
+     * seam, at least 1
+     */
+    void setBandWidth(int bandWidth) noexcept(false);
+
+    /**
+     * @brief setBandMargin sets how much more a banded seam may cost than
+     * the seam of the last full search before ENGINE_BANDED searches the
+     * full width again
+     * @param bandMargin allowed cost increase relative to the last full
+     * search, 0.1 allows 10 %
+     */
+    void setBandMargin(double bandMargin) noexcept(false);
+
+    /**
+     * @brief setSeamBatchSize sets how many seams are taken from a single
+     * cumulative energy map. Batches larger than one trace up to that
+     * many pixel-disjoint, non-crossing seams from the back-pointers,
+     * remove them in one pass and recompute the energy once. Seams after
+     * the first one are approximate, trading quality for fewer
+     * iterations. Batch seams are counted and recorded like single ones,
+     * in an order that removes them one at a time.
+     * @param seamBatchSize number of seams per iteration, at least 1
+     */
+    void setSeamBatchSize(int seamBatchSize) noexcept(false);
+
+    /**
+     * @brief setProgressCallback sets a function called on the carving
+     * thread after every iteration of a carve and once more when it ends
+     * @param progressCallback callback, or an empty function for none
+     */
+    void setProgressCallback(
+            function<void(const CarveProgress &)> progressCallback);
+
+    /**
+     * @brief setCancelToken makes carves watch the given token and throw
+     * CarveCancelled once it has been cancelled. Copies of this carver
+     * watch the same token.
+     * @param cancelToken token to watch
+     */
+    void setCancelToken(const CancelToken &cancelToken);
+
+    /**
+     * @brief setDeadline sets a point in time carves have to end by.
+     * Seams are carved as long as there is time for another iteration,
+     * the rest are removed by scaling the image down with cv::resize.
+     * @param deadline deadline of the following carves
+     */
+    void setDeadline(chrono::steady_clock::time_point deadline);
+
+    /**
+     * @brief clearDeadline lets the following carves run to completion
+     */
+    void clearDeadline();
+
+    /**
+     * @brief setHybridThreshold makes carves stop carving once the removed
+     * seam's mean energy exceeds a threshold and reach the result size by
+     * resizing instead. Seams that expensive cut through content anyway,
+     * so large reductions keep most of the quality of carving at a
+     * fraction of its time.
+     * @param threshold mean seam energy relative to the full range (0-1],
+     * 0 to carve every seam
+     */
+    void setHybridThreshold(double threshold) noexcept(false);
+
+    /**
+     * @brief setSeamBudget bounds the seams a carve removes by carving,
+     * the rest are resized away. The budget is checked between
+     * iterations, so seam batches may go a little over it.
+     * @param seamBudget seams carved at most, 0 for no budget
+     */
+    void setSeamBudget(int seamBudget) noexcept(false);
+
+    /**
+     * @brief setTimeBudget bounds the duration of each carve like a
+     * deadline counted from its start, see setDeadline()
+     * @param seconds duration of a carve, 0 for no budget
+     */
+    void setTimeBudget(double seconds) noexcept(false);
+
+    /**
+     * @brief getCarveSplit returns how many seams the last carve carved
+     * and resized away and why it stopped carving
+     * @return split of the last carve
+     */
+    CarveSplit getCarveSplit() const;
+
+    /**
+     * @brief setMemoryLimit bounds the memory a carve may use besides the
+     * target and result images. Targets whose in-memory working set, see
+     * getWorkspaceSize(), would exceed the limit are carved out of core:
+     * their pixels, energies and back-pointers go into a scratch file that
+     * is processed a strip of rows at a time, see TiledCarver. Out-of-core
+     * carves always use the exact engine with 8-bit energies summed in
+     * 32 bits, in BOTH mode remove all vertical seams first, and neither
+     * record seams nor follow seam guides. The decoded target and the
+     * result are not covered by the limit: peak memory is the target, the
+     * result and the limit, or the target and the limit when the target
+     * is overwritten, since the result then reuses its buffer.
+     * @param memoryLimit limit in bytes, 0 for no limit
+     */
+    void setMemoryLimit(size_t memoryLimit);
+
+    /**
+     * @brief setScratchDirectory sets where out-of-core carves keep their
+     * scratch files, by default $TMPDIR or /tmp
+     * @param scratchDirectory existing directory
+     */
+    void setScratchDirectory(const string &scratchDirectory) noexcept(false);
+
+    /**
+     * @brief setSeamRecording sets whether carves record the seams they
+     * remove, see getCarvedSeams()
+     * @param record recording state
+     */
+    void setSeamRecording(bool record);
+
+    /**
+     * @brief getCarvedSeams returns the seams removed by the last carve
+     * while recording was enabled
+     * @return removed seams
+     */
+    const CarvedSeams &getCarvedSeams() const;
+
+    /**
+     * @brief setSeamGuides makes the following carves search every seam
+     * only within a band around the seam removed at the same step by a
+     * guiding carve of an image of the same size, such as the previous
+     * frame of a video. A guided seam that costs more than the band
+     * margin over its guide, or has no guide, is searched in full with
+     * the selected engine. Seam batches are never guided.
+     * @param guides seams of the guiding carve, see getCarvedSeams()
+     * @param band positions searched on each side of a guide, at least 1
+     */
+    void setSeamGuides(const CarvedSeams &guides, int band) noexcept(false);
+
+    /**
+     * @brief clearSeamGuides makes the following carves search every seam
+     * in full again
+     */
+    void clearSeamGuides();
+
     /**
      * @brief carveImage runs the carving iterations and returns
      * the reduced image
@@ -69,9 +458,69 @@ public:
      */
     void carveImage(string outputPath);
 
+    /**
+     * @brief carveImage runs the carving iterations and writes the result
+     * into a caller-owned buffer
+     * @param data first pixel of a buffer holding getResultSize() 8-bit
+     * BGR pixels
+     * @param step bytes between the starts of two rows in the buffer
+     */
+    void carveImage(uchar *data, size_t step);
+
+    /**
+     * @brief carveImageEncoded runs the carving iterations and encodes the
+     * result in memory
+     * @param extension image format, such as ".png" or ".jpg"
+     * @param buffer target for the encoded image
+     * @return true if image encoding succeeded
+     */
+    bool carveImageEncoded(const string &extension, vector<uchar> &buffer);
+
+    /**
+     * @brief getResultSize returns the size of the image carveImage() will
+     * produce with the current target and settings
+     * @return result size
+     */
+    cv::Size getResultSize() noexcept(false);
+
+    /**
+     * @brief getWorkspaceSize returns the number of bytes of working
+     * buffers carving the current target with the current settings takes.
+     * They are allocated once when a carve starts, on top of the copy of
+     * the target image, and reused by later carves of images no larger.
+     * @return workspace size in bytes
+     */
+    size_t getWorkspaceSize() noexcept(false);
+
+    /**
+     * @brief getStats returns the stage timings and counters recorded
+     * since construction or the last resetStats(). Only recorded when the
+     * library is built with CARVER_STATS.
+     * @return statistics
+     */
+    CarverStats getStats() const;
+
+    /**
+     * @brief resetStats clears the recorded statistics
+     */
+    void resetStats();
+
+    /**
+     * @brief buildSeamIndexMap carves the target image in one direction
+     * and records the order in which its pixels were removed. The image
+     * can then be retargeted to any size up to the given number of seams
+     * with SeamIndexMap::retarget(). Declared in seamindexmap.hpp.
+     * @param direction seam direction, VERTICAL or HORIZONTAL
+     * @param seamCount number of seams to record
+     * @return seam index map of the target image
+     */
+    SeamIndexMap buildSeamIndexMap(CarveMode direction, int seamCount)
+        noexcept(false);
+
     /**
      * @brief calculateEnergy calculates energy map for the given image
-     * using crossed sobel filters
+     * using crossed sobel filters, with the fused energy kernel unless
+     * the blur is configured differently
      * @param source source grayscale image
      * @return energy map
      */
@@ -100,62 +549,119 @@ public:
      * @param energyMap energy map for the image
      * @param direction seam direction, VERTICAL or HORIZONTAL
      * @return vector containing the indices for the lowest energy path in
-     * the given direction
+     * the given direction: the column of every row for VERTICAL seams and
+     * the row of every column for HORIZONTAL seams
      */
     vector<int> getSeamToRemove(cv::Mat &energyMap, CarveMode direction);
 
     /**
      * @brief removeSeam removes the given seam from the image from
-     * top to bottom
-     * @param source source image
+     * top to bottom in place. Each row tail is shifted left by one pixel
+     * and the logical width shrinks while the row stride stays fixed.
+     * @param source source image, modified
      * @param seam vertical seam indices
-     * @return reduced target image
+     * @return reduced target image sharing the source buffer
      */
-    cv::Mat removeSeam(cv::Mat &source, vector<int> seam);
+    cv::Mat removeSeam(cv::Mat &source, const vector<int> &seam);
 
     /**
      * @brief removeSeams removes the given seams from the source image
-     * and returns a reduced version
-     * @param source source image
+     * in place and returns a reduced version
+     * @param source source image, modified
      * @param verticalSeam vertical seam indices
      * @param horizontalSeam horizontal seam indices
      * @return reduced target image
      */
     cv::Mat removeSeams(cv::Mat &source,
-                        vector<int> verticalSeam,
-                        vector<int> horizontalSeam);
+                        const vector<int> &verticalSeam,
+                        const vector<int> &horizontalSeam);
 
     /**
      * @brief removeVerticalSeam removes the given vertical seam from
-     * the source image and returns a reduced version
-     * @param source source image
+     * the source image in place and returns a reduced version
+     * @param source source image, modified
      * @param verticalSeam vertical seam indices
-     * @return reduced target image
+     * @return reduced target image sharing the source buffer
      */
     cv::Mat removeVerticalSeam(cv::Mat &source,
-                               vector<int> verticalSeam);
+                               const vector<int> &verticalSeam);
 
     /**
      * @brief removeHorizontalSeam removes the given horizontal seam from
-     * the source image and returns a reduced version
-     * @param source source image
+     * the source image in place and returns a reduced version
+     * @param source source image, modified
      * @param horizontalSeam horizontal seam indices
-     * @return reduced target image
+     * @return reduced target image sharing the source buffer
      */
     cv::Mat removeHorizontalSeam(cv::Mat &source,
-                                 vector<int> horizontalSeam);
+                                 const vector<int> &horizontalSeam);
 
 private:
     // Variables
     cv::Mat originalImage_;
-    CarveMode carveMode_;
+    // Carve the original in place instead of a copy
+    bool overwriteTarget_ = false;
+    CarveMode carveMode_ = BOTH;
     bool verbose_ = false;
-    float carveAmount_;
-    int imageRows_;
-    int imageCols_;
-    int vIterations_;
-    int hIterations_;
-    int carveCount_;
+    bool incrementalEnergy_ = true;
+    bool incrementalCumulativeEnergy_ = true;
+    EnergyType energyType_ = ENERGY_DOUBLE;
+    // Bits 16-bit energies of the current carve are shifted down by
+    int energyShift_ = 0;
+    int seamBatchSize_ = 1;
+    SeamEngine seamEngine_ = ENGINE_EXACT;
+    int bandWidth_ = 32;
+    double bandMargin_ = 0.1;
+
+    // Previous seam and last full search cost of ENGINE_BANDED, indexed
+    // by direction
+    vector<int> lastSeams_[2];
+    double seamCostBounds_[2] = {0, 0};
+
+    // Seams removed by the last carve, guides of the following ones and
+    // the number of seams searched so far in each direction
+    bool recordSeams_ = false;
+    CarvedSeams carvedSeams_;
+    CarvedSeams seamGuides_;
+    int guideBand_ = 0;
+    int seamCounts_[2] = {0, 0};
+
+    // Progress reporting, cancellation and the deadline of carves
+    function<void(const CarveProgress &)> progressCallback_;
+    CancelToken cancelToken_;
+    bool hasDeadline_ = false;
+    chrono::steady_clock::time_point deadline_;
+
+    // Hybrid carving: limits after which the rest is resized, the mean
+    // energy of the latest seam in each direction relative to the full
+    // range and the split of the last carve
+    double hybridThreshold_ = 0;
+    int seamBudget_ = 0;
+    double timeBudget_ = 0;
+    double seamEnergies_[2] = {0, 0};
+    CarveSplit carveSplit_;
+
+    // Out-of-core carving, see setMemoryLimit()
+    size_t memoryLimit_ = 0;
+    string scratchDirectory_;
+
+    // Instrumentation, see carverstats.hpp
+    StatsRecorder stats_;
+
+    // Buffers the carving loop works in, see workspace.hpp
+    Workspace workspace_;
+
+    // Cumulative energy maps and their back-pointer maps kept across
+    // iterations, indexed by direction
+    cv::Mat cumulativeEnergyMaps_[2];
+    cv::Mat directionMaps_[2];
+    float carveAmount_ = 0.15f;
+    int imageRows_ = 0;
+    int imageCols_ = 0;
+    int vIterations_ = 0;
+    int hIterations_ = 0;
+    int carveCount_ = 0;
+    shared_ptr<ThreadPool> threadPool_ = ThreadPool::sharedPool();
 
     // Image processing configuration
     bool blur_ = true;
@@ -163,13 +669,20 @@ private:
     const static int sobelDelta_ = 0;
     const static int sobelScale_ = 1;
 
-    /**
-     * @brief findMinOffset locates the minimum entry from the given
-     * nexthop vector and returns an offset value
-     * @param nextHops nexthop values
-     * @return offset value: -1, 0 or 1.
-     */
-    int findMinOffset_(vector<double> nextHops);
+    // Incremental energy updates recompute the seam neighbourhood in
+    // strips of this many rows (or columns for horizontal seams)
+    constexpr static int energyStripSize_ = 32;
+
+    // Cumulative energy tiling: each worker owns a column chunk at least
+    // this wide and processes rows in bands of at most maxBandHeight_ rows
+    constexpr static int minChunkWidth_ = 64;
+    constexpr static int maxBandHeight_ = 32;
+
+    // Pyramid seam search: levels are added while both sides of the
+    // coarsest one are at least twice this size, and the seam is refined
+    // within this many pixels of its projection on every finer level
+    constexpr static int pyramidMinSize_ = 128;
+    constexpr static int pyramidBand_ = 4;
 
     /**
      * @brief log prints out message with a newline
@@ -186,26 +699,518 @@ private:
     void log_(string message, bool overwrite);
 
     /**
-     * @brief calculateCumulativePixel calculates cumulative energy
-     * for a single pixel
-     * @param r row
-     * @param c column
+     * @brief calculateCumulativeLine calculates cumulative energies and
+     * back-pointers for the positions [j0, j1) of a single seam line
+     * @param i line
+     * @param j0 start position
+     * @param j1 end position
+     * @param energyMap energy map used for the calculation
+     * @param cumulativeEnergyMap target cumulative energy map, line i is
+     * stored at i modulo its length
+     * @param directionMap target back-pointer map
+     */
+    template<CarveMode direction, typename T>
+    void calculateCumulativeLine_(int i, int j0, int j1, cv::Mat &energyMap,
+                                  cv::Mat &cumulativeEnergyMap,
+                                  cv::Mat &directionMap);
+
+    /**
+     * @brief calculateCumulativeTrapezoid calculates cumulative energies
+     * for the position chunk [j0, j1) of the line band [i0, i1). Every
+     * line loses one position on each inner chunk edge as those cells
+     * depend on the neighbouring chunks.
+     * @param j0 chunk start position
+     * @param j1 chunk end position
+     * @param i0 band start line
+     * @param i1 band end line
      * @param energyMap energy map used for the calculation
      * @param cumulativeEnergyMap target cumulative energy map
+     * @param directionMap target back-pointer map
      */
-    void calculateCumulativePixel_(int r, int c, cv::Mat &energyMap,
-                                  cv::Mat &cumulativeEnergyMap);
+    template<CarveMode direction, typename T>
+    void calculateCumulativeTrapezoid_(int j0, int j1, int i0, int i1,
+                                       cv::Mat &energyMap,
+                                       cv::Mat &cumulativeEnergyMap,
+                                       cv::Mat &directionMap);
 
     /**
-     * @brief calculateCumulativePixelRange calculates cumulative energies
-     * for a range of rows
-     * @param r0 start row
-     * @param r1 end row
+     * @brief calculateCumulativeTriangle fills the cells left out by the
+     * trapezoids on both sides of the chunk boundary j
+     * @param j chunk boundary position
+     * @param i0 band start line
+     * @param i1 band end line
      * @param energyMap energy map used for the calculation
      * @param cumulativeEnergyMap target cumulative energy map
+     * @param directionMap target back-pointer map
+     */
+    template<CarveMode direction, typename T>
+    void calculateCumulativeTriangle_(int j, int i0, int i1,
+                                      cv::Mat &energyMap,
+                                      cv::Mat &cumulativeEnergyMap,
+                                      cv::Mat &directionMap);
+
+    /**
+     * @brief calculateCumulativeEnergy calculates cumulative energy along
+     * the given direction directly on the row-major energy map, recording
+     * for every cell the position offset of the upper neighbour it
+     * continues from. The version without a type parameter dispatches on
+     * the energy map type.
+     * @param energyMap energy map
+     * @param directionMap target back-pointer map, CV_8S of the energy
+     * map size
+     * @param rolling keep only the last few lines of the cumulative map,
+     * enough for the tiled pass and for locating the seam end
+     * @param cumulative workspace buffer of the cumulative map,
+     * BUFFER_COUNT to allocate it
+     * @param directions workspace buffer of the back-pointer map,
+     * BUFFER_COUNT to allocate it
+     * @return cumulative energy map, or its last lines when rolling
+     */
+    template<CarveMode direction, typename T>
+    cv::Mat calculateCumulativeEnergy_(
+            cv::Mat &energyMap, cv::Mat &directionMap, bool rolling,
+            WorkspaceBuffer cumulative = BUFFER_COUNT,
+            WorkspaceBuffer directions = BUFFER_COUNT);
+    template<CarveMode direction>
+    cv::Mat calculateCumulativeEnergy_(
+            cv::Mat &energyMap, cv::Mat &directionMap, bool rolling,
+            WorkspaceBuffer cumulative = BUFFER_COUNT,
+            WorkspaceBuffer directions = BUFFER_COUNT);
+
+    /**
+     * @brief calculateLowestEnergyPath backtracks the lowest energy seam
+     * in the given direction by comparing the upper neighbours on every
+     * line. The single parameter version dispatches on the cumulative
+     * energy map type.
+     * @param cumulativeEnergyMap full cumulative energy map
+     * @return seam indices as returned by getSeamToRemove
+     */
+    template<CarveMode direction, typename T>
+    vector<int> calculateLowestEnergyPath_(cv::Mat &cumulativeEnergyMap);
+    template<CarveMode direction>
+    vector<int> calculateLowestEnergyPath_(cv::Mat &cumulativeEnergyMap);
+
+    /**
+     * @brief backtrackSeam follows the back-pointers from the lowest
+     * energy seam end. The version without a type parameter dispatches on
+     * the cumulative energy map type.
+     * @param cumulativeEnergyMap full or rolling cumulative energy map
+     * @param directionMap back-pointer map
+     * @param path target seam indices as returned by getSeamToRemove,
+     * resized to the seam length
+     */
+    template<CarveMode direction, typename T>
+    void backtrackSeam_(cv::Mat &cumulativeEnergyMap, cv::Mat &directionMap,
+                        vector<int> &path);
+    template<CarveMode direction>
+    void backtrackSeam_(cv::Mat &cumulativeEnergyMap, cv::Mat &directionMap,
+                        vector<int> &path);
+
+    /**
+     * @brief findSeams traces up to count pixel-disjoint, non-crossing
+     * seams from a single cumulative energy map, cheapest seam end first
+     * @param energyMap energy map for the image
+     * @param count maximum number of seams
+     * @return seams as returned by getSeamToRemove, at least one
+     */
+    template<CarveMode direction, typename T>
+    vector<vector<int>> findSeams_(cv::Mat &energyMap, int count);
+
+    /**
+     * @brief carveBatch removes a batch of seams from the target image and
+     * brings the grayscale and energy maps up to date
+     * @param target target image, modified
+     * @param grayscale grayscale map of the target
+     * @param energyMap energy map of the target
+     * @param count maximum number of seams to remove
+     * @return number of seams removed
+     */
+    template<CarveMode direction>
+    int carveBatch_(cv::Mat &target, cv::Mat &grayscale, cv::Mat &energyMap,
+                    int count);
+
+    /**
+     * @brief removeSeams removes the given pixel-disjoint seams in place
+     * in a single pass over the image
+     * @param source source image, modified
+     * @param seams seam indices
+     * @return reduced target image sharing the source buffer
+     */
+    template<CarveMode direction>
+    cv::Mat removeSeams_(cv::Mat &source, const vector<vector<int>> &seams);
+
+    /**
+     * @brief sortedSeamPositions gathers the positions of all seams on
+     * every line in ascending order
+     * @param seams seam indices
+     * @param length number of lines
+     * @return positions of line i at [i * seams, (i + 1) * seams)
+     */
+    vector<int> sortedSeamPositions_(const vector<vector<int>> &seams,
+                                     int length);
+
+    /**
+     * @brief calculateBandedPath finds the lowest energy seam that stays
+     * within halfWidth positions of the given centre on every line. The
+     * band is searched in the band buffers of the workspace.
+     * @param energyMap energy map
+     * @param centre band centre on every line, consecutive centres at
+     * most halfWidth positions apart
+     * @param halfWidth band half width
+     * @param path target for the seam indices, not the centre
+     * @return cumulative energy of the seam
+     */
+    template<CarveMode direction, typename T>
+    double calculateBandedPath_(cv::Mat &energyMap,
+                                const vector<int> &centre, int halfWidth,
+                                vector<int> &path);
+
+    /**
+     * @brief calculateExactPath finds the lowest energy seam with a full
+     * cumulative energy pass, which only lives in the search buffers of
+     * the workspace until the next search
+     * @param energyMap energy map
+     * @param path target for the seam indices
+     */
+    template<CarveMode direction>
+    void calculateExactPath_(cv::Mat &energyMap, vector<int> &path);
+
+    /**
+     * @brief calculatePyramidPath finds the seam on the coarsest level of
+     * an energy pyramid and refines it level by level inside a band around
+     * its projection
+     * @param energyMap energy map
+     * @param path target for the seam indices
+     */
+    template<CarveMode direction, typename T>
+    void calculatePyramidPath_(cv::Mat &energyMap, vector<int> &path);
+
+    /**
+     * @brief calculateLocalPath finds the lowest energy seam near the
+     * previous one, searching the full width when there is no previous
+     * seam or the banded seam costs too much
+     * @param energyMap energy map
+     * @param path target for the seam indices
+     */
+    template<CarveMode direction, typename T>
+    void calculateLocalPath_(cv::Mat &energyMap, vector<int> &path);
+
+    /**
+     * @brief nextSeam finds the next seam to remove with the selected
+     * seam engine
+     * @param energyMap energy map for the image
+     * @param cached keep the exact engine's cumulative energy map for
+     * incremental updates
+     * @param seam target seam indices as returned by getSeamToRemove
+     */
+    template<CarveMode direction>
+    void nextSeam_(cv::Mat &energyMap, bool cached, vector<int> &seam);
+
+    /**
+     * @brief searchSeam finds the next seam of a carve, within the band
+     * around its guide when there is a usable one and with nextSeam()
+     * otherwise
+     * @param energyMap energy map for the image
+     * @param seam target seam indices as returned by getSeamToRemove
+     * @return seam energy
+     */
+    template<CarveMode direction>
+    double searchSeam_(cv::Mat &energyMap, vector<int> &seam);
+
+    /**
+     * @brief commitSeam counts a seam found by searchSeam() as removed and
+     * records it when recording is enabled
+     * @param energyMap energy map the seam was found in
+     * @param seam seam to be removed
+     * @param cost seam energy
+     */
+    template<CarveMode direction>
+    void commitSeam_(const cv::Mat &energyMap, const vector<int> &seam,
+                     double cost);
+
+    /**
+     * @brief seamCost sums the energies along a seam
+     * @param energyMap energy map
+     * @param seam seam indices as returned by getSeamToRemove
+     * @return seam energy
+     */
+    template<CarveMode direction>
+    double seamCost_(cv::Mat &energyMap, const vector<int> &seam);
+
+    /**
+     * @brief releaseCumulativeEnergy drops the cumulative energy and
+     * back-pointer maps kept for the direction
+     * @param direction seam direction, VERTICAL or HORIZONTAL
+     */
+    void releaseCumulativeEnergy_(CarveMode direction);
+
+    /**
+     * @brief removeSeam removes the given seam in place
+     * @param source source image, modified
+     * @param seam seam indices
+     * @return reduced target image sharing the source buffer
+     */
+    template<CarveMode direction>
+    cv::Mat removeSeam_(cv::Mat &source, const vector<int> &seam);
+
+    /**
+     * @brief calculateIterations sets the number of seams to remove in
+     * each direction
+     */
+    void calculateIterations_() noexcept(false);
+
+    /**
+     * @brief fusedEnergy tells whether the energy configuration is the one
+     * the fused energy kernel implements
+     * @return true if energies can be calculated with fusedEnergy()
+     */
+    bool fusedEnergy_() const;
+
+    /**
+     * @brief energyDepth returns the OpenCV depth of the energy maps
+     * @return depth matching the energy type
+     */
+    int energyDepth_() const;
+
+    /**
+     * @brief fitFixedEnergy picks how many bits 16-bit energies are
+     * shifted down by for the rest of a carve, so that the cheapest seams
+     * stay clear of saturation, and shifts the given map accordingly
+     * @param energyMap unshifted energy map of the whole image, left as is
+     * for other energy types
+     */
+    void fitFixedEnergy_(cv::Mat &energyMap);
+
+    /**
+     * @brief calculateMaps calculates the grayscale and energy maps of the
+     * target, in a single pass over the target where possible. The
+     * grayscale map is released when energies are not updated
+     * incrementally.
+     * @param target target image
+     * @param grayscale grayscale map of the target
+     * @param energyMap energy map of the target
+     */
+    void calculateMaps_(cv::Mat &target, cv::Mat &grayscale,
+                        cv::Mat &energyMap);
+
+    /**
+     * @brief calculateEnergy calculates the energy map of a grayscale
+     * image into the given matrix, which is kept if it already has the
+     * right size and type
+     * @param source source grayscale image
+     * @param target target energy map
+     */
+    void calculateEnergy_(cv::Mat &source, cv::Mat &target);
+
+    /**
+     * @brief workspaceBytes returns the size a workspace buffer needs for
+     * carving the current target with the current settings
+     * @param buffer workspace buffer
+     * @return buffer size in bytes
+     */
+    size_t workspaceBytes_(WorkspaceBuffer buffer) const;
+
+    /**
+     * @brief reserveWorkspace grows the workspace for carving the current
+     * target
+     */
+    void reserveWorkspace_();
+
+    /**
+     * @brief calculateGrayscale converts the target to grayscale
+     * @param target target image
+     * @param grayscale grayscale map of the target
+     */
+    void calculateGrayscale_(cv::Mat &target, cv::Mat &grayscale);
+
+    /**
+     * @brief carveOutOfCore carves the target with a TiledCarver
+     * @param start start of the carve
+     * @return reduced image
+     */
+    cv::Mat carveOutOfCore_(chrono::steady_clock::time_point start);
+
+    /**
+     * @brief checkCancelled throws CarveCancelled if the cancel token has
+     * been cancelled
+     */
+    void checkCancelled_() const noexcept(false);
+
+    /**
+     * @brief deadlineNear tells whether carving on risks missing the
+     * deadline or the time budget, keeping the time of one iteration for
+     * the final resize
+     * @param start start of the carve
+     * @param iterationSeconds expected duration of an iteration
+     * @return true if the remaining seams should be resized away
+     */
+    bool deadlineNear_(chrono::steady_clock::time_point start,
+                       double iterationSeconds) const;
+
+    /**
+     * @brief carveStop tells whether a carve should stop carving and
+     * resize the remaining seams away
+     * @param start start of the carve
+     * @param iterationSeconds expected duration of an iteration
+     * @param carvedSeams seams carved so far
+     * @return reason to stop, STOP_NONE to carve on
+     */
+    CarveStop carveStop_(chrono::steady_clock::time_point start,
+                         double iterationSeconds, int carvedSeams) const;
+
+    /**
+     * @brief relativeSeamEnergy returns the mean energy of a seam relative
+     * to the full range of the energy map
+     * @param energyMap energy map the seam was found in
+     * @param seam seam
+     * @param cost summed energy of the seam
+     * @return mean energy in [0, 1]
+     */
+    double relativeSeamEnergy_(const cv::Mat &energyMap,
+                               const vector<int> &seam, double cost) const;
+
+    /**
+     * @brief reportProgress passes the state of a carve to the progress
+     * callback
+     * @param start start of the carve
+     * @param iteration iterations done
+     * @param seamsRemaining seams left to remove
+     * @param seamSeconds average duration of a seam so far
+     * @param resizedSeams seams replaced by resizing
+     */
+    void reportProgress_(chrono::steady_clock::time_point start,
+                         int iteration, int seamsRemaining,
+                         double seamSeconds, int resizedSeams = 0);
+
+    /**
+     * @brief resizeRest scales the target down to the result size,
+     * standing in for the seams not carved
+     * @param target partly carved target image
+     * @param start start of the carve
+     * @param iteration iterations done
+     * @param stop reason carving stopped
+     * @return result image
+     */
+    cv::Mat resizeRest_(const cv::Mat &target,
+                        chrono::steady_clock::time_point start,
+                        int iteration, CarveStop stop);
+
+    /**
+     * @brief startCarve sets up a copy of the original image along with
+     * its grayscale and energy maps for carving
+     * @param target target image
+     * @param grayscale grayscale map of the target
+     * @param energyMap energy map of the target
+     */
+    void startCarve_(cv::Mat &target, cv::Mat &grayscale, cv::Mat &energyMap);
+
+    /**
+     * @brief carveSeam removes the minimum energy seam from the target
+     * image and brings all maps up to date
+     * @param target target image, modified
+     * @param grayscale grayscale map of the target
+     * @param energyMap energy map of the target
+     * @return removed seam, valid until the next seam in the direction
+     */
+    template<CarveMode direction>
+    const vector<int> &carveSeam_(cv::Mat &target, cv::Mat &grayscale,
+                                  cv::Mat &energyMap);
+
+    /**
+     * @brief carveCheaperSeam searches the minimum energy seam of both
+     * directions and removes the one with less energy, which greedily
+     * minimises the energy removed by a BOTH mode carve
+     * @param target target image, modified
+     * @param grayscale grayscale map of the target
+     * @param energyMap energy map of the target
+     * @return direction of the removed seam
+     */
+    CarveMode carveCheaperSeam_(cv::Mat &target, cv::Mat &grayscale,
+                                cv::Mat &energyMap);
+
+    /**
+     * @brief buildSeamIndexMap records the removal order of seamCount
+     * seams in the given direction
+     * @param seamCount number of seams to record
+     * @return seam index map
+     */
+    template<CarveMode direction>
+    SeamIndexMap buildSeamIndexMap_(int seamCount);
+
+    /**
+     * @brief updateMaps brings the grayscale and energy maps up to date
+     * after the given seam has been removed from the target image
+     * @param target reduced target image
+     * @param grayscale grayscale map of the image before the removal
+     * @param energyMap energy map of the image before the removal
+     * @param seam removed seam
+     * @param direction seam direction, VERTICAL or HORIZONTAL
+     */
+    void updateMaps_(cv::Mat &target, cv::Mat &grayscale, cv::Mat &energyMap,
+                     const vector<int> &seam, CarveMode direction);
+
+    /**
+     * @brief energyFootprint calculates the range of every line whose
+     * energy is affected by the removal of a seam
+     * @param removed removed position on every line
+     * @param length number of lines
+     * @param width reduced line width
+     * @param footprint target affected range on every line
+     */
+    void energyFootprint_(const vector<int> &removed, int length, int width,
+                          vector<cv::Range> &footprint);
+
+    /**
+     * @brief findSeam returns the minimum energy seam using the cumulative
+     * energy map kept for the direction, calculating it first if needed
+     * @param energyMap energy map for the image
+     * @param seam target seam indices as returned by getSeamToRemove
+     */
+    template<CarveMode direction>
+    void findSeam_(cv::Mat &energyMap, vector<int> &seam);
+
+    /**
+     * @brief updateCumulativeEnergy brings the cumulative energy and
+     * back-pointer maps kept for the direction up to date after the seam
+     * has been removed. Only
+     * the cells whose inputs changed are recomputed, and the recomputed
+     * range of a row follows the cells that actually changed on the row
+     * above. The map of the other direction is shifted on the pool
+     * meanwhile, see shiftCumulativeEnergy(). The single parameter
+     * version dispatches on the energy map type.
+     * @param energyMap reduced and updated energy map
+     * @param seam removed seam
+     */
+    template<CarveMode direction, typename T>
+    void updateCumulativeEnergy_(cv::Mat &energyMap, const vector<int> &seam);
+    template<CarveMode direction>
+    void updateCumulativeEnergy_(cv::Mat &energyMap, const vector<int> &seam);
+
+    /**
+     * @brief shiftCumulativeEnergy brings the cumulative energy and
+     * back-pointer maps kept for the direction up to date after a seam
+     * of the other direction has been removed. The seam crosses every
+     * line of the map, lines before the first one it or its changed
+     * energies reach keep their values and the rest are recomputed.
+     * @param energyMap reduced and updated energy map
+     * @param seam removed seam of the other direction
+     * @param footprint energy footprint of the removed seam
+     */
+    template<CarveMode direction, typename T>
+    void shiftCumulativeEnergy_(cv::Mat &energyMap, const vector<int> &seam,
+                                const vector<cv::Range> &footprint);
+
+    /**
+     * @brief updateEnergy recomputes the part of the energy map whose
+     * filter footprint was touched by a removed seam
+     * @param grayscale reduced grayscale map
+     * @param energyMap reduced energy map, stale around the seam
+     * @param removed removed column for every row on VERTICAL seams,
+     * removed row for every column on HORIZONTAL seams
+     * @param direction seam direction, VERTICAL or HORIZONTAL
      */
-    void calculateCumulativePixelRange_(int r0, int r1, cv::Mat &energyMap,
-                                       cv::Mat &cumulativeEnergyMap);
+    void updateEnergy_(cv::Mat &grayscale, cv::Mat &energyMap,
+                       const vector<int> &removed, CarveMode direction);
 
     void printStatus_(int h, int v);
 
@@ -0,0 +1,188 @@
+#ifndef CARVERSTATS_HPP
+#define CARVERSTATS_HPP
+
+#include <opencv2/core/core.hpp>
+
+#include <array>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+namespace carver {
+
+/**
+ * @brief CarveStage names the timed stages of carving. Horizontal seams
+ * are searched on the image as is, so there is no rotation stage;
+ * downsampling for ENGINE_PYRAMID is timed on its own instead.
+ */
+enum CarveStage {
+    STAGE_GRAYSCALE,
+    STAGE_ENERGY,
+    STAGE_CUMULATIVE,
+    STAGE_BACKTRACK,
+    STAGE_REMOVAL,
+    STAGE_PYRAMID,
+    STAGE_COUNT
+};
+
+/**
+ * @brief The CarverStats struct holds the timings and counters recorded
+ * by a carver. Everything stays zero unless the library was built with
+ * CARVER_STATS defined. Stages timed on different threads at once, such
+ * as the two seam searches of BOTH mode, add up to more than wall time.
+ */
+struct CarverStats {
+    // Whether the library was built with CARVER_STATS
+    bool enabled = false;
+
+    // Wall time and number of timed calls per stage
+    array<double, STAGE_COUNT> stageSeconds = {};
+    array<long, STAGE_COUNT> stageCalls = {};
+
+    // Wall time per stage of every carving iteration
+    vector<array<double, STAGE_COUNT>> iterationSeconds;
+
+    long iterations = 0;
+    long seams = 0;
+
+    // Bytes of image-sized buffers allocated: working copies, grayscale,
+    // energy, cumulative energy and back-pointer maps. Temporaries inside
+    // OpenCV filters are not counted.
+    long bytesAllocated = 0;
+
+    // Threads started for private pools and tasks handed to a pool
+    long threadsSpawned = 0;
+    long tasksSubmitted = 0;
+
+    /**
+     * @brief stageName returns the name of a stage as used in JSON
+     * @param stage stage
+     * @return stage name
+     */
+    static const char *stageName(CarveStage stage);
+
+    /**
+     * @brief toJson formats the statistics as a JSON object
+     * @return JSON text
+     */
+    string toJson() const;
+};
+
+/**
+ * @brief The StatsRecorder class collects statistics from the threads of
+ * a carver. Copies start with the statistics of the original.
+ */
+class StatsRecorder
+{
+public:
+    StatsRecorder();
+    StatsRecorder(const StatsRecorder &other);
+    StatsRecorder &operator=(const StatsRecorder &other);
+
+    void addStageTime(CarveStage stage, double seconds);
+    void addAllocation(const cv::Mat &mat);
+    void addThreads(long count);
+    void addTasks(long count);
+    void addSeams(long count);
+
+    /**
+     * @brief reserveIterations makes room for the timings of the given
+     * number of further iterations, so that closing them does not allocate
+     * @param count number of iterations
+     */
+    void reserveIterations(long count);
+
+    /**
+     * @brief endIteration closes the current iteration's stage timings
+     */
+    void endIteration();
+
+    /**
+     * @brief stats returns a snapshot of the statistics
+     * @return statistics
+     */
+    CarverStats stats() const;
+
+    /**
+     * @brief reset clears all statistics
+     */
+    void reset();
+
+private:
+    mutable mutex lock_;
+    CarverStats stats_;
+    array<double, STAGE_COUNT> iteration_ = {};
+};
+
+/**
+ * @brief The ScopedStageTimer class adds the time until it goes out of
+ * scope to a stage
+ */
+class ScopedStageTimer
+{
+public:
+    ScopedStageTimer(StatsRecorder &recorder, CarveStage stage)
+        : recorder_(recorder), stage_(stage),
+          start_(chrono::steady_clock::now()) {}
+
+    ~ScopedStageTimer() {
+        chrono::duration<double> elapsed =
+                chrono::steady_clock::now() - start_;
+        recorder_.addStageTime(stage_, elapsed.count());
+    }
+
+    ScopedStageTimer(const ScopedStageTimer &) = delete;
+    ScopedStageTimer &operator=(const ScopedStageTimer &) = delete;
+
+private:
+    StatsRecorder &recorder_;
+    CarveStage stage_;
+    chrono::steady_clock::time_point start_;
+};
+
+/**
+ * @brief The AllocationProbe class counts the buffer of a matrix as
+ * allocated if the matrix holds a different buffer when the probe goes
+ * out of scope
+ */
+class AllocationProbe
+{
+public:
+    AllocationProbe(StatsRecorder &recorder, const cv::Mat &mat)
+        : recorder_(recorder), mat_(mat), data_(mat.datastart) {}
+
+    ~AllocationProbe() {
+        if (mat_.datastart && mat_.datastart != data_)
+            recorder_.addAllocation(mat_);
+    }
+
+    AllocationProbe(const AllocationProbe &) = delete;
+    AllocationProbe &operator=(const AllocationProbe &) = delete;
+
+private:
+    StatsRecorder &recorder_;
+    const cv::Mat &mat_;
+    const uchar *data_;
+};
+} // namespace carver
+
+// Instrumentation hooks, these compile to nothing without CARVER_STATS
+#ifdef CARVER_STATS
+#define CARVER_STATS_CONCAT_(a, b) a##b
+#define CARVER_STATS_NAME_(a, b) CARVER_STATS_CONCAT_(a, b)
+#define CARVER_STATS_SCOPE(recorder, stage) \
+    carver::ScopedStageTimer CARVER_STATS_NAME_(stageTimer_, __LINE__)( \
+        recorder, stage)
+#define CARVER_STATS_ALLOCATION(recorder, mat) \
+    carver::AllocationProbe CARVER_STATS_NAME_(allocationProbe_, __LINE__)( \
+        recorder, mat)
+#define CARVER_STATS_COUNT(recorder, call) (recorder).call
+#else
+#define CARVER_STATS_SCOPE(recorder, stage) ((void)0)
+#define CARVER_STATS_ALLOCATION(recorder, mat) ((void)0)
+#define CARVER_STATS_COUNT(recorder, call) ((void)0)
+#endif
+
+#endif // CARVERSTATS_HPP
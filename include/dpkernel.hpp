@@ -0,0 +1,82 @@
+#ifndef DPKERNEL_HPP
+#define DPKERNEL_HPP
+
+#include <algorithm>
+#include <cstdint>
+
+namespace carver {
+
+/**
+ * @brief cumulativeCell calculates the cumulative energy of a single cell
+ * from its energy and the cumulative energies of its three upper
+ * neighbours. Fixed-point energies saturate instead of wrapping around.
+ * @param energy energy of the cell
+ * @param pre0 first upper neighbour
+ * @param pre1 second upper neighbour
+ * @param pre2 third upper neighbour
+ * @return cumulative energy
+ */
+template<typename T>
+inline T cumulativeCell(T energy, T pre0, T pre1, T pre2) {
+    return energy + std::min(pre0, std::min(pre1, pre2));
+}
+
+template<>
+inline uint16_t cumulativeCell(uint16_t energy, uint16_t pre0, uint16_t pre1,
+                               uint16_t pre2) {
+    unsigned sum = energy + std::min(pre0, std::min(pre1, pre2));
+    return static_cast<uint16_t>(std::min(sum, 0xFFFFu));
+}
+
+template<>
+inline int32_t cumulativeCell(int32_t energy, int32_t pre0, int32_t pre1,
+                              int32_t pre2) {
+    int64_t sum = int64_t(energy) + std::min(pre0, std::min(pre1, pre2));
+    return static_cast<int32_t>(std::min<int64_t>(sum, INT32_MAX));
+}
+
+/**
+ * @brief cumulativeDirection locates the smallest of three upper
+ * neighbours, the first one given wins ties
+ * @param pre0 first upper neighbour
+ * @param pre1 second upper neighbour
+ * @param pre2 third upper neighbour
+ * @return -1, 0 or 1 for the first, second and third neighbour
+ */
+template<typename T>
+inline int cumulativeDirection(T pre0, T pre1, T pre2) {
+    T minimum = std::min(pre0, std::min(pre1, pre2));
+    return pre0 == minimum ? -1 : (pre1 == minimum ? 0 : 1);
+}
+
+/**
+ * @brief cumulativeRow calculates the cumulative energies of the columns
+ * [c0, c1) of a row along with the back-pointer to the upper neighbour
+ * each of them continues from. Neighbours outside [0, cols) are clamped
+ * to the row edges and ties resolve to the left. Uses the widest vector
+ * instruction set supported by the CPU, picked at runtime, for both the
+ * energies and the back-pointers, and gives the same results as the scalar
+ * fallback. Fixed-point sums saturate like cumulativeCell.
+ * @param energyRow energy values of the row
+ * @param previousRow cumulative energies of the row above
+ * @param targetRow target cumulative energy row
+ * @param directionRow target back-pointer row, column offsets -1, 0 or 1
+ * @param c0 start column
+ * @param c1 end column
+ * @param cols row width
+ */
+void cumulativeRow(const double *energyRow, const double *previousRow,
+                   double *targetRow, int8_t *directionRow, int c0, int c1,
+                   int cols);
+void cumulativeRow(const float *energyRow, const float *previousRow,
+                   float *targetRow, int8_t *directionRow, int c0, int c1,
+                   int cols);
+void cumulativeRow(const uint16_t *energyRow, const uint16_t *previousRow,
+                   uint16_t *targetRow, int8_t *directionRow, int c0, int c1,
+                   int cols);
+void cumulativeRow(const int32_t *energyRow, const int32_t *previousRow,
+                   int32_t *targetRow, int8_t *directionRow, int c0, int c1,
+                   int cols);
+
+} // namespace carver
+#endif // DPKERNEL_HPP
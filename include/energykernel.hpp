@@ -0,0 +1,35 @@
+#ifndef ENERGYKERNEL_HPP
+#define ENERGYKERNEL_HPP
+
+#include <opencv2/core/core.hpp>
+
+#include <threadpool.hpp>
+
+namespace carver {
+
+/**
+ * @brief fusedEnergy calculates the energy map of an 8-bit image in a
+ * single streaming pass: grayscale conversion, 5x5 gaussian blur, 3x3
+ * sobel gradients, the average of their saturated magnitudes and the
+ * conversion to the energy type. Gives the same values as running
+ * cvtColor, GaussianBlur, Sobel, convertScaleAbs, addWeighted and
+ * convertTo one after another with reflected borders. Rows are split into
+ * tiles run on the pool, each tile keeps only a few rolling rows of
+ * intermediate results. The blur and sobel passes run over whole rows in
+ * 16-bit SSE2 lanes on x86, the grayscale conversion and the row edges
+ * are scalar.
+ * @param source CV_8UC3 BGR or CV_8UC1 grayscale image, pixels outside of
+ * it are never read even if it is a view into a larger buffer
+ * @param energyMap target energy map, created with the source size
+ * @param depth energy map depth, CV_64F and CV_32F energies are scaled to
+ * [0, 1], CV_8U, CV_16U and CV_32S ones are left in [0, 255]
+ * @param grayscale optional target for the grayscale map of a BGR source
+ * @param pool pool running the row tiles, the pass is serial when null
+ * @param shift bits fixed-point energies are shifted down by, rounding
+ * down, must be 0 for floating point depths
+ */
+void fusedEnergy(const cv::Mat &source, cv::Mat &energyMap, int depth,
+                 cv::Mat *grayscale, ThreadPool *pool,
+                 int shift = 0) noexcept(false);
+} // namespace carver
+#endif // ENERGYKERNEL_HPP
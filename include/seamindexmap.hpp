@@ -0,0 +1,91 @@
+#ifndef SEAMINDEXMAP_HPP
+#define SEAMINDEXMAP_HPP
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/core.hpp>
+
+#include <string>
+
+#include <carver.hpp>
+
+using namespace std;
+namespace carver {
+
+/**
+ * @brief The SeamIndexMap class records the order in which the pixels of
+ * an image were removed by carving it in one direction. Any number of
+ * seams up to the recorded count can then be removed from the image with
+ * a single gather, without energy or cumulative energy calculations.
+ * @author Joni Lepistö <joni.m.lepisto@gmail.com>
+ */
+class SeamIndexMap
+{
+public:
+    SeamIndexMap() = default;
+
+    /**
+     * @brief SeamIndexMap wraps a recorded removal order
+     * @param direction seam direction, VERTICAL or HORIZONTAL
+     * @param order CV_32S map of the image size holding the index of the
+     * seam that removed each pixel, seamCount for pixels never removed.
+     * Every seam must remove exactly one pixel of every line.
+     * @param seamCount number of recorded seams
+     */
+    SeamIndexMap(CarveMode direction, cv::Mat order, int seamCount)
+        noexcept(false);
+
+    /**
+     * @brief direction returns the direction of the recorded seams
+     * @return seam direction
+     */
+    CarveMode direction() const;
+
+    /**
+     * @brief seamCount returns the number of recorded seams
+     * @return seam count
+     */
+    int seamCount() const;
+
+    /**
+     * @brief order returns the removal order of every pixel
+     * @return CV_32S removal order map
+     */
+    const cv::Mat &order() const;
+
+    /**
+     * @brief empty tells whether the map holds a recording
+     * @return true if nothing has been recorded
+     */
+    bool empty() const;
+
+    /**
+     * @brief retarget removes the first seams of the recording from the
+     * image the map was recorded for
+     * @param image source image of the recorded size, any type
+     * @param seams number of seams to remove (0-seamCount)
+     * @return reduced image
+     */
+    cv::Mat retarget(const cv::Mat &image, int seams) const noexcept(false);
+
+    /**
+     * @brief save stores the map with cv::FileStorage, the format follows
+     * from the file extension (.yml, .xml, .json, optionally .gz)
+     * @param filepath target path
+     */
+    void save(const string &filepath) const noexcept(false);
+
+    /**
+     * @brief load reads a map stored with save(), rejecting maps that do
+     * not remove exactly one pixel of every line for each seam
+     * @param filepath source path
+     * @return loaded map
+     */
+    static SeamIndexMap load(const string &filepath) noexcept(false);
+
+private:
+    CarveMode direction_ = VERTICAL;
+    int seamCount_ = 0;
+    cv::Mat order_;
+};
+} // namespace carver
+#endif // SEAMINDEXMAP_HPP
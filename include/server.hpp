@@ -0,0 +1,245 @@
+#ifndef SERVER_HPP
+#define SERVER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <carver.hpp>
+#include <boundedqueue.hpp>
+
+using namespace std;
+namespace carver {
+
+/**
+ * @brief The CarveServer class keeps carvers and their threads alive and
+ * carves images sent over a Unix domain socket or a pair of streams.
+ *
+ * Requests and responses are frames of two length-prefixed parts, each
+ * length being a 32-bit unsigned integer in network byte order:
+ *
+ *     header length, header, payload length, payload
+ *
+ * The header is text holding one key=value pair per line. Requests carry
+ * mode=vertical|horizontal|both, optionally amount=<0-1> or count=<pixels>
+ * and format=<extension> for the result (.png by default), and either a
+ * path=<file> to read or the encoded image as payload. Paths are only
+ * read from inside the file root, see setFileRoot(). A deadline=<ms>
+ * bounds the time from receiving the request to the result: seams left
+ * when it nears are resized away instead of carved, as are those left
+ * once a seam's mean energy exceeds hybrid=<0-1>. A header with
+ * command=stats asks for the server metrics instead. Responses start
+ * with status=ok or status=error and message=<reason>; carved images come
+ * back encoded as payload along with their width and height, and
+ * resized=<seams> when the carve was cut short. Requests of a connection
+ * are carved concurrently and answered in order. Jobs of clients that
+ * hang up before their responses are cancelled.
+ * @author Joni Lepistö <joni.m.lepisto@gmail.com>
+ */
+class CarveServer
+{
+public:
+    /**
+     * @brief CarveServer creates a server
+     * @param prototype carver whose settings every job starts from, each
+     * worker keeps its own copy
+     */
+    explicit CarveServer(const Carver &prototype);
+
+    /**
+     * @brief setVerbosity sets this class to print information on stdout
+     * @param verbose verbosity state
+     */
+    void setVerbosity(bool verbose);
+
+    /**
+     * @brief setConcurrentJobs sets how many jobs are carved at once
+     * @param concurrentJobs number of worker threads and carvers
+     */
+    void setConcurrentJobs(int concurrentJobs) noexcept(false);
+
+    /**
+     * @brief setQueueSize sets how many jobs may wait for a worker, jobs
+     * beyond that are rejected right away
+     * @param queueSize maximum queue depth
+     */
+    void setQueueSize(int queueSize) noexcept(false);
+
+    /**
+     * @brief setMaxConnections sets how many socket connections are served
+     * at once, each by a thread of its own. Clients connecting beyond that
+     * get an error response and are closed.
+     * @param maxConnections connection limit
+     */
+    void setMaxConnections(int maxConnections) noexcept(false);
+
+    /**
+     * @brief setFileRoot sets the directory path= requests may read images
+     * from, relative paths start from it. Path requests are refused while
+     * no root is set, which is the default.
+     * @param fileRoot existing directory, empty to refuse path requests
+     */
+    void setFileRoot(const string &fileRoot) noexcept(false);
+
+    /**
+     * @brief serveSocket accepts connections on a Unix domain socket until
+     * stop() is called. Every connection may send any number of requests,
+     * without waiting for the responses. A stale socket file at the path
+     * is replaced.
+     * @param socketPath socket path
+     */
+    void serveSocket(const string &socketPath) noexcept(false);
+
+    /**
+     * @brief serveStream serves the requests read from a file descriptor
+     * until it reaches end of file, writing the responses to another one
+     * @param inputFd request stream, such as stdin
+     * @param outputFd response stream, such as stdout
+     */
+    void serveStream(int inputFd, int outputFd);
+
+    /**
+     * @brief stop makes serveSocket() stop accepting connections, close
+     * the open ones and return once their jobs have finished
+     */
+    void stop();
+
+    /**
+     * @brief queueDepth returns the number of jobs waiting for a worker
+     * @return queue depth
+     */
+    int queueDepth() const;
+
+    /**
+     * @brief activeJobs returns the number of jobs being carved
+     * @return active job count
+     */
+    int activeJobs() const;
+
+private:
+    typedef map<string, string> Header;
+
+    struct Response {
+        string header;
+        vector<uchar> payload;
+    };
+
+    struct Job {
+        Header header;
+        vector<uchar> payload;
+        promise<Response> response;
+        CancelToken cancelToken;
+        bool hasDeadline = false;
+        chrono::steady_clock::time_point deadline;
+    };
+
+    Carver prototype_;
+    bool verbose_ = false;
+    int concurrentJobs_ = 2;
+    int queueSize_ = 64;
+    int maxConnections_ = 16;
+    // Resolved directory path requests are read from, empty if disabled
+    string fileRoot_;
+
+    // Frames larger than these are refused and the connection closed
+    constexpr static uint32_t maxHeaderSize_ = 64 * 1024;
+    constexpr static uint32_t maxPayloadSize_ = 256 * 1024 * 1024;
+    // How often a waiting connection checks whether its client is gone
+    constexpr static int hangupPollMilliseconds_ = 50;
+
+    unique_ptr<BoundedQueue<Job>> jobs_;
+    vector<thread> workers_;
+    atomic<int> active_;
+    atomic<long> completed_;
+    atomic<long> rejected_;
+
+    atomic<bool> stopping_;
+    atomic<int> listenFd_;
+    mutex clientLock_;
+    set<int> clientFds_;
+    atomic<int> openConnections_;
+
+    /**
+     * @brief startWorkers starts the worker threads and opens the job queue
+     */
+    void startWorkers_();
+
+    /**
+     * @brief stopWorkers lets the workers finish the queued jobs and joins
+     * them
+     */
+    void stopWorkers_();
+
+    /**
+     * @brief workerLoop carves queued jobs with a carver of its own
+     */
+    void workerLoop_();
+
+    /**
+     * @brief connectionLoop serves accepted socket connections until the
+     * queue is closed
+     * @param connections queue of accepted client sockets
+     */
+    void connectionLoop_(BoundedQueue<int> &connections);
+
+    /**
+     * @brief serveConnection answers requests until the input ends or a
+     * frame cannot be read or written. Requests are read ahead of their
+     * responses, which a second thread writes in order.
+     * @param inputFd request stream
+     * @param outputFd response stream
+     */
+    void serveConnection_(int inputFd, int outputFd);
+
+    /**
+     * @brief submit queues the job of a single request
+     * @param header request header
+     * @param payload request payload
+     * @param cancelToken token of the connection, cancelled on a hang-up
+     * @return future response, ready right away for requests that need
+     * no carving or could not be queued
+     */
+    future<Response> submit_(Header header, vector<uchar> payload,
+                             CancelToken cancelToken);
+
+    /**
+     * @brief writeResponses writes the responses of a connection in
+     * request order, cancelling its jobs if the client hangs up
+     * @param pending responses in request order
+     * @param inputFd request stream, shut down when writing fails
+     * @param outputFd response stream, watched for a hang-up
+     * @param cancelToken token of the connection's jobs
+     */
+    void writeResponses_(BoundedQueue<future<Response>> &pending,
+                         int inputFd, int outputFd, CancelToken cancelToken);
+
+    /**
+     * @brief carve runs a carving job
+     * @param carver worker's carver
+     * @param job job to run
+     * @return response with the encoded result
+     */
+    Response carve_(Carver &carver, Job &job);
+
+    /**
+     * @brief errorResponse creates a failure response
+     * @param message failure reason
+     * @return response
+     */
+    static Response errorResponse_(const string &message);
+
+    /**
+     * @brief log prints a message when verbose
+     * @param message message to print
+     */
+    void log_(const string &message);
+};
+} // namespace carver
+#endif // SERVER_HPP
@@ -0,0 +1,122 @@
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+namespace carver {
+
+/**
+ * @brief The ThreadPool class is a long-lived work-stealing pool used by
+ * all parallel carving stages. Each worker owns a task queue and steals
+ * from the others when it runs dry. Threads waiting for a result help
+ * by running pending tasks, so nested parallelism never deadlocks even
+ * when the pool has no workers at all.
+ * @author Joni Lepistö <joni.m.lepisto@gmail.com>
+ */
+class ThreadPool
+{
+public:
+    /**
+     * @brief ThreadPool starts the worker threads
+     * @param workerCount number of worker threads, the calling thread
+     * always participates on top of these
+     */
+    explicit ThreadPool(int workerCount);
+
+    /**
+     * @brief ~ThreadPool finishes queued tasks and joins the workers
+     */
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    /**
+     * @brief sharedPool returns the process-wide default pool which has
+     * one worker less than there are hardware threads
+     * @return shared pool
+     */
+    static shared_ptr<ThreadPool> sharedPool();
+
+    /**
+     * @brief concurrency returns the number of threads taking part in
+     * parallel loops, workers and the calling thread
+     * @return concurrency level
+     */
+    int concurrency() const;
+
+    /**
+     * @brief submit queues a task for asynchronous execution
+     * @param task callable to run
+     * @return future for the task result, wait on it with wait()
+     */
+    template<typename F>
+    auto submit(F &&task) -> future<decltype(task())> {
+        using Result = decltype(task());
+        auto packaged = make_shared<packaged_task<Result()>>(
+                    std::forward<F>(task));
+        future<Result> result = packaged->get_future();
+        push_([packaged] { (*packaged)(); });
+        return result;
+    }
+
+    /**
+     * @brief wait blocks until the given future is ready, running pending
+     * tasks in the meantime
+     * @param result future returned by submit()
+     * @return task result
+     */
+    template<typename T>
+    T wait(future<T> &result) {
+        while (result.wait_for(chrono::seconds(0)) != future_status::ready) {
+            if (!runPendingTask())
+                this_thread::yield();
+        }
+        return result.get();
+    }
+
+    /**
+     * @brief parallelFor runs body(i) for every i in [0, n) on the pool
+     * and the calling thread and returns once all of them have finished.
+     * The first exception thrown by body is rethrown here.
+     * @param n number of iterations
+     * @param body loop body
+     */
+    void parallelFor(int n, const function<void(int)> &body);
+
+    /**
+     * @brief runPendingTask runs a single queued task on the calling thread
+     * @return true if a task was run
+     */
+    bool runPendingTask();
+
+private:
+    struct TaskQueue {
+        mutex lock;
+        deque<function<void()>> tasks;
+    };
+
+    vector<unique_ptr<TaskQueue>> queues_;
+    vector<thread> workers_;
+    atomic<bool> stop_;
+    atomic<int> pending_;
+    atomic<unsigned> nextQueue_;
+    mutex sleepMutex_;
+    condition_variable wakeCondition_;
+
+    void push_(function<void()> task);
+    bool pop_(function<void()> &task);
+    void workerLoop_(int index);
+};
+} // namespace carver
+#endif // THREADPOOL_HPP
@@ -0,0 +1,266 @@
+#ifndef TILEDCARVER_HPP
+#define TILEDCARVER_HPP
+
+#include <opencv2/core/core.hpp>
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <threadpool.hpp>
+
+using namespace std;
+namespace carver {
+
+/**
+ * @brief The ScratchRows class keeps the per-pixel state of an
+ * out-of-core carve in a scratch file. Every image row has a record of
+ * its BGR pixels, 8-bit energies and back-pointers packed into two bits
+ * each. Records are mapped into memory a strip of rows at a time, so only
+ * the current strip takes up memory. The file is removed as soon as it
+ * has been created and disappears with the object.
+ * @author Joni Lepistö <joni.m.lepisto@gmail.com>
+ */
+class ScratchRows
+{
+public:
+    /**
+     * @brief ScratchRows creates and sizes the scratch file
+     * @param directory directory of the scratch file
+     * @param rows number of row records
+     * @param cols pixels per row
+     */
+    ScratchRows(const string &directory, int rows, int cols) noexcept(false);
+    ~ScratchRows();
+
+    ScratchRows(const ScratchRows &) = delete;
+    ScratchRows &operator=(const ScratchRows &) = delete;
+
+    /**
+     * @brief map maps the records [r0, r1), unmapping the previous strip
+     * @param r0 first row
+     * @param r1 end row
+     */
+    void map(int r0, int r1) noexcept(false);
+
+    /**
+     * @brief unmap unmaps the current strip
+     */
+    void unmap();
+
+    /**
+     * @brief rowBytes returns the size of a row record
+     * @return record size in bytes
+     */
+    size_t rowBytes() const;
+
+    // Row record fields, only valid for rows of the mapped strip
+    uchar *pixels(int row);
+    uchar *energies(int row);
+    uchar *pointers(int row);
+
+    /**
+     * @brief pixelRows returns the pixels of mapped rows as an image
+     * @param r0 first row
+     * @param r1 end row
+     * @param width image width
+     * @return CV_8UC3 matrix on the mapped records
+     */
+    cv::Mat pixelRows(int r0, int r1, int width);
+
+private:
+    int fd_ = -1;
+    int cols_ = 0;
+    size_t rowBytes_ = 0;
+
+    // Mapped strip, the mapping starts at a page boundary at or before
+    // its first row
+    uchar *mapping_ = nullptr;
+    size_t mappingBytes_ = 0;
+    uchar *firstRow_ = nullptr;
+    int r0_ = 0;
+};
+
+/**
+ * @brief The TiledCarver class carves images whose working state does not
+ * fit in memory. Energies and back-pointers are kept next to the pixels
+ * in a ScratchRows file and every seam takes two passes over it: the
+ * forward pass brings the energies around the previous seam up to date
+ * and runs the cumulative energy DP strip by strip with only two rolling
+ * rows of cumulative energies in memory, the backward pass follows the
+ * back-pointers up and removes the seam. Horizontal seams are carved as
+ * vertical seams of the image rotated clockwise, in BOTH mode all
+ * vertical seams go first.
+ *
+ * Energies are the 8-bit gradient magnitudes summed in 32-bit integers,
+ * so seams are the ones the exact engine finds with ENERGY_FIXED32.
+ * @author Joni Lepistö <joni.m.lepisto@gmail.com>
+ */
+class TiledCarver
+{
+public:
+    /**
+     * @brief TiledCarver creates a tiled carver
+     * @param scratchDirectory directory for scratch files
+     * @param memoryLimit bytes the carve may keep in memory besides the
+     * source and result images. Strips are sized to fit, but never below
+     * a few rows. The result of an in-place carve shares the source
+     * buffer, otherwise it takes one buffer of the vertically carved size
+     * even in BOTH mode, so a carve holds at most the source, that buffer
+     * and the limit.
+     * @param pool pool running the row chunks, serial when null
+     */
+    TiledCarver(const string &scratchDirectory, size_t memoryLimit,
+                ThreadPool *pool);
+
+    /**
+     * @brief carve removes seams from an image
+     * @param image 8-bit BGR source image
+     * @param columns number of vertical seams to remove
+     * @param rows number of horizontal seams to remove
+     * @param inPlace write the result into the source buffer, which it
+     * then shares
+     * @param progress called with the number of vertical and horizontal
+     * seams removed so far after every seam, may be empty. Returning false
+     * stops the carve early, the result then keeps the remaining seams.
+     * @return reduced image
+     */
+    cv::Mat carve(const cv::Mat &image, int columns, int rows, bool inPlace,
+                  const function<bool(int, int)> &progress) noexcept(false);
+
+    /**
+     * @brief seamEnergy returns the mean energy of the latest seam, taken
+     * from the last row of the cumulative energy DP
+     * @return mean energy relative to the full range [0, 1]
+     */
+    double seamEnergy() const;
+
+private:
+    string scratchDirectory_;
+    size_t memoryLimit_;
+    ThreadPool *pool_;
+
+    // Rolling cumulative energy rows, the widened energy and back-pointer
+    // rows of the DP and the removed seam
+    vector<int32_t> energyRow_;
+    vector<int32_t> previousRow_;
+    vector<int32_t> currentRow_;
+    vector<int8_t> directionRow_;
+    vector<int> seam_;
+    double seamEnergy_ = 0;
+    // Energies recomputed around the previous seam
+    cv::Mat energyBand_;
+
+    // Energies depend on pixels up to this many rows and columns away
+    constexpr static int halo_ = 3;
+    // Strips have at least this many rows and energies are recomputed in
+    // bands of at most energyBandRows_ rows
+    constexpr static int minStripRows_ = 16;
+    constexpr static int energyBandRows_ = 32;
+    // Rows are split into chunks of at least this many columns
+    constexpr static int minChunkWidth_ = 8192;
+    // Rotated images are copied in square blocks of this many pixels a
+    // side, small enough for both sides of a block to stay in cache
+    constexpr static int transposeBlock_ = 64;
+
+    /**
+     * @brief carveLines removes vertical seams of an image, or of the
+     * image rotated clockwise
+     * @param source source image
+     * @param count number of seams to remove
+     * @param rotated carve the rotated image, which removes horizontal
+     * seams of the source
+     * @param target target image, created unless it already has the
+     * result size
+     * @param progress called with the number of seams removed so far,
+     * stops the carve when it returns false
+     * @return number of seams removed
+     */
+    int carveLines_(const cv::Mat &source, int count, bool rotated,
+                    cv::Mat &target, const function<bool(int)> &progress);
+
+    /**
+     * @brief stripRows returns the number of rows mapped at once
+     * @param scratch scratch rows
+     * @param lines number of rows
+     * @param width row width
+     * @return rows per strip
+     */
+    int stripRows_(const ScratchRows &scratch, int lines, int width) const;
+
+    /**
+     * @brief load copies an image into the scratch rows, rotating it
+     * a block of transposeBlock_ pixels at a time
+     * @param scratch scratch rows
+     * @param source source image
+     * @param rotated rotate the image clockwise
+     * @param stripRows rows per strip
+     */
+    void load_(ScratchRows &scratch, const cv::Mat &source, bool rotated,
+               int stripRows);
+
+    /**
+     * @brief store copies the scratch rows into an image, rotating them
+     * a block of transposeBlock_ pixels at a time
+     * @param scratch scratch rows
+     * @param lines number of rows
+     * @param width row width
+     * @param rotated rotate the rows counterclockwise
+     * @param stripRows rows per strip
+     * @param target target image, created unless it already has the size
+     */
+    void store_(ScratchRows &scratch, int lines, int width, bool rotated,
+                int stripRows, cv::Mat &target);
+
+    /**
+     * @brief updateEnergy recomputes the energies of the mapped rows
+     * [r0, r1), around the removed seam or everywhere
+     * @param scratch scratch rows, mapped with halo_ rows on both sides
+     * @param r0 first row
+     * @param r1 end row
+     * @param lines number of rows
+     * @param width row width
+     * @param full recompute every energy instead of those around the seam
+     */
+    void updateEnergy_(ScratchRows &scratch, int r0, int r1, int lines,
+                       int width, bool full);
+
+    /**
+     * @brief forwardPass updates the energies and runs the cumulative
+     * energy DP over all rows, storing the back-pointers
+     * @param scratch scratch rows
+     * @param lines number of rows
+     * @param width row width
+     * @param stripRows rows per strip
+     * @param full recompute every energy instead of those around the seam
+     * @return position of the lowest energy seam on the last row
+     */
+    int forwardPass_(ScratchRows &scratch, int lines, int width,
+                     int stripRows, bool full);
+
+    /**
+     * @brief backwardPass follows the back-pointers from the seam end and
+     * removes the seam from the pixels and energies
+     * @param scratch scratch rows
+     * @param lines number of rows
+     * @param width row width before the removal
+     * @param stripRows rows per strip
+     * @param end position of the seam on the last row
+     */
+    void backwardPass_(ScratchRows &scratch, int lines, int width,
+                       int stripRows, int end);
+
+    /**
+     * @brief forChunks splits [0, n) into chunks run on the pool, or runs
+     * it as a single chunk if it is too small to split
+     * @param n number of items
+     * @param minChunk smallest chunk worth running on its own
+     * @param function function taking the chunk index and its range
+     * [i0, i1), chunks start at multiples of four
+     */
+    void forChunks_(int n, int minChunk,
+                    const function<void(int, int, int)> &function);
+};
+} // namespace carver
+#endif // TILEDCARVER_HPP
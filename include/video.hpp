@@ -0,0 +1,147 @@
+#ifndef VIDEO_HPP
+#define VIDEO_HPP
+
+#include <exception>
+#include <mutex>
+#include <string>
+
+#include <opencv2/videoio.hpp>
+
+#include <carver.hpp>
+#include <boundedqueue.hpp>
+
+using namespace std;
+namespace carver {
+
+/**
+ * @brief The VideoResult struct summarises a video run
+ */
+struct VideoResult {
+    int frames = 0;
+    // Frames carved without seam guides: the first one and scene changes
+    int sceneChanges = 0;
+    cv::Size size;
+    double seconds = 0;
+};
+
+/**
+ * @brief The VideoCarver class retargets a video file frame by frame
+ * through a pipeline of decode, carve and encode stages. Frames are
+ * carved in order, each one guided by the seams of the previous frame:
+ * seams are searched in a narrow band around their predecessors, which
+ * is much cheaper than a full search and keeps them from jittering
+ * between frames. A full search is done on the first frame and whenever
+ * the scene changes.
+ * @author Joni Lepistö <joni.m.lepisto@gmail.com>
+ */
+class VideoCarver
+{
+public:
+    /**
+     * @brief VideoCarver creates a video carver
+     * @param prototype carver whose settings are used for every frame
+     */
+    explicit VideoCarver(const Carver &prototype);
+
+    /**
+     * @brief setVerbosity sets this class to print progress on stdout
+     * @param verbose verbosity state
+     */
+    void setVerbosity(bool verbose);
+
+    /**
+     * @brief setQueueSize sets how many decoded or carved frames may wait
+     * between two stages
+     * @param queueSize frames per queue
+     */
+    void setQueueSize(int queueSize) noexcept(false);
+
+    /**
+     * @brief setTemporalBand sets how far a seam is searched from the
+     * seam of the previous frame
+     * @param band positions searched on each side, at least 1
+     */
+    void setTemporalBand(int band) noexcept(false);
+
+    /**
+     * @brief setSceneThreshold sets the mean absolute difference between
+     * two downscaled grayscale frames above which the second one starts a
+     * new scene and is searched in full
+     * @param sceneThreshold difference relative to the full range (0-1]
+     */
+    void setSceneThreshold(double sceneThreshold) noexcept(false);
+
+    /**
+     * @brief setCodec sets the codec of the output video, MPEG-4 by
+     * default
+     * @param fourcc four character code such as "mp4v" or "MJPG"
+     */
+    void setCodec(const string &fourcc) noexcept(false);
+
+    /**
+     * @brief run carves every frame of a video and writes the result
+     * with the frame rate of the input
+     * @param inputPath input video path
+     * @param outputPath output video path
+     * @return summary of the run
+     */
+    VideoResult run(const string &inputPath, const string &outputPath)
+        noexcept(false);
+
+private:
+    struct Frame {
+        bool sceneChange = false;
+        cv::Mat image;
+    };
+
+    Carver prototype_;
+    bool verbose_ = false;
+    int queueSize_ = 8;
+    int temporalBand_ = 8;
+    double sceneThreshold_ = 0.12;
+    int fourcc_ = 0;
+
+    mutex errorLock_;
+    exception_ptr error_;
+
+    /**
+     * @brief decodeStage reads frames and flags scene changes
+     * @param capture opened input video
+     * @param decoded target queue
+     */
+    void decodeStage_(cv::VideoCapture &capture, BoundedQueue<Frame> &decoded);
+
+    /**
+     * @brief carveStage carves decoded frames in order, each one guided by
+     * the seams of the one before unless it starts a new scene
+     * @param decoded source queue
+     * @param carved target queue
+     * @param result run summary
+     * @param frameCount number of frames reported by the input, 0 if not
+     * known
+     */
+    void carveStage_(BoundedQueue<Frame> &decoded, BoundedQueue<Frame> &carved,
+                     VideoResult &result, int frameCount);
+
+    /**
+     * @brief encodeStage writes carved frames, opening the output on the
+     * first one
+     * @param writer output video
+     * @param outputPath output video path
+     * @param fourcc output codec
+     * @param fps output frame rate
+     * @param carved source queue
+     */
+    void encodeStage_(cv::VideoWriter &writer, const string &outputPath,
+                      int fourcc, double fps, BoundedQueue<Frame> &carved);
+
+    /**
+     * @brief fail records the first error of a stage and stops the
+     * pipeline
+     * @param decoded decode queue
+     * @param carved carve queue
+     */
+    void fail_(BoundedQueue<Frame> &decoded, BoundedQueue<Frame> &carved);
+};
+} // namespace carver
+#endif // VIDEO_HPP
@@ -0,0 +1,156 @@
+#ifndef WORKSPACE_HPP
+#define WORKSPACE_HPP
+
+#include <opencv2/core/core.hpp>
+
+#include <vector>
+
+using namespace std;
+namespace carver {
+
+/**
+ * @brief WorkspaceBuffer names the buffers of a Workspace. Buffers of seam
+ * searches come in pairs, the vertical one first, since the searches of
+ * the two directions may run at the same time. The band, search and
+ * pyramid buffers serve the seam engines other than ENGINE_EXACT, whose
+ * searches keep nothing between seams.
+ */
+enum WorkspaceBuffer {
+    BUFFER_GRAYSCALE,
+    BUFFER_ENERGY,
+    BUFFER_STRIP,
+    BUFFER_USED,
+    BUFFER_CUMULATIVE_VERTICAL,
+    BUFFER_CUMULATIVE_HORIZONTAL,
+    BUFFER_DIRECTIONS_VERTICAL,
+    BUFFER_DIRECTIONS_HORIZONTAL,
+    BUFFER_BAND_SUMS_VERTICAL,
+    BUFFER_BAND_SUMS_HORIZONTAL,
+    BUFFER_BAND_DIRECTIONS_VERTICAL,
+    BUFFER_BAND_DIRECTIONS_HORIZONTAL,
+    BUFFER_SEARCH_CUMULATIVE_VERTICAL,
+    BUFFER_SEARCH_CUMULATIVE_HORIZONTAL,
+    BUFFER_SEARCH_DIRECTIONS_VERTICAL,
+    BUFFER_SEARCH_DIRECTIONS_HORIZONTAL,
+    BUFFER_PYRAMID_VERTICAL,
+    BUFFER_PYRAMID_HORIZONTAL,
+    BUFFER_COUNT
+};
+
+/**
+ * @brief The Workspace class owns the buffers a carve works in. They are
+ * sized once for the original image and every stage writes into views of
+ * them, which shrink along with the image as seams are removed, so the
+ * carving loop itself does not allocate. Buffers only ever grow, a
+ * workspace reused for images no larger than the first one allocates
+ * nothing at all.
+ * @author Joni Lepistö <joni.m.lepisto@gmail.com>
+ */
+class Workspace
+{
+public:
+    Workspace() = default;
+
+    // Copies start out empty, carvers never share their buffers
+    Workspace(const Workspace &other);
+    Workspace &operator=(const Workspace &other);
+
+    /**
+     * @brief reserve grows a buffer to hold at least the given number of
+     * bytes, a buffer that is already large enough is kept as is
+     * @param buffer buffer to grow
+     * @param bytes required size in bytes
+     */
+    void reserve(WorkspaceBuffer buffer, size_t bytes);
+
+    /**
+     * @brief reserveLines makes room for seams, energy footprints and
+     * band bounds of the given length
+     * @param lines longest seam length
+     */
+    void reserveLines(int lines);
+
+    /**
+     * @brief view returns a continuous matrix on a buffer. Views of the
+     * same buffer share memory, only the latest one holds valid data,
+     * unless they are placed at different offsets.
+     * @param buffer source buffer
+     * @param rows matrix rows
+     * @param cols matrix columns
+     * @param type matrix type
+     * @param offset byte offset of the view in the buffer
+     * @return view of the buffer, or an empty matrix if the buffer is too
+     * small for it. Callers then allocate the matrix themselves and
+     * count it with CARVER_STATS_ALLOCATION, buffers are sized so that
+     * carves never get there.
+     */
+    cv::Mat view(WorkspaceBuffer buffer, int rows, int cols, int type,
+                 size_t offset = 0);
+
+    /**
+     * @brief block returns the memory block backing a buffer
+     * @param buffer buffer
+     * @return CV_8U block holding the buffer, empty if never reserved
+     */
+    const cv::Mat &block(WorkspaceBuffer buffer) const;
+
+    /**
+     * @brief seam returns the seam of a direction, kept between searches
+     * so that its storage is reused
+     * @param direction seam direction, VERTICAL or HORIZONTAL
+     * @return seam positions
+     */
+    vector<int> &seam(int direction);
+
+    /**
+     * @brief footprint returns the storage for energy footprints
+     * @return footprint ranges
+     */
+    vector<cv::Range> &footprint();
+
+    /**
+     * @brief bandStarts returns the storage for the first position of the
+     * band on every line of a banded search
+     * @param direction seam direction, VERTICAL or HORIZONTAL
+     * @return band starts
+     */
+    vector<int> &bandStarts(int direction);
+
+    /**
+     * @brief bandCentre returns the storage for the centre of the band on
+     * every line of a banded search
+     * @param direction seam direction, VERTICAL or HORIZONTAL
+     * @return band centres
+     */
+    vector<int> &bandCentre(int direction);
+
+    /**
+     * @brief pyramid returns the storage for the level headers of an
+     * energy pyramid, the levels themselves are views of the direction's
+     * pyramid buffer
+     * @param direction seam direction, VERTICAL or HORIZONTAL
+     * @return pyramid levels
+     */
+    vector<cv::Mat> &pyramid(int direction);
+
+    /**
+     * @brief size returns the number of bytes held by the buffers
+     * @return total buffer size
+     */
+    size_t size() const;
+
+    /**
+     * @brief release frees all buffers
+     */
+    void release();
+
+private:
+    cv::Mat blocks_[BUFFER_COUNT];
+    vector<int> seams_[2];
+    vector<cv::Range> footprint_;
+    vector<int> bandStarts_[2];
+    vector<int> bandCentre_[2];
+    vector<cv::Mat> pyramid_[2];
+};
+} // namespace carver
+#endif // WORKSPACE_HPP
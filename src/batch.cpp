@@ -0,0 +1,225 @@
+#include <batch.hpp>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+
+namespace carver {
+namespace {
+// File extensions picked up when a whole directory is given
+const char *imageExtensions[] = {
+    "bmp", "dib", "jpeg", "jpg", "jpe", "jp2", "png", "webp", "pbm", "pgm",
+    "ppm", "pxm", "pnm", "sr", "ras", "tiff", "tif", "exr", "hdr", "pic"
+};
+
+bool hasImageExtension(const string &path) {
+    size_t dot = path.find_last_of('.');
+    if (dot == string::npos)
+        return false;
+    string extension = path.substr(dot + 1);
+    transform(extension.begin(), extension.end(), extension.begin(),
+              [](unsigned char c) { return static_cast<char>(tolower(c)); });
+    for (const char *known : imageExtensions) {
+        if (extension == known)
+            return true;
+    }
+    return false;
+}
+
+string outputPathFor(const string &inputPath, const string &outputDirectory) {
+    size_t slash = inputPath.find_last_of('/');
+    string name = slash == string::npos ? inputPath
+                                        : inputPath.substr(slash + 1);
+    return outputDirectory + "/" + name;
+}
+} // namespace
+
+BatchCarver::BatchCarver(const Carver &prototype)
+    : prototype_(prototype), finished_(0) {
+    // Per-image progress lines from several threads would interleave
+    prototype_.setVerbosity(false);
+}
+
+void BatchCarver::setVerbosity(bool verbose) {
+    this->verbose_ = verbose;
+}
+
+void BatchCarver::setConcurrentImages(int concurrentImages) {
+    if (concurrentImages < 1) {
+        throw out_of_range("Concurrent image count out of range");
+    }
+    this->concurrentImages_ = concurrentImages;
+}
+
+void BatchCarver::setIoThreadCount(int ioThreadCount) {
+    if (ioThreadCount < 1) {
+        throw out_of_range("I/O thread count out of range");
+    }
+    this->ioThreadCount_ = ioThreadCount;
+}
+
+void BatchCarver::setQueueSize(int queueSize) {
+    if (queueSize < 1) {
+        throw out_of_range("Queue size out of range");
+    }
+    this->queueSize_ = queueSize;
+}
+
+void BatchCarver::finish_(const vector<BatchJob> &jobs, size_t job,
+                          BatchResult &result, const string &error) {
+    lock_guard<mutex> lock(resultLock_);
+    if (error.empty()) {
+        result.succeeded++;
+    } else {
+        result.failures.push_back(make_pair(jobs[job], error));
+        if (verbose_)
+            cout << "\n" << jobs[job].inputPath << ": " << error << endl;
+    }
+
+    int finished = ++finished_;
+    if (verbose_) {
+        cout << "\rProcessed " << finished << "/" << jobs.size() << flush;
+    }
+}
+
+void BatchCarver::decodeStage_(const vector<BatchJob> &jobs,
+                               atomic<size_t> &next,
+                               BoundedQueue<Item> &decoded,
+                               BatchResult &result) {
+    size_t job;
+    while ((job = next++) < jobs.size()) {
+        cv::Mat image = cv::imread(jobs[job].inputPath, cv::IMREAD_COLOR);
+        if (image.empty()) {
+            finish_(jobs, job, result, "image loading failed");
+            continue;
+        }
+        if (!decoded.push(Item{job, image}))
+            return;
+    }
+}
+
+void BatchCarver::carveStage_(const vector<BatchJob> &jobs,
+                              BoundedQueue<Item> &decoded,
+                              BoundedQueue<Item> &carved,
+                              BatchResult &result) {
+    // The carver of a thread keeps its workspace across jobs, so buffers
+    // are only allocated when an image is larger than every one before
+    // it. Each carve starts over from the prototype's settings, which
+    // never change, and the decoded image is carved in place.
+    Carver carver = prototype_;
+    Item item;
+    while (decoded.pop(item)) {
+        try {
+            carver.setTargetImage(item.image, true);
+            item.image = carver.carveImage();
+        } catch (exception &e) {
+            finish_(jobs, item.job, result, e.what());
+            continue;
+        }
+        if (!carved.push(std::move(item)))
+            return;
+    }
+}
+
+void BatchCarver::encodeStage_(const vector<BatchJob> &jobs,
+                               BoundedQueue<Item> &carved,
+                               BatchResult &result) {
+    Item item;
+    while (carved.pop(item)) {
+        string error;
+        try {
+            if (!cv::imwrite(jobs[item.job].outputPath, item.image))
+                error = "image saving failed";
+        } catch (exception &e) {
+            error = e.what();
+        }
+        finish_(jobs, item.job, result, error);
+    }
+}
+
+BatchResult BatchCarver::run(const vector<BatchJob> &jobs) {
+    BatchResult result;
+    finished_ = 0;
+
+    BoundedQueue<Item> decoded(queueSize_);
+    BoundedQueue<Item> carved(queueSize_);
+    atomic<size_t> next(0);
+
+    vector<thread> decoders;
+    vector<thread> carvers;
+    vector<thread> encoders;
+    for (int i = 0; i < ioThreadCount_; i++) {
+        decoders.push_back(thread([&] {
+            decodeStage_(jobs, next, decoded, result);
+        }));
+        encoders.push_back(thread([&] {
+            encodeStage_(jobs, carved, result);
+        }));
+    }
+    for (int i = 0; i < concurrentImages_; i++) {
+        carvers.push_back(thread([&] {
+            carveStage_(jobs, decoded, carved, result);
+        }));
+    }
+
+    // Each stage drains once everything upstream has finished
+    for (auto &decoder : decoders) {
+        decoder.join();
+    }
+    decoded.close();
+    for (auto &carver : carvers) {
+        carver.join();
+    }
+    carved.close();
+    for (auto &encoder : encoders) {
+        encoder.join();
+    }
+
+    if (verbose_)
+        cout << endl;
+    return result;
+}
+
+vector<BatchJob> BatchCarver::jobsFromPattern(const string &pattern,
+                                              const string &outputDirectory) {
+    // A plain directory stands for the images inside it
+    bool directory = pattern.find_first_of("*?[") == string::npos;
+    vector<cv::String> paths;
+    cv::glob(directory ? pattern + "/*" : pattern, paths, false);
+
+    vector<BatchJob> jobs;
+    for (const cv::String &path : paths) {
+        if (directory && !hasImageExtension(path))
+            continue;
+        jobs.push_back(BatchJob{path, outputPathFor(path, outputDirectory)});
+    }
+    sort(jobs.begin(), jobs.end(), [](const BatchJob &a, const BatchJob &b) {
+        return a.inputPath < b.inputPath;
+    });
+    return jobs;
+}
+
+vector<BatchJob> BatchCarver::jobsFromManifest(const string &manifestPath,
+                                               const string &outputDirectory) {
+    ifstream manifest(manifestPath);
+    if (!manifest) {
+        throw runtime_error("Could not open manifest " + manifestPath);
+    }
+
+    vector<BatchJob> jobs;
+    string line;
+    while (getline(manifest, line)) {
+        istringstream fields(line);
+        string input;
+        string output;
+        if (!(fields >> input) || input[0] == '#')
+            continue;
+        if (!(fields >> output))
+            output = outputPathFor(input, outputDirectory);
+        jobs.push_back(BatchJob{input, output});
+    }
+    return jobs;
+}
+} // namespace carver
@@ -1,7 +1,198 @@
 #include <carver.hpp>
+#include <energykernel.hpp>
+#include <seamindexmap.hpp>
+#include <tiledcarver.hpp>
+
+#include <cstdlib>
 
 
 namespace carver {
+namespace {
+/**
+ * @brief cumulativeBuffer returns the workspace buffer of the cumulative
+ * energy map of a direction
+ */
+inline WorkspaceBuffer cumulativeBuffer(CarveMode direction) {
+    return direction == VERTICAL ? BUFFER_CUMULATIVE_VERTICAL
+                                 : BUFFER_CUMULATIVE_HORIZONTAL;
+}
+
+/**
+ * @brief directionsBuffer returns the workspace buffer of the back-pointer
+ * map of a direction
+ */
+inline WorkspaceBuffer directionsBuffer(CarveMode direction) {
+    return direction == VERTICAL ? BUFFER_DIRECTIONS_VERTICAL
+                                 : BUFFER_DIRECTIONS_HORIZONTAL;
+}
+
+/**
+ * @brief searchBuffer returns the buffer of a direction from a pair of
+ * seam search buffers
+ * @param vertical vertical buffer of the pair
+ * @param direction seam direction
+ */
+inline WorkspaceBuffer searchBuffer(WorkspaceBuffer vertical,
+                                    CarveMode direction) {
+    return static_cast<WorkspaceBuffer>(vertical +
+                                        (direction == HORIZONTAL ? 1 : 0));
+}
+
+/**
+ * @brief pyramidBytes returns the size of the single precision energy
+ * pyramid built for an image by ENGINE_PYRAMID
+ */
+size_t pyramidBytes(int rows, int cols, int minSize) {
+    size_t bytes = static_cast<size_t>(rows) * cols * sizeof(float);
+    while (min(rows, cols) >= 2 * minSize) {
+        rows = (rows + 1) / 2;
+        cols = (cols + 1) / 2;
+        bytes += static_cast<size_t>(rows) * cols * sizeof(float);
+    }
+    return bytes;
+}
+
+/**
+ * @brief defaultScratchDirectory returns the directory of scratch files
+ * when none has been set
+ */
+string defaultScratchDirectory() {
+    const char *directory = getenv("TMPDIR");
+    return directory && *directory ? directory : "/tmp";
+}
+
+template<typename T> struct EnergyTag {
+    typedef T type;
+};
+
+/**
+ * @brief dispatchEnergy calls the given generic callable with an
+ * EnergyTag matching the element type of an energy map
+ * @param depth OpenCV depth of the energy map
+ * @param function callable taking an EnergyTag
+ * @return callable result
+ */
+template<typename F>
+auto dispatchEnergy(int depth, F &&function)
+    -> decltype(function(EnergyTag<double>())) {
+    switch (depth) {
+    case CV_64F:
+        return function(EnergyTag<double>());
+    case CV_32F:
+        return function(EnergyTag<float>());
+    case CV_16U:
+        return function(EnergyTag<uint16_t>());
+    case CV_32S:
+        return function(EnergyTag<int32_t>());
+    default:
+        throw invalid_argument("Unsupported energy map type");
+    }
+}
+
+/**
+ * @brief upperNeighbour locates the upper neighbour a seam continues from,
+ * the one preferred by Axis::tieOffset wins ties
+ * @param cumulativeEnergyMap cumulative energy map
+ * @param line cumulative energy map line above the current one
+ * @param j current position
+ * @param width line width
+ * @return position of the smallest neighbour on the line above
+ */
+template<typename Axis, typename T>
+inline int upperNeighbour(cv::Mat &cumulativeEnergyMap, int line, int j,
+                          int width) {
+    int j0 = min(max(j + Axis::tieOffset, 0), width - 1);
+    int j2 = min(max(j - Axis::tieOffset, 0), width - 1);
+    int d = cumulativeDirection(
+                Axis::template at<T>(cumulativeEnergyMap, line, j0),
+                Axis::template at<T>(cumulativeEnergyMap, line, j),
+                Axis::template at<T>(cumulativeEnergyMap, line, j2));
+    return d < 0 ? j0 : (d > 0 ? j2 : j);
+}
+
+/**
+ * @brief seamStart locates the seam end with the lowest cumulative
+ * energy, visiting positions in tie preference order
+ * @param cumulativeEnergyMap cumulative energy map
+ * @param line last line of the cumulative energy map
+ * @param width line width
+ * @return position of the seam on the last line
+ */
+template<typename Axis, typename T>
+int seamStart(cv::Mat &cumulativeEnergyMap, int line, int width) {
+    int minIdx = 0;
+    T minValue = T();
+    for (int k = 0; k < width; k++) {
+        int j = Axis::tieOffset < 0 ? k : width - 1 - k;
+        T value = Axis::template at<T>(cumulativeEnergyMap, line, j);
+        if (k == 0 || value < minValue) {
+            minValue = value;
+            minIdx = j;
+        }
+    }
+    return minIdx;
+}
+
+/**
+ * @brief stepBlocked tells whether a seam may not continue from position
+ * j on line i to position next on the line above, either because the
+ * target is taken or because the step would cross another seam
+ * @param used pixels taken by earlier seams
+ * @param i current line
+ * @param j current position
+ * @param next position on the line above
+ * @return true if the step is not allowed
+ */
+template<typename Axis>
+inline bool stepBlocked(cv::Mat &used, int i, int j, int next) {
+    return Axis::template at<uchar>(used, i - 1, next) ||
+            (next != j && Axis::template at<uchar>(used, i, next) &&
+             Axis::template at<uchar>(used, i - 1, j));
+}
+
+/**
+ * @brief traceSeam follows the back-pointers from the given seam end
+ * around the pixels taken by earlier seams, detouring through the
+ * cheapest free upper neighbour where the pointer is blocked
+ * @param cumulativeEnergyMap full cumulative energy map
+ * @param directionMap back-pointer map
+ * @param used pixels taken by earlier seams
+ * @param end seam position on the last line
+ * @param path target seam indices
+ * @return false if the seam ran into a dead end
+ */
+template<typename Axis, typename T>
+bool traceSeam(cv::Mat &cumulativeEnergyMap, cv::Mat &directionMap,
+               cv::Mat &used, int end, vector<int> &path) {
+    int length = Axis::length(directionMap);
+    int width = Axis::width(directionMap);
+    if (Axis::template at<uchar>(used, length - 1, end))
+        return false;
+
+    int j = end;
+    path[length - 1] = j;
+    for (int i = length - 1; i > 0; i--) {
+        int next = j + Axis::template at<int8_t>(directionMap, i, j);
+        if (stepBlocked<Axis>(used, i, j, next)) {
+            next = -1;
+            for (int k = max(j - 1, 0); k <= min(j + 1, width - 1); k++) {
+                if (stepBlocked<Axis>(used, i, j, k))
+                    continue;
+                if (next < 0 ||
+                        Axis::template at<T>(cumulativeEnergyMap, i - 1, k) <
+                        Axis::template at<T>(cumulativeEnergyMap, i - 1, next))
+                    next = k;
+            }
+            if (next < 0)
+                return false;
+        }
+        j = next;
+        path[i - 1] = j;
+    }
+    return true;
+}
+} // namespace
+
 void Carver::log_(string message) {
     log_(message, false);
 }
@@ -16,6 +207,9 @@ void Carver::log_(string message, bool overwrite) {
 }
 
 void Carver::printStatus_(int h, int v) {
+    // Skip building the message on every iteration when nobody reads it
+    if (!verbose_)
+        return;
     string vStatus = v+1 > vIterations_ ?
                 "READY" : to_string(v) + "/" + to_string(vIterations_);
     string hStatus = h+1 > hIterations_ ?
@@ -27,11 +221,27 @@ void Carver::setVerbosity(bool verbose) {
     this->verbose_ = verbose;
 }
 
-bool Carver::loadTargetImage(string filepath) {
+void Carver::setThreadCount(int threadCount) {
+    if (threadCount < 1) {
+        throw out_of_range("Thread count out of range");
+    }
+    this->threadPool_ = make_shared<ThreadPool>(threadCount - 1);
+    CARVER_STATS_COUNT(stats_, addThreads(threadCount - 1));
+}
+
+void Carver::setThreadPool(shared_ptr<ThreadPool> threadPool) {
+    if (!threadPool) {
+        throw invalid_argument("Thread pool missing");
+    }
+    this->threadPool_ = threadPool;
+}
+
+bool Carver::loadTargetImage(string filepath, bool overwrite) {
     originalImage_ = cv::imread(filepath, cv::IMREAD_COLOR);
     if (originalImage_.empty()) {
         return false;
     } else {
+        overwriteTarget_ = overwrite;
         imageCols_ = originalImage_.cols;
         imageRows_ = originalImage_.rows;
         log_("Loaded image " + filepath + " with dimensions "
@@ -40,6 +250,39 @@ bool Carver::loadTargetImage(string filepath) {
     }
 }
 
+bool Carver::decodeTargetImage(const uchar *data, size_t size,
+                               bool overwrite) {
+    // Wrap the buffer, imdecode reads it without a copy
+    cv::Mat buffer(1, static_cast<int>(size), CV_8U, const_cast<uchar *>(data));
+    cv::Mat image = cv::imdecode(buffer, cv::IMREAD_COLOR);
+    if (image.empty()) {
+        return false;
+    }
+    setTargetImage(image, overwrite);
+    log_("Decoded image with dimensions " + to_string(imageCols_) + "x" +
+         to_string(imageRows_));
+    return true;
+}
+
+void Carver::setTargetImage(cv::Mat image, bool overwrite) {
+    if (image.empty() || image.type() != CV_8UC3) {
+        throw invalid_argument("Target image must be a non-empty 8-bit BGR "
+                               "image");
+    }
+    originalImage_ = image;
+    overwriteTarget_ = overwrite;
+    imageCols_ = originalImage_.cols;
+    imageRows_ = originalImage_.rows;
+}
+
+void Carver::setTargetImage(uchar *data, int cols, int rows, size_t step,
+                            bool overwrite) {
+    if (!data || cols < 1 || rows < 1 || step < cols * 3 * sizeof(uchar)) {
+        throw invalid_argument("Target buffer invalid");
+    }
+    setTargetImage(cv::Mat(rows, cols, CV_8UC3, data, step), overwrite);
+}
+
 void Carver::setCarveMode(CarveMode carveMode) {
     this->carveMode_ = carveMode;
 }
@@ -52,6 +295,126 @@ void Carver::setCarveAmount(float carveAmount) {
     }
 }
 
+void Carver::setIncrementalEnergy(bool incrementalEnergy) {
+    this->incrementalEnergy_ = incrementalEnergy;
+}
+
+void Carver::setIncrementalCumulativeEnergy(
+        bool incrementalCumulativeEnergy) {
+    this->incrementalCumulativeEnergy_ = incrementalCumulativeEnergy;
+}
+
+void Carver::setEnergyType(EnergyType energyType) {
+    this->energyType_ = energyType;
+}
+
+void Carver::setSeamEngine(SeamEngine seamEngine) {
+    this->seamEngine_ = seamEngine;
+}
+
+void Carver::setBandWidth(int bandWidth) {
+    if (bandWidth < 1) {
+        throw out_of_range("Band width out of range");
+    }
+    this->bandWidth_ = bandWidth;
+}
+
+void Carver::setBandMargin(double bandMargin) {
+    if (bandMargin < 0.0) {
+        throw out_of_range("Band margin out of range");
+    }
+    this->bandMargin_ = bandMargin;
+}
+
+void Carver::setProgressCallback(
+        function<void(const CarveProgress &)> progressCallback) {
+    this->progressCallback_ = progressCallback;
+}
+
+void Carver::setCancelToken(const CancelToken &cancelToken) {
+    this->cancelToken_ = cancelToken;
+}
+
+void Carver::setDeadline(chrono::steady_clock::time_point deadline) {
+    this->deadline_ = deadline;
+    this->hasDeadline_ = true;
+}
+
+void Carver::clearDeadline() {
+    this->hasDeadline_ = false;
+}
+
+void Carver::setHybridThreshold(double threshold) {
+    if (threshold < 0 || threshold > 1) {
+        throw out_of_range("Hybrid threshold out of range");
+    }
+    this->hybridThreshold_ = threshold;
+}
+
+void Carver::setSeamBudget(int seamBudget) {
+    if (seamBudget < 0) {
+        throw out_of_range("Seam budget out of range");
+    }
+    this->seamBudget_ = seamBudget;
+}
+
+void Carver::setTimeBudget(double seconds) {
+    if (!(seconds >= 0)) {
+        throw out_of_range("Time budget out of range");
+    }
+    this->timeBudget_ = seconds;
+}
+
+CarveSplit Carver::getCarveSplit() const {
+    return carveSplit_;
+}
+
+void Carver::setMemoryLimit(size_t memoryLimit) {
+    this->memoryLimit_ = memoryLimit;
+}
+
+void Carver::setScratchDirectory(const string &scratchDirectory) {
+    if (scratchDirectory.empty()) {
+        throw invalid_argument("Scratch directory missing");
+    }
+    this->scratchDirectory_ = scratchDirectory;
+}
+
+void Carver::setSeamRecording(bool record) {
+    this->recordSeams_ = record;
+}
+
+const CarvedSeams &Carver::getCarvedSeams() const {
+    return carvedSeams_;
+}
+
+void Carver::setSeamGuides(const CarvedSeams &guides, int band) {
+    if (band < 1) {
+        throw out_of_range("Seam guide band out of range");
+    }
+    for (int d = 0; d < 2; d++) {
+        if (guides.seams[d].size() != guides.costs[d].size()) {
+            throw invalid_argument("Seam guides need a cost for every seam");
+        }
+    }
+    this->seamGuides_ = guides;
+    this->guideBand_ = band;
+}
+
+void Carver::clearSeamGuides() {
+    for (int d = 0; d < 2; d++) {
+        seamGuides_.seams[d].clear();
+        seamGuides_.costs[d].clear();
+    }
+}
+
+void Carver::setSeamBatchSize(int seamBatchSize) {
+    if (seamBatchSize < 1) {
+        throw out_of_range("Seam batch size out of range");
+    }
+    this->seamBatchSize_ = seamBatchSize;
+}
+
 void Carver::setCarveCount(int carveCount) {
     if (carveCount < 0) {
         throw out_of_range("Carve count out of range being negative");
@@ -60,208 +423,1410 @@ void Carver::setCarveCount(int carveCount) {
 }
 
 cv::Mat Carver::calculateEnergy(cv::Mat &source) {
-    cv::Mat xGradient, yGradient, target;
+    cv::Mat target;
+    energyShift_ = 0;
+    calculateEnergy_(source, target);
+    fitFixedEnergy_(target);
+    return target;
+}
+
+void Carver::calculateEnergy_(cv::Mat &source, cv::Mat &target) {
+    CARVER_STATS_SCOPE(stats_, STAGE_ENERGY);
+    CARVER_STATS_ALLOCATION(stats_, target);
+    if (fusedEnergy_()) {
+        fusedEnergy(source, target, energyDepth_(), nullptr,
+                    threadPool_.get(), energyShift_);
+        return;
+    }
+    cv::Mat blurred = source;
+    cv::Mat xGradient, yGradient, energy;
 
-    // Blur to remove minor artifacts for more stable results
-    if (blur_) cv::GaussianBlur(source, target, blurKernel_, 0, 0,
-                               cv::BORDER_DEFAULT);
+    // Blur to remove minor artifacts for more stable results. The source
+    // may be a view into a larger buffer, never read outside of it.
+    if (blur_) cv::GaussianBlur(source, blurred, blurKernel_, 0, 0,
+                               cv::BORDER_DEFAULT | cv::BORDER_ISOLATED);
 
     // Calculate gradient using sobel filters
-    cv::Sobel(target, xGradient, CV_16S, 1, 0, 3, sobelScale_, sobelDelta_,
+    cv::Sobel(blurred, xGradient, CV_16S, 1, 0, 3, sobelScale_, sobelDelta_,
               cv::BORDER_DEFAULT);
     cv::convertScaleAbs(xGradient, xGradient);
-    cv::Sobel(target, yGradient, CV_16S, 0, 1, 3, sobelScale_, sobelDelta_,
+    cv::Sobel(blurred, yGradient, CV_16S, 0, 1, 3, sobelScale_, sobelDelta_,
               cv::BORDER_DEFAULT);
     cv::convertScaleAbs(yGradient, yGradient);
 
-    cv::addWeighted(xGradient, 0.5, yGradient, 0.5, 0, target);
-    target.convertTo(target, CV_64F, 1.0/255.0);
-    return target;
+    // Floating point energies are scaled to [0, 1], shifted fixed-point
+    // ones are rounded down like in the fused kernel
+    cv::addWeighted(xGradient, 0.5, yGradient, 0.5, 0, energy);
+    if (energyShift_ > 0) {
+        cv::Mat shifted(1, 256, CV_8U);
+        for (int e = 0; e < 256; e++)
+            shifted.at<uchar>(e) = static_cast<uchar>(e >> energyShift_);
+        cv::LUT(energy, shifted, energy);
+    }
+    int depth = energyDepth_();
+    energy.convertTo(target, depth,
+                     depth == CV_64F || depth == CV_32F ? 1.0/255.0 : 1.0);
 }
 
-void Carver::calculateCumulativePixel_(int r, int c, cv::Mat &energyMap,
-                                      cv::Mat &cumulativeEnergyMap) {
-    double pre0, pre1, pre2;
-    pre0 = cumulativeEnergyMap.at<double>(r - 1, max(c - 1, 0));
-    pre1 = cumulativeEnergyMap.at<double>(r - 1, c);
-    pre2 = cumulativeEnergyMap.at<double>(r - 1, min(c + 1, energyMap.cols - 1));
-    cumulativeEnergyMap.at<double>(r, c) = energyMap.at<double>(r, c) +
-            std::min(pre0, min(pre1, pre2));
+bool Carver::fusedEnergy_() const {
+    return blur_ && blurKernel_ == cv::Size(5, 5) && sobelScale_ == 1
+            && sobelDelta_ == 0;
 }
 
-void Carver::calculateCumulativePixelRange_(int r0, int r1,
-                                           cv::Mat &energyMap,
-                                           cv::Mat &cumulativeEnergyMap) {
-    for (int r = r0; r < r1; r++ ) {
+int Carver::energyDepth_() const {
+    switch (energyType_) {
+    case ENERGY_FLOAT:
+        return CV_32F;
+    case ENERGY_FIXED16:
+        return CV_16U;
+    case ENERGY_FIXED32:
+        return CV_32S;
+    default:
+        return CV_64F;
+    }
+}
+
+void Carver::fitFixedEnergy_(cv::Mat &energyMap) {
+    energyShift_ = 0;
+    if (energyMap.depth() != CV_16U || energyMap.empty())
+        return;
+
+    // The cheapest straight line in either direction bounds the cheapest
+    // seam, half of the range is left for seams growing during the carve
+    vector<int64_t> columnSums(energyMap.cols, 0);
+    int64_t rowBound = numeric_limits<int64_t>::max();
+    for (int r = 0; r < energyMap.rows; r++) {
+        const uint16_t *row = energyMap.ptr<uint16_t>(r);
+        int64_t rowSum = 0;
         for (int c = 0; c < energyMap.cols; c++) {
-            calculateCumulativePixel_(r, c, energyMap, cumulativeEnergyMap);
+            rowSum += row[c];
+            columnSums[c] += row[c];
         }
+        rowBound = min(rowBound, rowSum);
+    }
+    int64_t bound = max(rowBound, *min_element(columnSums.begin(),
+                                               columnSums.end()));
+    while ((bound >> energyShift_) > 0x7FFF)
+        energyShift_++;
+    if (energyShift_ == 0)
+        return;
+
+    // Shifting rounds down like the shifted energy calculations do
+    for (int r = 0; r < energyMap.rows; r++) {
+        uint16_t *row = energyMap.ptr<uint16_t>(r);
+        for (int c = 0; c < energyMap.cols; c++)
+            row[c] = static_cast<uint16_t>(row[c] >> energyShift_);
     }
 }
 
-cv::Mat Carver::calculateCumulativeEnergy(cv::Mat &energyMap) {
-    vector<thread> workers;
-    cv::Mat target = cv::Mat(energyMap.rows, energyMap.cols, CV_64F,
-                             double(0));
-    energyMap.row(0).copyTo(target.row(0));
-
-    #ifdef CONCURRENT
-    int chunkSize = energyMap.rows / N_THREADS;
-    int leftOver = energyMap.rows % N_THREADS;
-    for (int i = 0; i < N_THREADS; i++) {
-        int startIdx = i * chunkSize + 1;
-        int stopIdx;
-        if (i == N_THREADS - 1) {
-            stopIdx = startIdx + chunkSize + leftOver - 1;
-        } else {
-            stopIdx = startIdx + chunkSize - 1;
+void Carver::calculateMaps_(cv::Mat &target, cv::Mat &grayscale,
+                            cv::Mat &energyMap) {
+    // Recalculated maps start over at the beginning of their workspace
+    // buffers. The grayscale map is only kept around for incremental
+    // updates.
+    energyMap = workspace_.view(BUFFER_ENERGY, target.rows, target.cols,
+                                energyDepth_());
+    if (incrementalEnergy_) {
+        grayscale = workspace_.view(BUFFER_GRAYSCALE, target.rows,
+                                    target.cols, CV_8U);
+    } else {
+        grayscale.release();
+    }
+
+    if (!fusedEnergy_()) {
+        calculateGrayscale_(target, grayscale);
+        calculateEnergy_(grayscale, energyMap);
+        return;
+    }
+
+    CARVER_STATS_SCOPE(stats_, STAGE_ENERGY);
+    CARVER_STATS_ALLOCATION(stats_, energyMap);
+    CARVER_STATS_ALLOCATION(stats_, grayscale);
+    fusedEnergy(target, energyMap, energyDepth_(),
+                incrementalEnergy_ ? &grayscale : nullptr,
+                threadPool_.get(), energyShift_);
+}
+
+size_t Carver::workspaceBytes_(WorkspaceBuffer buffer) const {
+    size_t pixels = static_cast<size_t>(imageRows_) * imageCols_;
+    size_t longest = max(imageRows_, imageCols_);
+    size_t energySize = CV_ELEM_SIZE(energyDepth_());
+    int radius = (blur_ ? max(blurKernel_.width, blurKernel_.height) / 2 : 0)
+            + 1;
+
+    // Only the exact engine and seam batches keep cumulative maps. They
+    // are full for batches and incremental updates, otherwise they roll
+    // over at most a band of lines.
+    bool cached = seamEngine_ == ENGINE_EXACT || seamBatchSize_ > 1;
+    bool vertical = cached && carveMode_ != HORIZONTAL;
+    bool horizontal = cached && carveMode_ != VERTICAL;
+    size_t cumulative = incrementalCumulativeEnergy_ || seamBatchSize_ > 1
+            ? pixels : min(pixels, (maxBandHeight_ + 1) * longest);
+    size_t strip = min(pixels, (energyStripSize_ + 2 * radius) * longest);
+
+    // The other engines search bands around earlier seams, guides are
+    // searched the same way. A full search rolls over its cumulative map
+    // and covers the whole image: the pyramid engine searches it in full
+    // once carving has made it too small for a pyramid. The searches of
+    // the two directions run at the same time in BOTH mode and have
+    // buffers of their own.
+    bool guided = !seamGuides_.seams[VERTICAL].empty() ||
+            !seamGuides_.seams[HORIZONTAL].empty();
+    bool banded = seamEngine_ != ENGINE_EXACT || guided;
+    int halfWidth = max(seamEngine_ == ENGINE_BANDED ? bandWidth_ : 0,
+                        seamEngine_ == ENGINE_PYRAMID ? pyramidBand_ : 0);
+    if (guided)
+        halfWidth = max(halfWidth, guideBand_);
+    size_t band = longest * min(2 * static_cast<size_t>(halfWidth) + 1,
+                                longest);
+    size_t pyramid = seamEngine_ == ENGINE_PYRAMID
+            ? pyramidBytes(imageRows_, imageCols_, pyramidMinSize_) : 0;
+    bool search = seamEngine_ != ENGINE_EXACT;
+    size_t searchCumulative = min(pixels, (maxBandHeight_ + 1) * longest)
+            * max(energySize, sizeof(float));
+    bool carved[2] = {carveMode_ != HORIZONTAL, carveMode_ != VERTICAL};
+
+    switch (buffer) {
+    case BUFFER_GRAYSCALE:
+        return incrementalEnergy_ ? pixels : 0;
+    case BUFFER_ENERGY:
+        return pixels * energySize;
+    case BUFFER_STRIP:
+        return incrementalEnergy_ ? strip * energySize : 0;
+    case BUFFER_USED:
+        return seamBatchSize_ > 1 ? pixels : 0;
+    case BUFFER_CUMULATIVE_VERTICAL:
+        return vertical ? cumulative * energySize : 0;
+    case BUFFER_CUMULATIVE_HORIZONTAL:
+        return horizontal ? cumulative * energySize : 0;
+    case BUFFER_DIRECTIONS_VERTICAL:
+        return vertical ? pixels : 0;
+    case BUFFER_DIRECTIONS_HORIZONTAL:
+        return horizontal ? pixels : 0;
+    case BUFFER_BAND_SUMS_VERTICAL:
+    case BUFFER_BAND_SUMS_HORIZONTAL:
+        return banded && carved[buffer - BUFFER_BAND_SUMS_VERTICAL]
+                ? band * sizeof(double) : 0;
+    case BUFFER_BAND_DIRECTIONS_VERTICAL:
+    case BUFFER_BAND_DIRECTIONS_HORIZONTAL:
+        return banded && carved[buffer - BUFFER_BAND_DIRECTIONS_VERTICAL]
+                ? band : 0;
+    case BUFFER_SEARCH_CUMULATIVE_VERTICAL:
+    case BUFFER_SEARCH_CUMULATIVE_HORIZONTAL:
+        return search && carved[buffer - BUFFER_SEARCH_CUMULATIVE_VERTICAL]
+                ? searchCumulative : 0;
+    case BUFFER_SEARCH_DIRECTIONS_VERTICAL:
+    case BUFFER_SEARCH_DIRECTIONS_HORIZONTAL:
+        return search && carved[buffer - BUFFER_SEARCH_DIRECTIONS_VERTICAL]
+                ? pixels : 0;
+    case BUFFER_PYRAMID_VERTICAL:
+    case BUFFER_PYRAMID_HORIZONTAL:
+        return carved[buffer - BUFFER_PYRAMID_VERTICAL] ? pyramid : 0;
+    default:
+        return 0;
+    }
+}
+
+void Carver::reserveWorkspace_() {
+    for (int b = 0; b < BUFFER_COUNT; b++) {
+        WorkspaceBuffer buffer = static_cast<WorkspaceBuffer>(b);
+        CARVER_STATS_ALLOCATION(stats_, workspace_.block(buffer));
+        workspace_.reserve(buffer, workspaceBytes_(buffer));
+    }
+    workspace_.reserveLines(max(imageRows_, imageCols_));
+}
+
+void Carver::energyFootprint_(const vector<int> &removed, int length,
+                              int width, vector<cv::Range> &footprint) {
+    // Energy at a pixel depends on its neighbourhood through the blur and
+    // sobel kernels. Pixels whose neighbourhood lies entirely on one side
+    // of the seam only shifted and keep their energy.
+    int radius = (blur_ ? max(blurKernel_.width, blurKernel_.height) / 2 : 0)
+            + 1;
+    footprint.resize(length);
+
+    for (int l = 0; l < length; l++) {
+        int seamMin = width;
+        int seamMax = 0;
+        for (int k = max(l - radius, 0); k < min(l + radius + 1, length); k++) {
+            seamMin = min(seamMin, removed[k]);
+            seamMax = max(seamMax, removed[k]);
         }
+        footprint[l] = cv::Range(max(seamMin - radius, 0),
+                                 min(seamMax + radius, width));
+    }
+}
+
+void Carver::updateEnergy_(cv::Mat &grayscale, cv::Mat &energyMap,
+                           const vector<int> &removed,
+                           CarveMode direction) {
+    int radius = (blur_ ? max(blurKernel_.width, blurKernel_.height) / 2 : 0)
+            + 1;
+    bool vertical = direction == VERTICAL;
+    int length = vertical ? grayscale.rows : grayscale.cols;
+    int width = vertical ? grayscale.cols : grayscale.rows;
+    cv::Rect bounds(0, 0, grayscale.cols, grayscale.rows);
+    vector<cv::Range> &footprint = workspace_.footprint();
+    energyFootprint_(removed, length, width, footprint);
+
+    for (int l0 = 0; l0 < length; l0 += energyStripSize_) {
+        int l1 = min(l0 + energyStripSize_, length);
+
+        int x0 = width;
+        int x1 = 0;
+        for (int l = l0; l < l1; l++) {
+            x0 = min(x0, footprint[l].start);
+            x1 = max(x1, footprint[l].end);
+        }
+        if (x0 >= x1)
+            continue;
+
+        cv::Rect dirty = vertical ? cv::Rect(x0, l0, x1 - x0, l1 - l0)
+                                  : cv::Rect(l0, x0, l1 - l0, x1 - x0);
 
-        workers.push_back(
-                    thread([this, startIdx, stopIdx, &energyMap, &target] {
-                        return calculateCumulativePixelRange_(
-                            startIdx, stopIdx, energyMap, target);
-        }));
+        // Recompute on a margin wide enough for the filters to see the
+        // same pixels as on the full image
+        cv::Rect source = cv::Rect(dirty.x - radius, dirty.y - radius,
+                                   dirty.width + 2 * radius,
+                                   dirty.height + 2 * radius) & bounds;
+        cv::Mat sourceGray = grayscale(source);
+        cv::Mat sourceEnergy = workspace_.view(BUFFER_STRIP, source.height,
+                                               source.width,
+                                               energyMap.type());
+        calculateEnergy_(sourceGray, sourceEnergy);
+        sourceEnergy(cv::Rect(dirty.x - source.x, dirty.y - source.y,
+                              dirty.width, dirty.height))
+                .copyTo(energyMap(dirty));
     }
+}
 
-    #else
-    for (int r = 1; r < energyMap.rows; r++) {
-        for (int c = 0; c < energyMap.cols; c++) {
-            calculateCumulativePixel(r, c, energyMap, target);
+void Carver::updateMaps_(cv::Mat &target, cv::Mat &grayscale,
+                         cv::Mat &energyMap, const vector<int> &seam,
+                         CarveMode direction) {
+    if (!incrementalEnergy_) {
+        calculateMaps_(target, grayscale, energyMap);
+        return;
+    }
+
+    // Grayscale conversion is per pixel, so removing the seam from the
+    // grayscale map is exact
+    if (direction == VERTICAL) {
+        grayscale = removeVerticalSeam(grayscale, seam);
+        energyMap = removeVerticalSeam(energyMap, seam);
+    } else {
+        grayscale = removeHorizontalSeam(grayscale, seam);
+        energyMap = removeHorizontalSeam(energyMap, seam);
+    }
+    updateEnergy_(grayscale, energyMap, seam, direction);
+}
+
+template<CarveMode direction, typename T>
+void Carver::calculateCumulativeLine_(int i, int j0, int j1,
+                                      cv::Mat &energyMap,
+                                      cv::Mat &cumulativeEnergyMap,
+                                      cv::Mat &directionMap) {
+    typedef SeamAxis<direction> Axis;
+    int width = Axis::width(energyMap);
+
+    // Rolling cumulative maps hold fewer lines than the energy map
+    int lines = Axis::length(cumulativeEnergyMap);
+    int current = i % lines;
+    int previous = (i - 1) % lines;
+
+    // Vertical lines are contiguous rows and go through the vector kernel
+    if (direction == VERTICAL) {
+        cumulativeRow(energyMap.ptr<T>(i),
+                      cumulativeEnergyMap.ptr<T>(previous),
+                      cumulativeEnergyMap.ptr<T>(current),
+                      directionMap.ptr<int8_t>(i), j0, j1, width);
+        return;
+    }
+
+    for (int j = j0; j < j1; j++) {
+        int k = upperNeighbour<Axis, T>(cumulativeEnergyMap, previous, j,
+                                        width);
+        T pre = Axis::template at<T>(cumulativeEnergyMap, previous, k);
+        Axis::template at<T>(cumulativeEnergyMap, current, j) =
+                cumulativeCell(Axis::template at<T>(energyMap, i, j),
+                               pre, pre, pre);
+        Axis::template at<int8_t>(directionMap, i, j) =
+                static_cast<int8_t>(k - j);
+    }
+}
+
+template<CarveMode direction, typename T>
+void Carver::calculateCumulativeTrapezoid_(int j0, int j1, int i0, int i1,
+                                           cv::Mat &energyMap,
+                                           cv::Mat &cumulativeEnergyMap,
+                                           cv::Mat &directionMap) {
+    int width = SeamAxis<direction>::width(energyMap);
+    for (int i = i0; i < i1; i++) {
+        int k = i - i0;
+        int lo = j0 == 0 ? 0 : j0 + k;
+        int hi = j1 == width ? width : j1 - k;
+        calculateCumulativeLine_<direction, T>(i, lo, hi, energyMap,
+                                            cumulativeEnergyMap,
+                                            directionMap);
+    }
+}
+
+template<CarveMode direction, typename T>
+void Carver::calculateCumulativeTriangle_(int j, int i0, int i1,
+                                          cv::Mat &energyMap,
+                                          cv::Mat &cumulativeEnergyMap,
+                                          cv::Mat &directionMap) {
+    for (int i = i0 + 1; i < i1; i++) {
+        int k = i - i0;
+        calculateCumulativeLine_<direction, T>(i, j - k, j + k, energyMap,
+                                            cumulativeEnergyMap,
+                                            directionMap);
+    }
+}
+
+template<CarveMode direction, typename T>
+cv::Mat Carver::calculateCumulativeEnergy_(cv::Mat &energyMap,
+                                           cv::Mat &directionMap,
+                                           bool rolling,
+                                           WorkspaceBuffer cumulative,
+                                           WorkspaceBuffer directions) {
+    CARVER_STATS_SCOPE(stats_, STAGE_CUMULATIVE);
+    typedef SeamAxis<direction> Axis;
+    int length = Axis::length(energyMap);
+    int width = Axis::width(energyMap);
+
+    int nChunks = min(threadPool_->concurrency(), width / minChunkWidth_);
+
+    // Chunks are at least twice the band height wide so that the boundary
+    // triangles of neighbouring chunks never overlap
+    int chunkSize = nChunks > 1 ? width / nChunks : width;
+    int bandHeight = min(maxBandHeight_, chunkSize / 2);
+
+    // A band reads the line above it, so a rolling map needs one line
+    // more than a band. The serial pass only ever needs two lines.
+    int lines = length;
+    if (rolling) {
+        lines = min(length, nChunks > 1 ? bandHeight + 1 : 2);
+    }
+
+    int targetRows = direction == VERTICAL ? lines : width;
+    int targetCols = direction == VERTICAL ? width : lines;
+    cv::Mat target;
+    if (cumulative != BUFFER_COUNT) {
+        target = workspace_.view(cumulative, targetRows, targetCols,
+                                 energyMap.type());
+    }
+    if (directions != BUFFER_COUNT) {
+        directionMap = workspace_.view(directions, energyMap.rows,
+                                       energyMap.cols, CV_8S);
+    }
+    {
+        CARVER_STATS_ALLOCATION(stats_, target);
+        CARVER_STATS_ALLOCATION(stats_, directionMap);
+        target.create(targetRows, targetCols, energyMap.type());
+        directionMap.create(energyMap.rows, energyMap.cols, CV_8S);
+    }
+    for (int j = 0; j < width; j++) {
+        Axis::template at<T>(target, 0, j) =
+                Axis::template at<T>(energyMap, 0, j);
+        Axis::template at<int8_t>(directionMap, 0, j) = 0;
+    }
+
+    if (nChunks <= 1) {
+        for (int i = 1; i < length; i++) {
+            calculateCumulativeLine_<direction, T>(i, 0, width, energyMap,
+                                                target, directionMap);
         }
+        return target;
     }
-    #endif
 
-    for (auto &worker : workers) {
-        worker.join();
+    for (int i0 = 1; i0 < length; i0 += bandHeight) {
+        int i1 = min(i0 + bandHeight, length);
+        CARVER_STATS_COUNT(stats_, addTasks(2 * nChunks - 1));
+        threadPool_->parallelFor(nChunks, [&](int k) {
+            int j0 = k * chunkSize;
+            int j1 = k == nChunks - 1 ? width : j0 + chunkSize;
+            calculateCumulativeTrapezoid_<direction, T>(j0, j1, i0, i1,
+                                                     energyMap, target,
+                                                     directionMap);
+        });
+        threadPool_->parallelFor(nChunks - 1, [&](int k) {
+            calculateCumulativeTriangle_<direction, T>((k + 1) * chunkSize,
+                                                    i0, i1, energyMap,
+                                                    target, directionMap);
+        });
     }
 
     return target;
 }
 
-int Carver::findMinOffset_(vector<double> nextHops) {
-    switch (std::min_element(nextHops.begin(),nextHops.end()) - nextHops.begin()) {
-    case 0:
-        return -1;
-    case 1:
-        return 0;
-    case 2:
-        return 1;
-    default:
-        throw out_of_range("Nexthop index out of range");
+template<CarveMode direction>
+cv::Mat Carver::calculateCumulativeEnergy_(cv::Mat &energyMap,
+                                           cv::Mat &directionMap,
+                                           bool rolling,
+                                           WorkspaceBuffer cumulative,
+                                           WorkspaceBuffer directions) {
+    return dispatchEnergy(energyMap.depth(), [&](auto tag) {
+        typedef typename decltype(tag)::type T;
+        return calculateCumulativeEnergy_<direction, T>(
+                    energyMap, directionMap, rolling, cumulative,
+                    directions);
+    });
+}
+
+cv::Mat Carver::calculateCumulativeEnergy(cv::Mat &energyMap) {
+    cv::Mat directionMap;
+    return calculateCumulativeEnergy_<VERTICAL>(energyMap, directionMap,
+                                                false);
+}
+
+template<CarveMode direction, typename T>
+vector<int> Carver::calculateLowestEnergyPath_(cv::Mat &source) {
+    CARVER_STATS_SCOPE(stats_, STAGE_BACKTRACK);
+    typedef SeamAxis<direction> Axis;
+    int length = Axis::length(source);
+    int width = Axis::width(source);
+    vector<int> path(length);
+
+    // Start from the minimum of the last line and climb to the smallest
+    // upper neighbour on every line
+    int minIdx = seamStart<Axis, T>(source, length - 1, width);
+    path[length - 1] = minIdx;
+
+    for (int i = length - 2; i >= 0; i--) {
+        minIdx = upperNeighbour<Axis, T>(source, i, minIdx, width);
+        path[i] = minIdx;
     }
+
+    return path;
+}
+
+template<CarveMode direction>
+vector<int> Carver::calculateLowestEnergyPath_(cv::Mat &source) {
+    return dispatchEnergy(source.depth(), [&](auto tag) {
+        typedef typename decltype(tag)::type T;
+        return calculateLowestEnergyPath_<direction, T>(source);
+    });
 }
 
 vector<int> Carver::calculateLowestEnergyPath(cv::Mat &source) {
-    vector<int> path(source.rows);
-    vector<double> nextHops(3);
-    int delta = 0;
+    return calculateLowestEnergyPath_<VERTICAL>(source);
+}
 
-    // Find the minimum of the last row, that is our starting point
-    cv::Point minIdxPoint;
-    int minIdx;
-    cv::Mat lastRow = source.row(source.rows - 1);
-    cv::minMaxLoc(lastRow, nullptr, nullptr, &minIdxPoint, nullptr);
-    minIdx = minIdxPoint.x;
-    path[source.rows - 1] = minIdx;
+template<CarveMode direction, typename T>
+void Carver::backtrackSeam_(cv::Mat &cumulativeEnergyMap,
+                            cv::Mat &directionMap, vector<int> &path) {
+    CARVER_STATS_SCOPE(stats_, STAGE_BACKTRACK);
+    typedef SeamAxis<direction> Axis;
+    int length = Axis::length(directionMap);
+    int width = Axis::width(directionMap);
+    path.resize(length);
 
-    for (int r = source.rows - 2; r >= 0; r--) {
-        nextHops[0] = source.at<double>(r, max(minIdx - 1, 0));
-        nextHops[1] = source.at<double>(r, minIdx);
-        nextHops[2] = source.at<double>(r, min(minIdx + 1, source.cols - 1));
+    // The last line sits at the end of a rolling map's ring
+    int last = (length - 1) % Axis::length(cumulativeEnergyMap);
+    int minIdx = seamStart<Axis, T>(cumulativeEnergyMap, last, width);
+    path[length - 1] = minIdx;
 
-        delta = findMinOffset_(nextHops);
+    // Back-pointers are clamped to the line, just follow them
+    for (int i = length - 1; i > 0; i--) {
+        minIdx += Axis::template at<int8_t>(directionMap, i, minIdx);
+        path[i - 1] = minIdx;
+    }
+}
+
+template<CarveMode direction>
+void Carver::backtrackSeam_(cv::Mat &cumulativeEnergyMap,
+                            cv::Mat &directionMap, vector<int> &path) {
+    dispatchEnergy(cumulativeEnergyMap.depth(), [&](auto tag) {
+        typedef typename decltype(tag)::type T;
+        backtrackSeam_<direction, T>(cumulativeEnergyMap, directionMap,
+                                     path);
+    });
+}
+
+template<CarveMode direction>
+void Carver::findSeam_(cv::Mat &energyMap, vector<int> &seam) {
+    cv::Mat &cumulativeEnergyMap = cumulativeEnergyMaps_[direction];
+    cv::Mat &directionMap = directionMaps_[direction];
 
-        // Add the discovered minimum index to our path, taking care
-        // not to cross image boundaries
-        minIdx += delta;
-        minIdx = min(max(minIdx, 0), source.cols - 1);
-        path[r] = minIdx;
+    // Without incremental updates only the back-pointers are needed
+    // later on, the cumulative map can roll over a few lines
+    if (cumulativeEnergyMap.empty()) {
+        cumulativeEnergyMap = calculateCumulativeEnergy_<direction>(
+                    energyMap, directionMap, !incrementalCumulativeEnergy_,
+                    cumulativeBuffer(direction), directionsBuffer(direction));
     }
 
-    return path;
+    backtrackSeam_<direction>(cumulativeEnergyMap, directionMap, seam);
+}
+
+template<CarveMode direction, typename T>
+vector<vector<int>> Carver::findSeams_(cv::Mat &energyMap, int count) {
+    typedef SeamAxis<direction> Axis;
+    int length = Axis::length(energyMap);
+    int width = Axis::width(energyMap);
+
+    cv::Mat directionMap;
+    cv::Mat cumulativeEnergyMap = calculateCumulativeEnergy_<direction, T>(
+                energyMap, directionMap, false, cumulativeBuffer(direction),
+                directionsBuffer(direction));
+    CARVER_STATS_SCOPE(stats_, STAGE_BACKTRACK);
+    cv::Mat used = workspace_.view(BUFFER_USED, energyMap.rows,
+                                   energyMap.cols, CV_8U);
+    {
+        CARVER_STATS_ALLOCATION(stats_, used);
+        used.create(energyMap.rows, energyMap.cols, CV_8U);
+    }
+    used.setTo(0);
+
+    // Try the seam ends from the cheapest up, equal costs in tie
+    // preference order so that the first seam is the exact one
+    vector<int> ends(width);
+    for (int k = 0; k < width; k++) {
+        ends[k] = Axis::tieOffset < 0 ? k : width - 1 - k;
+    }
+    stable_sort(ends.begin(), ends.end(), [&](int a, int b) {
+        return Axis::template at<T>(cumulativeEnergyMap, length - 1, a) <
+                Axis::template at<T>(cumulativeEnergyMap, length - 1, b);
+    });
+
+    vector<vector<int>> seams;
+    vector<int> path(length);
+    for (int end : ends) {
+        if (static_cast<int>(seams.size()) == count)
+            break;
+        if (!traceSeam<Axis, T>(cumulativeEnergyMap, directionMap, used, end,
+                                path))
+            continue;
+        for (int i = 0; i < length; i++) {
+            Axis::template at<uchar>(used, i, path[i]) = 1;
+        }
+        seams.push_back(path);
+    }
+
+    return seams;
+}
+
+template<CarveMode direction>
+int Carver::carveBatch_(cv::Mat &target, cv::Mat &grayscale,
+                        cv::Mat &energyMap, int count) {
+    vector<vector<int>> seams = dispatchEnergy(
+                energyMap.depth(), [&](auto tag) {
+        typedef typename decltype(tag)::type T;
+        return findSeams_<direction, T>(energyMap, count);
+    });
+    // Seams are committed from the far side in, so that each one is
+    // recorded in the coordinates left by removing the ones before it,
+    // as if the batch had been carved seam by seam. Seams do not cross,
+    // their first positions order them.
+    vector<int> order(seams.size());
+    vector<double> costs(seams.size());
+    for (size_t k = 0; k < seams.size(); k++) {
+        order[k] = static_cast<int>(k);
+        costs[k] = seamCost_<direction>(energyMap, seams[k]);
+    }
+    sort(order.begin(), order.end(), [&](int a, int b) {
+        return seams[a][0] > seams[b][0];
+    });
+    for (int k : order)
+        commitSeam_<direction>(energyMap, seams[k], costs[k]);
+    // Later seams of a batch cost more, the last one found decides
+    if (!seams.empty()) {
+        seamEnergies_[direction] = relativeSeamEnergy_(
+                    energyMap, seams.back(), costs.back());
+    }
+    target = removeSeams_<direction>(target, seams);
+
+    // Energies changed around every removed seam, start over
+    calculateMaps_(target, grayscale, energyMap);
+    releaseCumulativeEnergy_(VERTICAL);
+    releaseCumulativeEnergy_(HORIZONTAL);
+    return static_cast<int>(seams.size());
+}
+
+template<CarveMode direction, typename T>
+double Carver::calculateBandedPath_(cv::Mat &energyMap,
+                                    const vector<int> &centre, int halfWidth,
+                                    vector<int> &path) {
+    CARVER_STATS_SCOPE(stats_, STAGE_CUMULATIVE);
+    typedef SeamAxis<direction> Axis;
+    int length = Axis::length(energyMap);
+    int width = Axis::width(energyMap);
+    int bandWidth = min(2 * halfWidth + 1, width);
+    const double unreachable = numeric_limits<double>::infinity();
+
+    // Bands keep their width at the image edges. Cells outside the band
+    // of a line are unreachable, the sums are kept in double so that
+    // saturating energy types cannot be mistaken for unreachable cells.
+    vector<int> &lo = workspace_.bandStarts(direction);
+    lo.resize(length);
+    cv::Mat sums = workspace_.view(
+                searchBuffer(BUFFER_BAND_SUMS_VERTICAL, direction), length,
+                bandWidth, CV_64F);
+    cv::Mat directions = workspace_.view(
+                searchBuffer(BUFFER_BAND_DIRECTIONS_VERTICAL, direction),
+                length, bandWidth, CV_8S);
+    {
+        CARVER_STATS_ALLOCATION(stats_, sums);
+        CARVER_STATS_ALLOCATION(stats_, directions);
+        sums.create(length, bandWidth, CV_64F);
+        directions.create(length, bandWidth, CV_8S);
+    }
+
+    for (int i = 0; i < length; i++) {
+        lo[i] = min(max(centre[i] - halfWidth, 0), width - bandWidth);
+        double *line = sums.ptr<double>(i);
+        int8_t *pointers = directions.ptr<int8_t>(i);
+
+        for (int b = 0; b < bandWidth; b++) {
+            int j = lo[i] + b;
+            double energy = Axis::template at<T>(energyMap, i, j);
+            if (i == 0) {
+                line[b] = energy;
+                pointers[b] = 0;
+                continue;
+            }
+
+            // Upper neighbours in tie preference order
+            const double *upper = line - bandWidth;
+            int candidates[3] = {
+                min(max(j + Axis::tieOffset, 0), width - 1), j,
+                min(max(j - Axis::tieOffset, 0), width - 1)
+            };
+            double best = unreachable;
+            int bestIdx = j;
+            for (int k : candidates) {
+                int ub = k - lo[i - 1];
+                if (ub < 0 || ub >= bandWidth)
+                    continue;
+                if (upper[ub] < best) {
+                    best = upper[ub];
+                    bestIdx = k;
+                }
+            }
+            line[b] = energy + best;
+            pointers[b] = static_cast<int8_t>(bestIdx - j);
+        }
+    }
+
+    // Seam end in tie preference order, then follow the back-pointers
+    const double *last = sums.ptr<double>(length - 1);
+    int end = 0;
+    for (int k = 0; k < bandWidth; k++) {
+        int b = Axis::tieOffset < 0 ? k : bandWidth - 1 - k;
+        if (k == 0 || last[b] < last[end])
+            end = b;
+    }
+
+    path.resize(length);
+    int j = lo[length - 1] + end;
+    path[length - 1] = j;
+    for (int i = length - 1; i > 0; i--) {
+        j += directions.at<int8_t>(i, j - lo[i]);
+        path[i - 1] = j;
+    }
+    return last[end];
+}
+
+template<CarveMode direction>
+void Carver::calculateExactPath_(cv::Mat &energyMap, vector<int> &path) {
+    cv::Mat directionMap;
+    cv::Mat cumulativeEnergyMap = calculateCumulativeEnergy_<direction>(
+                energyMap, directionMap, true,
+                searchBuffer(BUFFER_SEARCH_CUMULATIVE_VERTICAL, direction),
+                searchBuffer(BUFFER_SEARCH_DIRECTIONS_VERTICAL, direction));
+    backtrackSeam_<direction>(cumulativeEnergyMap, directionMap, path);
+}
+
+template<CarveMode direction, typename T>
+void Carver::calculatePyramidPath_(cv::Mat &energyMap, vector<int> &path) {
+    typedef SeamAxis<direction> Axis;
+
+    // Not every energy type can be downsampled, the pyramid only guides
+    // the search and is built in single precision. Levels follow each
+    // other in the pyramid buffer.
+    WorkspaceBuffer buffer = searchBuffer(BUFFER_PYRAMID_VERTICAL,
+                                          direction);
+    vector<cv::Mat> &levels = workspace_.pyramid(direction);
+    levels.clear();
+    {
+        CARVER_STATS_SCOPE(stats_, STAGE_PYRAMID);
+        cv::Mat level = workspace_.view(buffer, energyMap.rows,
+                                        energyMap.cols, CV_32F);
+        {
+            CARVER_STATS_ALLOCATION(stats_, level);
+            energyMap.convertTo(level, CV_32F);
+        }
+        levels.push_back(level);
+        size_t offset = level.total() * level.elemSize();
+        while (min(level.rows, level.cols) >= 2 * pyramidMinSize_) {
+            cv::Mat coarser = workspace_.view(buffer,
+                                              (level.rows + 1) / 2,
+                                              (level.cols + 1) / 2, CV_32F,
+                                              offset);
+            {
+                CARVER_STATS_ALLOCATION(stats_, coarser);
+                cv::pyrDown(level, coarser);
+            }
+            offset += coarser.total() * coarser.elemSize();
+            levels.push_back(coarser);
+            level = coarser;
+        }
+    }
+    if (levels.size() == 1) {
+        calculateExactPath_<direction>(energyMap, path);
+        return;
+    }
+
+    calculateExactPath_<direction>(levels.back(), path);
+
+    // Project the seam onto the next finer level and refine it there
+    vector<int> &centre = workspace_.bandCentre(direction);
+    for (int l = static_cast<int>(levels.size()) - 2; l >= 0; l--) {
+        int length = Axis::length(levels[l]);
+        int width = Axis::width(levels[l]);
+        centre.resize(length);
+        for (int i = 0; i < length; i++) {
+            int coarse = min(i / 2, static_cast<int>(path.size()) - 1);
+            centre[i] = min(2 * path[coarse], width - 1);
+        }
+
+        if (l > 0) {
+            calculateBandedPath_<direction, float>(levels[l], centre,
+                                                   pyramidBand_, path);
+        } else {
+            calculateBandedPath_<direction, T>(energyMap, centre,
+                                               pyramidBand_, path);
+        }
+    }
+}
+
+template<CarveMode direction, typename T>
+void Carver::calculateLocalPath_(cv::Mat &energyMap, vector<int> &path) {
+    typedef SeamAxis<direction> Axis;
+    int length = Axis::length(energyMap);
+    int width = Axis::width(energyMap);
+    vector<int> &previous = lastSeams_[direction];
+    double &bound = seamCostBounds_[direction];
+
+    // The previous seam is one line longer or shorter after a seam in the
+    // other direction, which shifts the band by at most one position
+    int previousLength = static_cast<int>(previous.size());
+    if (previousLength > 0 && abs(previousLength - length) <= 1) {
+        vector<int> &centre = workspace_.bandCentre(direction);
+        centre.resize(length);
+        for (int i = 0; i < length; i++) {
+            centre[i] = min(previous[min(i, previousLength - 1)], width - 1);
+        }
+
+        double cost = calculateBandedPath_<direction, T>(
+                    energyMap, centre, bandWidth_, path);
+        if (cost <= bound * (1.0 + bandMargin_)) {
+            previous.assign(path.begin(), path.end());
+            return;
+        }
+    }
+
+    // Full search, its cost is the new bound for the band searches
+    calculateExactPath_<direction>(energyMap, path);
+    bound = 0;
+    for (int i = 0; i < length; i++) {
+        bound += Axis::template at<T>(energyMap, i, path[i]);
+    }
+    previous.assign(path.begin(), path.end());
+}
+
+template<CarveMode direction>
+void Carver::nextSeam_(cv::Mat &energyMap, bool cached, vector<int> &seam) {
+    if (seamEngine_ == ENGINE_EXACT && cached) {
+        findSeam_<direction>(energyMap, seam);
+        return;
+    }
+
+    // The other engines search in the workspace and write the seam in
+    // place, keeping the storage of the target
+    if (seamEngine_ == ENGINE_BANDED) {
+        dispatchEnergy(energyMap.depth(), [&](auto tag) {
+            typedef typename decltype(tag)::type T;
+            calculateLocalPath_<direction, T>(energyMap, seam);
+        });
+    } else if (seamEngine_ == ENGINE_PYRAMID) {
+        dispatchEnergy(energyMap.depth(), [&](auto tag) {
+            typedef typename decltype(tag)::type T;
+            calculatePyramidPath_<direction, T>(energyMap, seam);
+        });
+    } else {
+        calculateExactPath_<direction>(energyMap, seam);
+    }
+}
+
+template<CarveMode direction>
+double Carver::seamCost_(cv::Mat &energyMap, const vector<int> &seam) {
+    typedef SeamAxis<direction> Axis;
+    return dispatchEnergy(energyMap.depth(), [&](auto tag) {
+        typedef typename decltype(tag)::type T;
+        double cost = 0;
+        for (int i = 0; i < Axis::length(energyMap); i++) {
+            cost += Axis::template at<T>(energyMap, i, seam[i]);
+        }
+        return cost;
+    });
+}
+
+template<CarveMode direction>
+double Carver::searchSeam_(cv::Mat &energyMap, vector<int> &seam) {
+    typedef SeamAxis<direction> Axis;
+    size_t index = static_cast<size_t>(seamCounts_[direction]);
+    const vector<vector<int>> &guides = seamGuides_.seams[direction];
+    bool guided = false;
+
+    // Guides come from an image of the same size, so the seam at the
+    // same step crosses the same number of lines
+    if (index < guides.size() &&
+            static_cast<int>(guides[index].size()) == Axis::length(energyMap)) {
+        // A rejected seam is searched again over the same storage
+        double cost = dispatchEnergy(energyMap.depth(), [&](auto tag) {
+            typedef typename decltype(tag)::type T;
+            return calculateBandedPath_<direction, T>(
+                        energyMap, guides[index], guideBand_, seam);
+        });
+        double bound = seamGuides_.costs[direction][index];
+        guided = cost <= bound * (1.0 + bandMargin_);
+    }
+    if (!guided)
+        nextSeam_<direction>(energyMap, true, seam);
+    return seamCost_<direction>(energyMap, seam);
+}
+
+template<CarveMode direction>
+void Carver::commitSeam_(const cv::Mat &energyMap, const vector<int> &seam,
+                         double cost) {
+    seamCounts_[direction]++;
+    seamEnergies_[direction] = relativeSeamEnergy_(energyMap, seam, cost);
+    if (recordSeams_) {
+        carvedSeams_.seams[direction].push_back(seam);
+        carvedSeams_.costs[direction].push_back(cost);
+    }
+}
+
+double Carver::relativeSeamEnergy_(const cv::Mat &energyMap,
+                                   const vector<int> &seam,
+                                   double cost) const {
+    // Floating point energies are scaled to [0, 1], fixed-point ones not
+    int depth = energyMap.depth();
+    double range = depth == CV_64F || depth == CV_32F
+            ? 1.0 : 255.0 / (1 << energyShift_);
+    return seam.empty() ? 0 : cost / (range * seam.size());
+}
+
+void Carver::releaseCumulativeEnergy_(CarveMode direction) {
+    cumulativeEnergyMaps_[direction].release();
+    directionMaps_[direction].release();
+}
+
+template<CarveMode direction, typename T>
+void Carver::updateCumulativeEnergy_(cv::Mat &energyMap,
+                                     const vector<int> &seam) {
+    typedef SeamAxis<direction> Axis;
+    constexpr CarveMode other = direction == VERTICAL ? HORIZONTAL : VERTICAL;
+    int length = Axis::length(energyMap);
+    int width = Axis::width(energyMap);
+    vector<cv::Range> &dirty = workspace_.footprint();
+    energyFootprint_(seam, length, width, dirty);
+
+    // The other direction's map is shifted on the pool meanwhile, the
+    // two only share the energy map and the footprint, which neither
+    // writes
+    future<void> shift;
+    if (!cumulativeEnergyMaps_[other].empty()) {
+        CARVER_STATS_COUNT(stats_, addTasks(1));
+        shift = threadPool_->submit([&] {
+            shiftCumulativeEnergy_<other, T>(energyMap, seam, dirty);
+        });
+    }
+    cv::Mat &cumulativeEnergyMap = cumulativeEnergyMaps_[direction];
+    cv::Mat &directionMap = directionMaps_[direction];
+    if (!incrementalCumulativeEnergy_ || cumulativeEnergyMap.empty()) {
+        releaseCumulativeEnergy_(direction);
+        if (shift.valid())
+            threadPool_->wait(shift);
+        return;
+    }
+
+    cumulativeEnergyMap = removeSeam_<direction>(cumulativeEnergyMap, seam);
+    directionMap = removeSeam_<direction>(directionMap, seam);
+    CARVER_STATS_SCOPE(stats_, STAGE_CUMULATIVE);
+
+    // Cells that changed on the previous line, [changedLo, changedHi)
+    int changedLo = 0;
+    int changedHi = 0;
+
+    for (int i = 0; i < length; i++) {
+        int lo = dirty[i].start;
+        int hi = dirty[i].end;
+
+        if (i > 0) {
+            // Cells whose upper neighbours moved relative to them
+            lo = min(lo, min(seam[i - 1] - 1, seam[i]));
+            hi = max(hi, max(seam[i] - 1, seam[i - 1]) + 1);
+
+            // Cells below a changed cell
+            if (changedLo < changedHi) {
+                lo = min(lo, changedLo - 1);
+                hi = max(hi, changedHi + 1);
+            }
+        }
+        lo = max(lo, 0);
+        hi = min(hi, width);
+
+        changedLo = width;
+        changedHi = 0;
+
+        for (int j = lo; j < hi; j++) {
+            T value = Axis::template at<T>(energyMap, i, j);
+            if (i > 0) {
+                // The back-pointer may change even if the value does not
+                int k = upperNeighbour<Axis, T>(cumulativeEnergyMap, i - 1,
+                                                j, width);
+                T pre = Axis::template at<T>(cumulativeEnergyMap, i - 1, k);
+                value = cumulativeCell(value, pre, pre, pre);
+                Axis::template at<int8_t>(directionMap, i, j) =
+                        static_cast<int8_t>(k - j);
+            }
+
+            T &target = Axis::template at<T>(cumulativeEnergyMap, i, j);
+            if (value != target) {
+                target = value;
+                changedLo = min(changedLo, j);
+                changedHi = j + 1;
+            }
+        }
+    }
+    if (shift.valid())
+        threadPool_->wait(shift);
+}
+
+template<CarveMode direction, typename T>
+void Carver::shiftCumulativeEnergy_(cv::Mat &energyMap,
+                                    const vector<int> &seam,
+                                    const vector<cv::Range> &footprint) {
+    typedef SeamAxis<direction> Axis;
+    constexpr CarveMode across = direction == VERTICAL ? HORIZONTAL
+                                                       : VERTICAL;
+    cv::Mat &cumulativeEnergyMap = cumulativeEnergyMaps_[direction];
+    cv::Mat &directionMap = directionMaps_[direction];
+    if (!incrementalCumulativeEnergy_) {
+        releaseCumulativeEnergy_(direction);
+        return;
+    }
+
+    CARVER_STATS_SCOPE(stats_, STAGE_CUMULATIVE);
+    cumulativeEnergyMap = removeSeam_<across>(cumulativeEnergyMap, seam);
+    directionMap = removeSeam_<across>(directionMap, seam);
+    int length = Axis::length(energyMap);
+    int width = Axis::width(energyMap);
+
+    // Cells before the seam and its footprint on every line across this
+    // map neither moved nor changed
+    int first = length;
+    for (size_t k = 0; k < seam.size(); k++) {
+        first = min(first, min(seam[k], footprint[k].start));
+    }
+    if (first == 0) {
+        for (int j = 0; j < width; j++) {
+            Axis::template at<T>(cumulativeEnergyMap, 0, j) =
+                    Axis::template at<T>(energyMap, 0, j);
+            Axis::template at<int8_t>(directionMap, 0, j) = 0;
+        }
+        first = 1;
+    }
+    for (int i = first; i < length; i++) {
+        calculateCumulativeLine_<direction, T>(i, 0, width, energyMap,
+                                               cumulativeEnergyMap,
+                                               directionMap);
+    }
+}
+
+template<CarveMode direction>
+void Carver::updateCumulativeEnergy_(cv::Mat &energyMap,
+                                     const vector<int> &seam) {
+    dispatchEnergy(energyMap.depth(), [&](auto tag) {
+        typedef typename decltype(tag)::type T;
+        updateCumulativeEnergy_<direction, T>(energyMap, seam);
+    });
 }
 
 vector<int> Carver::getSeamToRemove(cv::Mat &energyMap,
                                     CarveMode direction) {
-    // Intermediate variables needed by the algorithm.
-    cv::Mat source;
-    cv::Mat cumulativeEnergyMap;
-    cv::Mat result;
-    vector<int> lowestEnergyPath;
-
-    // Rotate the image on horizontal operations to be able to use the same
-    // algorithms as-is
+    vector<int> seam;
     if (direction == HORIZONTAL) {
-        cv::rotate(energyMap, source, cv::ROTATE_90_CLOCKWISE);
+        nextSeam_<HORIZONTAL>(energyMap, false, seam);
     } else {
-        source = energyMap;
+        nextSeam_<VERTICAL>(energyMap, false, seam);
+    }
+    return seam;
+}
+
+template<>
+cv::Mat Carver::removeSeam_<VERTICAL>(cv::Mat &source,
+                                      const vector<int> &seam) {
+    CARVER_STATS_SCOPE(stats_, STAGE_REMOVAL);
+    size_t pixelSize = source.elemSize();
+
+    for (int r = 0; r < source.rows; r++) {
+        uchar *row = source.ptr(r);
+        int c = seam[r];
+        memmove(row + c * pixelSize, row + (c + 1) * pixelSize,
+                (source.cols - c - 1) * pixelSize);
     }
 
-    cumulativeEnergyMap = calculateCumulativeEnergy(source);
-    lowestEnergyPath = calculateLowestEnergyPath(cumulativeEnergyMap);
+    return source(cv::Rect(0, 0, source.cols - 1, source.rows));
+}
 
-    return lowestEnergyPath;
+template<>
+cv::Mat Carver::removeSeam_<HORIZONTAL>(cv::Mat &source,
+                                        const vector<int> &seam) {
+    CARVER_STATS_SCOPE(stats_, STAGE_REMOVAL);
+    size_t pixelSize = source.elemSize();
+
+    // Pull the pixels below the seam up by one row, streaming over the
+    // rows and copying runs of columns where the seam lies above
+    for (int r = 0; r < source.rows - 1; r++) {
+        uchar *row = source.ptr(r);
+        const uchar *next = source.ptr(r + 1);
+        int c = 0;
+        while (c < source.cols) {
+            if (seam[c] > r) {
+                c++;
+                continue;
+            }
+            int c0 = c;
+            while (c < source.cols && seam[c] <= r) {
+                c++;
+            }
+            memcpy(row + c0 * pixelSize, next + c0 * pixelSize,
+                   (c - c0) * pixelSize);
+        }
+    }
+
+    return source(cv::Rect(0, 0, source.cols, source.rows - 1));
+}
+
+vector<int> Carver::sortedSeamPositions_(const vector<vector<int>> &seams,
+                                         int length) {
+    int n = static_cast<int>(seams.size());
+    vector<int> positions(static_cast<size_t>(length) * n);
+    for (int i = 0; i < length; i++) {
+        int *line = &positions[static_cast<size_t>(i) * n];
+        for (int s = 0; s < n; s++) {
+            line[s] = seams[s][i];
+        }
+        sort(line, line + n);
+    }
+    return positions;
 }
 
-cv::Mat Carver::removeSeam(cv::Mat &source, vector<int> seam) {
-    cv::Mat target = cv::Mat(source.rows, source.cols - 1, source.type(),
-                             double(0));
+template<>
+cv::Mat Carver::removeSeams_<VERTICAL>(cv::Mat &source,
+                                       const vector<vector<int>> &seams) {
+    CARVER_STATS_SCOPE(stats_, STAGE_REMOVAL);
+    int n = static_cast<int>(seams.size());
+    if (n == 0)
+        return source;
+    size_t pixelSize = source.elemSize();
+    vector<int> positions = sortedSeamPositions_(seams, source.rows);
 
+    // Close the gaps left by the removed pixels one run at a time
     for (int r = 0; r < source.rows; r++) {
-        cv::Mat a,b;
-        cv::Mat result;
-        source(cv::Range(r,r+1), cv::Range(0, seam[r])).copyTo(a);
-        source(cv::Range(r,r+1), cv::Range(seam[r] + 1, source.cols)).copyTo(b);
-        if (a.empty()) {
-            result = b;
-        } else if (b.empty()) {
-            result = a;
-        } else {
-            cv::hconcat(a,b,result);
+        uchar *row = source.ptr(r);
+        const int *removed = &positions[static_cast<size_t>(r) * n];
+        int write = removed[0];
+        for (int s = 0; s < n; s++) {
+            int c0 = removed[s] + 1;
+            int c1 = s + 1 < n ? removed[s + 1] : source.cols;
+            memmove(row + write * pixelSize, row + c0 * pixelSize,
+                    (c1 - c0) * pixelSize);
+            write += c1 - c0;
         }
+    }
+
+    return source(cv::Rect(0, 0, source.cols - n, source.rows));
+}
+
+template<>
+cv::Mat Carver::removeSeams_<HORIZONTAL>(cv::Mat &source,
+                                         const vector<vector<int>> &seams) {
+    CARVER_STATS_SCOPE(stats_, STAGE_REMOVAL);
+    int n = static_cast<int>(seams.size());
+    if (n == 0)
+        return source;
+    size_t pixelSize = source.elemSize();
+    vector<int> positions = sortedSeamPositions_(seams, source.cols);
 
-        result.copyTo(target.row(r));
+    // Every target row pulls each column from the source row below it
+    // that skips the removed pixels seen so far in that column. Source
+    // rows are never above the target row, so nothing is read after
+    // being overwritten.
+    vector<int> skipped(source.cols, 0);
+    for (int r = 0; r < source.rows - n; r++) {
+        for (int c = 0; c < source.cols; c++) {
+            const int *removed = &positions[static_cast<size_t>(c) * n];
+            while (skipped[c] < n && removed[skipped[c]] <= r + skipped[c]) {
+                skipped[c]++;
+            }
+        }
+
+        uchar *row = source.ptr(r);
+        int c = 0;
+        while (c < source.cols) {
+            int k = skipped[c];
+            int c0 = c;
+            while (c < source.cols && skipped[c] == k) {
+                c++;
+            }
+            if (k > 0) {
+                memcpy(row + c0 * pixelSize,
+                       source.ptr(r + k) + c0 * pixelSize,
+                       (c - c0) * pixelSize);
+            }
+        }
     }
 
-    return target;
+    return source(cv::Rect(0, 0, source.cols, source.rows - n));
+}
 
+cv::Mat Carver::removeSeam(cv::Mat &source, const vector<int> &seam) {
+    return removeSeam_<VERTICAL>(source, seam);
 }
 
 cv::Mat Carver::removeVerticalSeam(cv::Mat &source,
-                                   vector<int> verticalSeam) {
-    return removeSeam(source, verticalSeam);
+                                   const vector<int> &verticalSeam) {
+    return removeSeam_<VERTICAL>(source, verticalSeam);
 }
 
 cv::Mat Carver::removeHorizontalSeam(cv::Mat &source,
-                                     vector<int> horizontalSeam) {
-    cv::Mat flipped, target;
-    cv::rotate(source, flipped, cv::ROTATE_90_CLOCKWISE);
-    flipped = removeSeam(flipped, horizontalSeam);
-    cv::rotate(flipped, target, cv::ROTATE_90_COUNTERCLOCKWISE);
-    return target;
-
+                                     const vector<int> &horizontalSeam) {
+    return removeSeam_<HORIZONTAL>(source, horizontalSeam);
 }
 
-cv::Mat Carver::removeSeams(cv::Mat &source, vector<int> verticalSeam,
-                            vector<int> horizontalSeam) {
+cv::Mat Carver::removeSeams(cv::Mat &source,
+                            const vector<int> &verticalSeam,
+                            const vector<int> &horizontalSeam) {
     cv::Mat target = source;
     target = removeVerticalSeam(source, verticalSeam);
     target = removeHorizontalSeam(target, horizontalSeam);
     return target;
 }
 
+void Carver::calculateGrayscale_(cv::Mat &target, cv::Mat &grayscale) {
+    CARVER_STATS_SCOPE(stats_, STAGE_GRAYSCALE);
+    CARVER_STATS_ALLOCATION(stats_, grayscale);
+    cv::cvtColor(target, grayscale, cv::COLOR_BGR2GRAY);
+}
+
+void Carver::startCarve_(cv::Mat &target, cv::Mat &grayscale,
+                         cv::Mat &energyMap) {
+    if (originalImage_.empty()) {
+        throw runtime_error("Target image not loaded");
+    }
+
+    // Seams are removed in place, keep the original intact unless the
+    // caller handed its pixels over
+    if (overwriteTarget_) {
+        target = originalImage_;
+        originalImage_.release();
+    } else {
+        target = originalImage_.clone();
+        CARVER_STATS_COUNT(stats_, addAllocation(target));
+    }
+    reserveWorkspace_();
+    energyShift_ = 0;
+    calculateMaps_(target, grayscale, energyMap);
+    fitFixedEnergy_(energyMap);
+    releaseCumulativeEnergy_(VERTICAL);
+    releaseCumulativeEnergy_(HORIZONTAL);
+    lastSeams_[VERTICAL].clear();
+    lastSeams_[HORIZONTAL].clear();
+    for (int d = 0; d < 2; d++) {
+        seamCounts_[d] = 0;
+        if (recordSeams_) {
+            carvedSeams_.seams[d].clear();
+            carvedSeams_.costs[d].clear();
+        }
+    }
+}
+
+template<CarveMode direction>
+const vector<int> &Carver::carveSeam_(cv::Mat &target, cv::Mat &grayscale,
+                                      cv::Mat &energyMap) {
+    vector<int> &seam = workspace_.seam(direction);
+    double cost = searchSeam_<direction>(energyMap, seam);
+    commitSeam_<direction>(energyMap, seam, cost);
+    target = removeSeam_<direction>(target, seam);
+    updateMaps_(target, grayscale, energyMap, seam, direction);
+    updateCumulativeEnergy_<direction>(energyMap, seam);
+    return seam;
+}
+
+CarveMode Carver::carveCheaperSeam_(cv::Mat &target, cv::Mat &grayscale,
+                                    cv::Mat &energyMap) {
+    vector<int> &verticalSeam = workspace_.seam(VERTICAL);
+    vector<int> &horizontalSeam = workspace_.seam(HORIZONTAL);
+
+    // Search the horizontal seam on the pool while this thread handles
+    // the vertical one. Both cumulative maps are kept up to date across
+    // iterations, so a search is mostly a backtrack. Every search buffer
+    // of the workspace comes once per direction.
+    double horizontalCost = 0;
+    CARVER_STATS_COUNT(stats_, addTasks(1));
+    auto horizontalSearch = threadPool_->submit([&] {
+        horizontalCost = searchSeam_<HORIZONTAL>(energyMap, horizontalSeam);
+    });
+    double verticalCost = searchSeam_<VERTICAL>(energyMap, verticalSeam);
+    threadPool_->wait(horizontalSearch);
+
+    // Ties go to the vertical seam
+    CarveMode direction = verticalCost <= horizontalCost ? VERTICAL
+                                                         : HORIZONTAL;
+    const vector<int> &seam = direction == VERTICAL ? verticalSeam
+                                                    : horizontalSeam;
+    if (direction == VERTICAL)
+        commitSeam_<VERTICAL>(energyMap, seam, verticalCost);
+    else
+        commitSeam_<HORIZONTAL>(energyMap, seam, horizontalCost);
+
+    // The incremental maps are updated from the grayscale map alone, so
+    // the image itself shrinks on the pool meanwhile
+    future<void> removal;
+    if (incrementalEnergy_) {
+        CARVER_STATS_COUNT(stats_, addTasks(1));
+        removal = threadPool_->submit([&] {
+            target = direction == VERTICAL
+                    ? removeVerticalSeam(target, seam)
+                    : removeHorizontalSeam(target, seam);
+        });
+    } else {
+        target = direction == VERTICAL ? removeVerticalSeam(target, seam)
+                                       : removeHorizontalSeam(target, seam);
+    }
+    updateMaps_(target, grayscale, energyMap, seam, direction);
+    if (direction == VERTICAL)
+        updateCumulativeEnergy_<VERTICAL>(energyMap, seam);
+    else
+        updateCumulativeEnergy_<HORIZONTAL>(energyMap, seam);
+    if (removal.valid())
+        threadPool_->wait(removal);
+    return direction;
+}
+
+template<CarveMode direction>
+SeamIndexMap Carver::buildSeamIndexMap_(int seamCount) {
+    typedef SeamAxis<direction> Axis;
+    int length = Axis::length(originalImage_);
+    int width = Axis::width(originalImage_);
+
+    if (seamCount < 0 || seamCount >= width) {
+        throw out_of_range("Number of seams to record " +
+                           to_string(seamCount) +
+                           " out of range for image of size " +
+                           to_string(originalImage_.cols) + "x" +
+                           to_string(originalImage_.rows));
+    }
+
+    cv::Mat target;
+    cv::Mat grayscale;
+    cv::Mat energyMap;
+    startCarve_(target, grayscale, energyMap);
+    CARVER_STATS_COUNT(stats_, reserveIterations(seamCount));
+
+    // Pixels never removed keep the seam count. The origin map follows
+    // the carve and holds the original position of every pixel left.
+    cv::Mat order(imageRows_, imageCols_, CV_32S, cv::Scalar(seamCount));
+    cv::Mat origin(imageRows_, imageCols_, CV_32S);
+    for (int i = 0; i < length; i++) {
+        for (int j = 0; j < width; j++) {
+            Axis::template at<int>(origin, i, j) = j;
+        }
+    }
+
+    for (int s = 0; s < seamCount; s++) {
+        const vector<int> &seam = carveSeam_<direction>(target, grayscale,
+                                                        energyMap);
+        for (int i = 0; i < length; i++) {
+            int position = Axis::template at<int>(origin, i, seam[i]);
+            Axis::template at<int>(order, i, position) = s;
+        }
+        origin = removeSeam_<direction>(origin, seam);
+        CARVER_STATS_COUNT(stats_, endIteration());
+        log_("Recording seam " + to_string(s + 1) + "/" +
+             to_string(seamCount), true);
+    }
+    CARVER_STATS_COUNT(stats_, addSeams(seamCount));
+    log_("");
+
+    return SeamIndexMap(direction, order, seamCount);
+}
+
+SeamIndexMap Carver::buildSeamIndexMap(CarveMode direction, int seamCount) {
+    switch (direction) {
+    case VERTICAL:
+        return buildSeamIndexMap_<VERTICAL>(seamCount);
+    case HORIZONTAL:
+        return buildSeamIndexMap_<HORIZONTAL>(seamCount);
+    default:
+        throw invalid_argument("Seam index maps are recorded for a single "
+                               "direction");
+    }
+}
+
 void Carver::carveImage(string outputPath) {
     cv::Mat target = carveImage();
     cv::imwrite(outputPath, target);
     log_("Saved output image as " + outputPath);
 }
 
-cv::Mat Carver::carveImage() {
-    // Set the iteration counters and max values
-    int v = 0;
-    int h = 0;
+void Carver::carveImage(uchar *data, size_t step) {
+    cv::Size size = getResultSize();
+    if (!data || step < size.width * 3 * sizeof(uchar)) {
+        throw invalid_argument("Output buffer invalid");
+    }
+    // The wrapper already has the result size, so copyTo writes into it
+    cv::Mat output(size, CV_8UC3, data, step);
+    carveImage().copyTo(output);
+}
+
+bool Carver::carveImageEncoded(const string &extension,
+                               vector<uchar> &buffer) {
+    return cv::imencode(extension, carveImage(), buffer);
+}
+
+cv::Size Carver::getResultSize() {
+    if (originalImage_.empty()) {
+        throw runtime_error("Target image not loaded");
+    }
+    calculateIterations_();
+    return cv::Size(imageCols_ - vIterations_, imageRows_ - hIterations_);
+}
+
+size_t Carver::getWorkspaceSize() {
+    if (originalImage_.empty()) {
+        throw runtime_error("Target image not loaded");
+    }
+    size_t total = 0;
+    for (int b = 0; b < BUFFER_COUNT; b++) {
+        total += workspaceBytes_(static_cast<WorkspaceBuffer>(b));
+    }
+    return total;
+}
+
+CarverStats Carver::getStats() const {
+    return stats_.stats();
+}
 
+void Carver::resetStats() {
+    stats_.reset();
+}
+
+void Carver::calculateIterations_() {
     if (!carveCount_) {
         vIterations_ = carveMode_ == BOTH || carveMode_ == VERTICAL ?
                     static_cast<int>(imageCols_ * carveAmount_) : 0;
@@ -280,59 +1845,208 @@ cv::Mat Carver::carveImage() {
                                 to_string(imageCols_) + "x" +
                                 to_string(imageRows_)));
     }
+}
+
+void Carver::checkCancelled_() const {
+    if (cancelToken_.cancelled())
+        throw CarveCancelled();
+}
+
+bool Carver::deadlineNear_(chrono::steady_clock::time_point start,
+                           double iterationSeconds) const {
+    if (!hasDeadline_ && timeBudget_ == 0)
+        return false;
+    auto deadline = chrono::steady_clock::time_point::max();
+    if (hasDeadline_)
+        deadline = deadline_;
+    if (timeBudget_ > 0) {
+        deadline = min(deadline, start + chrono::duration_cast<
+                       chrono::steady_clock::duration>(
+                           chrono::duration<double>(timeBudget_)));
+    }
+    // One iteration to carve and one to spare for resizing the rest
+    auto reserve = chrono::duration_cast<chrono::steady_clock::duration>(
+                chrono::duration<double>(2 * iterationSeconds));
+    return chrono::steady_clock::now() + reserve > deadline;
+}
 
+CarveStop Carver::carveStop_(chrono::steady_clock::time_point start,
+                             double iterationSeconds, int carvedSeams) const {
+    if (deadlineNear_(start, iterationSeconds))
+        return STOP_TIME;
+    if (seamBudget_ > 0 && carvedSeams >= seamBudget_)
+        return STOP_SEAM_BUDGET;
+    if (hybridThreshold_ > 0 && max(seamEnergies_[VERTICAL],
+                                    seamEnergies_[HORIZONTAL])
+            > hybridThreshold_)
+        return STOP_SEAM_COST;
+    return STOP_NONE;
+}
+
+void Carver::reportProgress_(chrono::steady_clock::time_point start,
+                             int iteration, int seamsRemaining,
+                             double seamSeconds, int resizedSeams) {
+    if (!progressCallback_)
+        return;
+    CarveProgress progress;
+    progress.iteration = iteration;
+    progress.seamsRemaining = seamsRemaining;
+    progress.elapsed = chrono::duration<double>(
+                chrono::steady_clock::now() - start).count();
+    progress.remaining = seamSeconds * seamsRemaining;
+    progress.resizedSeams = resizedSeams;
+    progressCallback_(progress);
+}
+
+cv::Mat Carver::resizeRest_(const cv::Mat &target,
+                            chrono::steady_clock::time_point start,
+                            int iteration, CarveStop stop) {
+    static const char *const reasons[] = {
+        "", "Seam cost over threshold", "Seam budget used up",
+        "Deadline near"
+    };
+    cv::Size size(imageCols_ - vIterations_, imageRows_ - hIterations_);
+    int resizedSeams = target.cols - size.width + target.rows - size.height;
+    carveSplit_.carvedSeams = vIterations_ + hIterations_ - resizedSeams;
+    carveSplit_.resizedSeams = resizedSeams;
+    carveSplit_.stop = stop;
+
+    cv::Mat result;
+    cv::resize(target, result, size, 0, 0, cv::INTER_AREA);
+    log_("\n" + string(reasons[stop]) + ", carved " +
+         to_string(carveSplit_.carvedSeams) + " seams and resized " +
+         to_string(resizedSeams) + " away");
+    reportProgress_(start, iteration, 0, 0, resizedSeams);
+    return result;
+}
+
+cv::Mat Carver::carveOutOfCore_(chrono::steady_clock::time_point start) {
+    string directory = scratchDirectory_.empty() ? defaultScratchDirectory()
+                                                 : scratchDirectory_;
+    log_("Carving out of core in " + directory);
+
+    // An overwritten target takes the result into its own buffer
+    cv::Mat source = originalImage_;
+    if (overwriteTarget_)
+        originalImage_.release();
+    TiledCarver tiled(directory, memoryLimit_, threadPool_.get());
+    int seams = vIterations_ + hIterations_;
+    CarveStop stop = STOP_NONE;
+    cv::Mat target = tiled.carve(source, vIterations_, hIterations_,
+                                 overwriteTarget_, [&](int v, int h) {
+        printStatus_(h, v);
+        checkCancelled_();
+        // Every seam is an iteration of its own
+        double seamSeconds = chrono::duration<double>(
+                    chrono::steady_clock::now() - start).count() / (v + h);
+        reportProgress_(start, v + h, seams - v - h, seamSeconds);
+        // Seams of both directions are vertical to the tiled carver
+        seamEnergies_[VERTICAL] = tiled.seamEnergy();
+        stop = carveStop_(start, seamSeconds, v + h);
+        return stop == STOP_NONE;
+    });
+    int carved = imageCols_ - target.cols + imageRows_ - target.rows;
+    CARVER_STATS_COUNT(stats_, addSeams(carved));
+    log_("");
+    if (carved < seams)
+        return resizeRest_(target, start, carved, stop);
+    reportProgress_(start, seams, 0, 0);
+    return target;
+}
+
+cv::Mat Carver::carveImage() {
+    // Set the iteration counters and max values
+    int v = 0;
+    int h = 0;
+    calculateIterations_();
 
     log_("Removing " + to_string(vIterations_) + " columns and " +
         to_string(hIterations_) + " rows");
 
+    auto start = chrono::steady_clock::now();
+    checkCancelled_();
+    carveSplit_ = CarveSplit();
+    carveSplit_.carvedSeams = vIterations_ + hIterations_;
+    seamEnergies_[VERTICAL] = 0;
+    seamEnergies_[HORIZONTAL] = 0;
+    // Past the deadline there is no time to carve anything
+    if (hasDeadline_ && start >= deadline_ && !originalImage_.empty()) {
+        cv::Mat source = originalImage_;
+        if (overwriteTarget_)
+            originalImage_.release();
+        return resizeRest_(source, start, 0, STOP_TIME);
+    }
+
+    // The working set of an in-place carve does not include a copy
+    if (memoryLimit_) {
+        size_t imageBytes = overwriteTarget_ ? 0 : originalImage_.total()
+                                                   * originalImage_.elemSize();
+        if (getWorkspaceSize() + imageBytes > memoryLimit_)
+            return carveOutOfCore_(start);
+    }
+
+    cv::Mat target;
     cv::Mat grayscale;
     cv::Mat energyMap;
-    cv::Mat target = originalImage_;
+    startCarve_(target, grayscale, energyMap);
+    CARVER_STATS_COUNT(stats_, reserveIterations(vIterations_ + hIterations_));
 
+    // Until an iteration has been timed, setting up is the best guess
+    auto loopStart = chrono::steady_clock::now();
+    double iterationSeconds = chrono::duration<double>(loopStart - start)
+            .count();
+    int iteration = 0;
+    bool resized = false;
     while(v < vIterations_ || h < hIterations_) {
-        cv::cvtColor(target, grayscale, cv::COLOR_BGR2GRAY);
-        energyMap = calculateEnergy(grayscale);
-        if (v < vIterations_ && h < hIterations_) {
-            vector<int> verticalSeam;
-            vector<int> horizontalSeam;
-
-            #ifdef CONCURRENT
-            // Invoke asynchronous processing for seam pathfinding
-            auto verticalSeamFuture =
-                    async(launch::async, [this, &energyMap] {
-                        return getSeamToRemove(energyMap, VERTICAL);
-                    });
-            auto horizontalSeamFuture =
-                    async(launch::async, [this, &energyMap] {
-                        return getSeamToRemove(energyMap, HORIZONTAL);
-                    });
-
-            // Synchronize
-            verticalSeam = verticalSeamFuture.get();
-            horizontalSeam = horizontalSeamFuture.get();
-
-            #else
-            verticalSeam = getSeamToRemove(energyMap, VERTICAL);
-            horizontalSeam = getSeamToRemove(energyMap, HORIZONTAL);
-            #endif
-
-            target = removeSeams(target, verticalSeam, horizontalSeam);
-            v++;
-            h++;
+        checkCancelled_();
+        CarveStop stop = carveStop_(start, iterationSeconds, v + h);
+        if (stop != STOP_NONE) {
+            target = resizeRest_(target, start, iteration, stop);
+            resized = true;
+            break;
+        }
+
+        if (seamBatchSize_ > 1) {
+            if (v < vIterations_) {
+                v += carveBatch_<VERTICAL>(target, grayscale, energyMap,
+                                           min(seamBatchSize_,
+                                               vIterations_ - v));
+            }
+            if (h < hIterations_) {
+                h += carveBatch_<HORIZONTAL>(target, grayscale, energyMap,
+                                             min(seamBatchSize_,
+                                                 hIterations_ - h));
+            }
+        } else if (v < vIterations_ && h < hIterations_) {
+            if (carveCheaperSeam_(target, grayscale, energyMap) == VERTICAL)
+                v++;
+            else
+                h++;
+            // The map of a finished direction would be shifted in vain
+            if (v == vIterations_)
+                releaseCumulativeEnergy_(VERTICAL);
+            if (h == hIterations_)
+                releaseCumulativeEnergy_(HORIZONTAL);
         } else if (v < vIterations_) {
-            vector<int> verticalSeam =
-                    getSeamToRemove(energyMap, VERTICAL);
-            target = removeVerticalSeam(target, verticalSeam);
+            carveSeam_<VERTICAL>(target, grayscale, energyMap);
             v++;
         } else if (h < hIterations_) {
-            vector<int> horizontalSeam =
-                    getSeamToRemove(energyMap, HORIZONTAL);
-            target = removeHorizontalSeam(target, horizontalSeam);
+            carveSeam_<HORIZONTAL>(target, grayscale, energyMap);
             h++;
         }
+        iteration++;
+        double loopSeconds = chrono::duration<double>(
+                    chrono::steady_clock::now() - loopStart).count();
+        iterationSeconds = loopSeconds / iteration;
+        CARVER_STATS_COUNT(stats_, endIteration());
         printStatus_(h, v);
+        reportProgress_(start, iteration, vIterations_ - v + hIterations_ - h,
+                        loopSeconds / (v + h));
     }
+    CARVER_STATS_COUNT(stats_, addSeams(v + h));
     log_("");
+    if (!resized)
+        reportProgress_(start, iteration, 0, 0);
     return target;
 }
 } // namespace carver
@@ -0,0 +1,127 @@
+#include <carverstats.hpp>
+
+#include <sstream>
+
+
+namespace carver {
+const char *CarverStats::stageName(CarveStage stage) {
+    switch (stage) {
+    case STAGE_GRAYSCALE:
+        return "grayscale";
+    case STAGE_ENERGY:
+        return "energy";
+    case STAGE_CUMULATIVE:
+        return "cumulative";
+    case STAGE_BACKTRACK:
+        return "backtrack";
+    case STAGE_REMOVAL:
+        return "removal";
+    case STAGE_PYRAMID:
+        return "pyramid";
+    default:
+        return "unknown";
+    }
+}
+
+string CarverStats::toJson() const {
+    ostringstream json;
+    json.precision(9);
+    json << "{\n"
+         << "  \"enabled\": " << (enabled ? "true" : "false") << ",\n"
+         << "  \"iterations\": " << iterations << ",\n"
+         << "  \"seams\": " << seams << ",\n"
+         << "  \"bytesAllocated\": " << bytesAllocated << ",\n"
+         << "  \"threadsSpawned\": " << threadsSpawned << ",\n"
+         << "  \"tasksSubmitted\": " << tasksSubmitted << ",\n"
+         << "  \"stages\": {";
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        json << (s ? "," : "") << "\n    \""
+             << stageName(static_cast<CarveStage>(s))
+             << "\": {\"seconds\": " << stageSeconds[s]
+             << ", \"calls\": " << stageCalls[s] << "}";
+    }
+
+    // Iteration timings follow the stage order above
+    json << "\n  },\n  \"iterationSeconds\": [";
+    for (size_t i = 0; i < iterationSeconds.size(); i++) {
+        json << (i ? ",\n    [" : "\n    [");
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            json << (s ? ", " : "") << iterationSeconds[i][s];
+        }
+        json << "]";
+    }
+    json << (iterationSeconds.empty() ? "]\n}" : "\n  ]\n}");
+    return json.str();
+}
+
+StatsRecorder::StatsRecorder() {
+#ifdef CARVER_STATS
+    stats_.enabled = true;
+#endif
+}
+
+StatsRecorder::StatsRecorder(const StatsRecorder &other)
+    : stats_(other.stats()) {}
+
+StatsRecorder &StatsRecorder::operator=(const StatsRecorder &other) {
+    if (this != &other) {
+        CarverStats stats = other.stats();
+        lock_guard<mutex> lock(lock_);
+        stats_ = stats;
+        iteration_.fill(0);
+    }
+    return *this;
+}
+
+void StatsRecorder::addStageTime(CarveStage stage, double seconds) {
+    lock_guard<mutex> lock(lock_);
+    stats_.stageSeconds[stage] += seconds;
+    stats_.stageCalls[stage]++;
+    iteration_[stage] += seconds;
+}
+
+void StatsRecorder::addAllocation(const cv::Mat &mat) {
+    lock_guard<mutex> lock(lock_);
+    stats_.bytesAllocated += static_cast<long>(mat.total() * mat.elemSize());
+}
+
+void StatsRecorder::addThreads(long count) {
+    lock_guard<mutex> lock(lock_);
+    stats_.threadsSpawned += count;
+}
+
+void StatsRecorder::addTasks(long count) {
+    lock_guard<mutex> lock(lock_);
+    stats_.tasksSubmitted += count;
+}
+
+void StatsRecorder::addSeams(long count) {
+    lock_guard<mutex> lock(lock_);
+    stats_.seams += count;
+}
+
+void StatsRecorder::reserveIterations(long count) {
+    lock_guard<mutex> lock(lock_);
+    stats_.iterationSeconds.reserve(stats_.iterationSeconds.size() + count);
+}
+
+void StatsRecorder::endIteration() {
+    lock_guard<mutex> lock(lock_);
+    stats_.iterations++;
+    stats_.iterationSeconds.push_back(iteration_);
+    iteration_.fill(0);
+}
+
+CarverStats StatsRecorder::stats() const {
+    lock_guard<mutex> lock(lock_);
+    return stats_;
+}
+
+void StatsRecorder::reset() {
+    lock_guard<mutex> lock(lock_);
+    bool enabled = stats_.enabled;
+    stats_ = CarverStats();
+    stats_.enabled = enabled;
+    iteration_.fill(0);
+}
+} // namespace carver
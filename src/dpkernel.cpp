@@ -0,0 +1,321 @@
+#include <dpkernel.hpp>
+
+#include <opencv2/core/core.hpp>
+
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CARVER_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+
+namespace carver {
+namespace {
+// Back-pointers are stored clamped so that walking them never leaves
+// the row
+template<typename T>
+void cumulativeRowScalar(const T *energyRow, const T *previousRow,
+                         T *targetRow, int8_t *directionRow, int c0, int c1,
+                         int cols) {
+    for (int c = c0; c < c1; c++) {
+        T pre0 = previousRow[std::max(c - 1, 0)];
+        T pre1 = previousRow[c];
+        T pre2 = previousRow[std::min(c + 1, cols - 1)];
+        targetRow[c] = cumulativeCell(energyRow[c], pre0, pre1, pre2);
+        int d = cumulativeDirection(pre0, pre1, pre2);
+        directionRow[c] = static_cast<int8_t>(
+                    std::min(std::max(c + d, 0), cols - 1) - c);
+    }
+}
+
+#ifdef CARVER_X86_KERNELS
+// Vector operations per instruction set and element type. The row drivers
+// below are compiled once per instruction set so that these inline into
+// them.
+#define CARVER_SSE41 __attribute__((target("sse4.1"), always_inline))
+#define CARVER_AVX2 __attribute__((target("avx2"), always_inline))
+
+// Back-pointers from the lane masks of the left and centre neighbours
+// being the minimum, all ones where they are: 1 + (centre | left) + left
+// gives -1 when the left one is, else 0 when the centre one is, else 1.
+// The masks are narrowed to bytes with signed saturation.
+CARVER_SSE41 inline __m128i directionMask(__m128i left, __m128i centre,
+                                          __m128i one) {
+    return _mm_add_epi32(_mm_add_epi32(one, _mm_or_si128(centre, left)),
+                         left);
+}
+
+CARVER_SSE41 inline void storeDirections16(int8_t *p, __m128i left,
+                                           __m128i centre) {
+    __m128i d = _mm_add_epi16(_mm_add_epi16(_mm_set1_epi16(1),
+                                            _mm_or_si128(centre, left)),
+                              left);
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(p), _mm_packs_epi16(d, d));
+}
+
+CARVER_SSE41 inline void storeDirections32(int8_t *p, __m128i left,
+                                           __m128i centre) {
+    __m128i d = directionMask(left, centre, _mm_set1_epi32(1));
+    d = _mm_packs_epi32(d, d);
+    int32_t packed = _mm_cvtsi128_si32(_mm_packs_epi16(d, d));
+    memcpy(p, &packed, sizeof(packed));
+}
+
+// 64-bit masks keep their low halves, which are all ones or zero too
+CARVER_SSE41 inline void storeDirections64(int8_t *p, __m128i left,
+                                           __m128i centre) {
+    __m128i d = directionMask(_mm_shuffle_epi32(left, _MM_SHUFFLE(2, 0, 2, 0)),
+                              _mm_shuffle_epi32(centre,
+                                                _MM_SHUFFLE(2, 0, 2, 0)),
+                              _mm_set1_epi32(1));
+    d = _mm_packs_epi32(d, d);
+    int16_t packed = static_cast<int16_t>(
+                _mm_cvtsi128_si32(_mm_packs_epi16(d, d)));
+    memcpy(p, &packed, sizeof(packed));
+}
+
+struct Sse41Double {
+    typedef double T;
+    typedef __m128d V;
+    static const int lanes = 2;
+    CARVER_SSE41 static V load(const T *p) { return _mm_loadu_pd(p); }
+    CARVER_SSE41 static void store(T *p, V v) { _mm_storeu_pd(p, v); }
+    CARVER_SSE41 static V min(V a, V b) { return _mm_min_pd(a, b); }
+    CARVER_SSE41 static V add(V a, V b) { return _mm_add_pd(a, b); }
+    CARVER_SSE41 static void directions(int8_t *p, V l, V c, V m) {
+        storeDirections64(p, _mm_castpd_si128(_mm_cmpeq_pd(l, m)),
+                          _mm_castpd_si128(_mm_cmpeq_pd(c, m)));
+    }
+};
+
+struct Sse41Float {
+    typedef float T;
+    typedef __m128 V;
+    static const int lanes = 4;
+    CARVER_SSE41 static V load(const T *p) { return _mm_loadu_ps(p); }
+    CARVER_SSE41 static void store(T *p, V v) { _mm_storeu_ps(p, v); }
+    CARVER_SSE41 static V min(V a, V b) { return _mm_min_ps(a, b); }
+    CARVER_SSE41 static V add(V a, V b) { return _mm_add_ps(a, b); }
+    CARVER_SSE41 static void directions(int8_t *p, V l, V c, V m) {
+        storeDirections32(p, _mm_castps_si128(_mm_cmpeq_ps(l, m)),
+                          _mm_castps_si128(_mm_cmpeq_ps(c, m)));
+    }
+};
+
+struct Sse41Fixed16 {
+    typedef uint16_t T;
+    typedef __m128i V;
+    static const int lanes = 8;
+    CARVER_SSE41 static V load(const T *p) {
+        return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    }
+    CARVER_SSE41 static void store(T *p, V v) {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(p), v);
+    }
+    CARVER_SSE41 static V min(V a, V b) { return _mm_min_epu16(a, b); }
+    CARVER_SSE41 static V add(V a, V b) { return _mm_adds_epu16(a, b); }
+    CARVER_SSE41 static void directions(int8_t *p, V l, V c, V m) {
+        storeDirections16(p, _mm_cmpeq_epi16(l, m), _mm_cmpeq_epi16(c, m));
+    }
+};
+
+// Cumulative energies are never negative, so their unsigned sum cannot
+// wrap and clamping it to the largest signed value saturates
+struct Sse41Fixed32 {
+    typedef int32_t T;
+    typedef __m128i V;
+    static const int lanes = 4;
+    CARVER_SSE41 static V load(const T *p) {
+        return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    }
+    CARVER_SSE41 static void store(T *p, V v) {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(p), v);
+    }
+    CARVER_SSE41 static V min(V a, V b) { return _mm_min_epi32(a, b); }
+    CARVER_SSE41 static V add(V a, V b) {
+        return _mm_min_epu32(_mm_add_epi32(a, b), _mm_set1_epi32(INT32_MAX));
+    }
+    CARVER_SSE41 static void directions(int8_t *p, V l, V c, V m) {
+        storeDirections32(p, _mm_cmpeq_epi32(l, m), _mm_cmpeq_epi32(c, m));
+    }
+};
+
+// AVX2 masks are narrowed through their 128-bit halves
+struct Avx2Double {
+    typedef double T;
+    typedef __m256d V;
+    static const int lanes = 4;
+    CARVER_AVX2 static V load(const T *p) { return _mm256_loadu_pd(p); }
+    CARVER_AVX2 static void store(T *p, V v) { _mm256_storeu_pd(p, v); }
+    CARVER_AVX2 static V min(V a, V b) { return _mm256_min_pd(a, b); }
+    CARVER_AVX2 static V add(V a, V b) { return _mm256_add_pd(a, b); }
+    CARVER_AVX2 static void directions(int8_t *p, V l, V c, V m) {
+        __m256i left = _mm256_castpd_si256(_mm256_cmp_pd(l, m, _CMP_EQ_OQ));
+        __m256i centre = _mm256_castpd_si256(
+                    _mm256_cmp_pd(c, m, _CMP_EQ_OQ));
+        storeDirections64(p, _mm256_castsi256_si128(left),
+                          _mm256_castsi256_si128(centre));
+        storeDirections64(p + 2, _mm256_extracti128_si256(left, 1),
+                          _mm256_extracti128_si256(centre, 1));
+    }
+};
+
+struct Avx2Float {
+    typedef float T;
+    typedef __m256 V;
+    static const int lanes = 8;
+    CARVER_AVX2 static V load(const T *p) { return _mm256_loadu_ps(p); }
+    CARVER_AVX2 static void store(T *p, V v) { _mm256_storeu_ps(p, v); }
+    CARVER_AVX2 static V min(V a, V b) { return _mm256_min_ps(a, b); }
+    CARVER_AVX2 static V add(V a, V b) { return _mm256_add_ps(a, b); }
+    CARVER_AVX2 static void directions(int8_t *p, V l, V c, V m) {
+        __m256i left = _mm256_castps_si256(_mm256_cmp_ps(l, m, _CMP_EQ_OQ));
+        __m256i centre = _mm256_castps_si256(
+                    _mm256_cmp_ps(c, m, _CMP_EQ_OQ));
+        storeDirections32(p, _mm256_castsi256_si128(left),
+                          _mm256_castsi256_si128(centre));
+        storeDirections32(p + 4, _mm256_extracti128_si256(left, 1),
+                          _mm256_extracti128_si256(centre, 1));
+    }
+};
+
+struct Avx2Fixed16 {
+    typedef uint16_t T;
+    typedef __m256i V;
+    static const int lanes = 16;
+    CARVER_AVX2 static V load(const T *p) {
+        return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+    }
+    CARVER_AVX2 static void store(T *p, V v) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(p), v);
+    }
+    CARVER_AVX2 static V min(V a, V b) { return _mm256_min_epu16(a, b); }
+    CARVER_AVX2 static V add(V a, V b) { return _mm256_adds_epu16(a, b); }
+    CARVER_AVX2 static void directions(int8_t *p, V l, V c, V m) {
+        __m256i left = _mm256_cmpeq_epi16(l, m);
+        __m256i centre = _mm256_cmpeq_epi16(c, m);
+        storeDirections16(p, _mm256_castsi256_si128(left),
+                          _mm256_castsi256_si128(centre));
+        storeDirections16(p + 8, _mm256_extracti128_si256(left, 1),
+                          _mm256_extracti128_si256(centre, 1));
+    }
+};
+
+struct Avx2Fixed32 {
+    typedef int32_t T;
+    typedef __m256i V;
+    static const int lanes = 8;
+    CARVER_AVX2 static V load(const T *p) {
+        return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+    }
+    CARVER_AVX2 static void store(T *p, V v) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(p), v);
+    }
+    CARVER_AVX2 static V min(V a, V b) { return _mm256_min_epi32(a, b); }
+    CARVER_AVX2 static V add(V a, V b) {
+        return _mm256_min_epu32(_mm256_add_epi32(a, b),
+                                _mm256_set1_epi32(INT32_MAX));
+    }
+    CARVER_AVX2 static void directions(int8_t *p, V l, V c, V m) {
+        __m256i left = _mm256_cmpeq_epi32(l, m);
+        __m256i centre = _mm256_cmpeq_epi32(c, m);
+        storeDirections32(p, _mm256_castsi256_si128(left),
+                          _mm256_castsi256_si128(centre));
+        storeDirections32(p + 4, _mm256_extracti128_si256(left, 1),
+                          _mm256_extracti128_si256(centre, 1));
+    }
+};
+
+// Interior columns have all three neighbours in range and go through the
+// vector path, cumulative energies and back-pointers alike. The clamped
+// edges and the tail go through the scalar one.
+#define CARVER_DEFINE_ROW_DRIVER(NAME, TARGET)                               \
+template<typename Ops>                                                       \
+__attribute__((target(TARGET)))                                              \
+void NAME(const typename Ops::T *energyRow,                                  \
+          const typename Ops::T *previousRow,                                \
+          typename Ops::T *targetRow, int8_t *directionRow, int c0, int c1,  \
+          int cols) {                                                        \
+    typedef typename Ops::V V;                                               \
+    int lo = std::max(c0, 1);                                                \
+    int hi = std::min(c1, cols - 1);                                         \
+    if (hi <= lo) {                                                          \
+        cumulativeRowScalar(energyRow, previousRow, targetRow, directionRow, \
+                            c0, c1, cols);                                   \
+        return;                                                              \
+    }                                                                        \
+    cumulativeRowScalar(energyRow, previousRow, targetRow, directionRow, c0, \
+                        lo, cols);                                           \
+    int c = lo;                                                              \
+    for (; c + Ops::lanes <= hi; c += Ops::lanes) {                          \
+        V left = Ops::load(previousRow + c - 1);                             \
+        V centre = Ops::load(previousRow + c);                               \
+        V right = Ops::load(previousRow + c + 1);                            \
+        V minimum = Ops::min(left, Ops::min(centre, right));                 \
+        Ops::store(targetRow + c, Ops::add(Ops::load(energyRow + c),         \
+                                           minimum));                        \
+        Ops::directions(directionRow + c, left, centre, minimum);            \
+    }                                                                        \
+    cumulativeRowScalar(energyRow, previousRow, targetRow, directionRow, c,  \
+                        c1, cols);                                           \
+}
+
+CARVER_DEFINE_ROW_DRIVER(cumulativeRowSse41, "sse4.1")
+CARVER_DEFINE_ROW_DRIVER(cumulativeRowAvx2, "avx2")
+#endif
+
+template<typename T>
+using RowKernel = void (*)(const T *, const T *, T *, int8_t *, int, int,
+                           int);
+
+template<typename T, typename Sse41Ops, typename Avx2Ops>
+RowKernel<T> selectRowKernel() {
+#ifdef CARVER_X86_KERNELS
+    if (cv::checkHardwareSupport(CV_CPU_AVX2))
+        return cumulativeRowAvx2<Avx2Ops>;
+    if (cv::checkHardwareSupport(CV_CPU_SSE4_1))
+        return cumulativeRowSse41<Sse41Ops>;
+#endif
+    return cumulativeRowScalar<T>;
+}
+} // namespace
+
+#ifdef CARVER_X86_KERNELS
+#define CARVER_ROW_KERNEL(T, SSE41, AVX2) selectRowKernel<T, SSE41, AVX2>()
+#else
+#define CARVER_ROW_KERNEL(T, SSE41, AVX2) selectRowKernel<T, void, void>()
+#endif
+
+void cumulativeRow(const double *energyRow, const double *previousRow,
+                   double *targetRow, int8_t *directionRow, int c0, int c1,
+                   int cols) {
+    static const RowKernel<double> kernel =
+            CARVER_ROW_KERNEL(double, Sse41Double, Avx2Double);
+    kernel(energyRow, previousRow, targetRow, directionRow, c0, c1, cols);
+}
+
+void cumulativeRow(const float *energyRow, const float *previousRow,
+                   float *targetRow, int8_t *directionRow, int c0, int c1,
+                   int cols) {
+    static const RowKernel<float> kernel =
+            CARVER_ROW_KERNEL(float, Sse41Float, Avx2Float);
+    kernel(energyRow, previousRow, targetRow, directionRow, c0, c1, cols);
+}
+
+void cumulativeRow(const uint16_t *energyRow, const uint16_t *previousRow,
+                   uint16_t *targetRow, int8_t *directionRow, int c0, int c1,
+                   int cols) {
+    static const RowKernel<uint16_t> kernel =
+            CARVER_ROW_KERNEL(uint16_t, Sse41Fixed16, Avx2Fixed16);
+    kernel(energyRow, previousRow, targetRow, directionRow, c0, c1, cols);
+}
+
+void cumulativeRow(const int32_t *energyRow, const int32_t *previousRow,
+                   int32_t *targetRow, int8_t *directionRow, int c0, int c1,
+                   int cols) {
+    static const RowKernel<int32_t> kernel =
+            CARVER_ROW_KERNEL(int32_t, Sse41Fixed32, Avx2Fixed32);
+    kernel(energyRow, previousRow, targetRow, directionRow, c0, c1, cols);
+}
+} // namespace carver
@@ -0,0 +1,382 @@
+#include <energykernel.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <stdexcept>
+#include <vector>
+
+// SSE2 is part of every x86-64 CPU, the row passes need no runtime
+// dispatch
+#if defined(__SSE2__)
+#define CARVER_SSE2_KERNELS
+#include <emmintrin.h>
+#endif
+
+namespace carver {
+namespace {
+// Tiles are at least this many rows high so the two halo rows recomputed
+// on each side stay a small fraction of the work, and images below this
+// many pixels are not split at all
+constexpr int minTileRows = 64;
+constexpr int minParallelPixels = 1 << 16;
+
+/**
+ * @brief reflect101 maps a position outside [0, n) back into it the way
+ * cv::BORDER_REFLECT_101 does
+ * @param p position
+ * @param n line length
+ * @return position inside the line
+ */
+inline int reflect101(int p, int n) {
+    if (n == 1)
+        return 0;
+    while (p < 0 || p >= n)
+        p = p < 0 ? -p : 2 * n - 2 - p;
+    return p;
+}
+
+// BGR to grayscale with the fixed-point weights of cv::cvtColor
+void grayRow(const uchar *bgr, uchar *gray, int cols) {
+    for (int c = 0; c < cols; c++) {
+        const uchar *p = bgr + 3 * c;
+        gray[c] = static_cast<uchar>((p[0] * 1868 + p[1] * 9617 + p[2] * 4899
+                                      + (1 << 13)) >> 14);
+    }
+}
+
+#ifdef CARVER_SSE2_KERNELS
+inline __m128i load8(const uchar *p) {
+    return _mm_unpacklo_epi8(
+                _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p)),
+                _mm_setzero_si128());
+}
+
+inline __m128i load16(const uint16_t *p) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+}
+
+// [1 4 6 4 1] of five 16-bit vectors, which cannot overflow for sums of
+// up to 16 * 4080
+inline __m128i binomial5(__m128i a, __m128i b, __m128i c, __m128i d,
+                         __m128i e) {
+    __m128i outer = _mm_add_epi16(a, e);
+    __m128i inner = _mm_slli_epi16(_mm_add_epi16(b, d), 2);
+    __m128i centre = _mm_add_epi16(_mm_slli_epi16(c, 2),
+                                   _mm_slli_epi16(c, 1));
+    return _mm_add_epi16(_mm_add_epi16(outer, inner), centre);
+}
+
+// Eight horizontal blur taps at a time, returns the first column left
+int blurRowHSse2(const uchar *gray, uint16_t *target, int lo, int hi) {
+    int c = lo;
+    for (; c + 8 <= hi; c += 8) {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(target + c),
+                         binomial5(load8(gray + c - 2), load8(gray + c - 1),
+                                   load8(gray + c), load8(gray + c + 1),
+                                   load8(gray + c + 2)));
+    }
+    return c;
+}
+
+// Eight vertical blur taps at a time, returns the first column left
+int blurRowVSse2(const uint16_t *const h[5], uchar *target, int cols) {
+    const __m128i half = _mm_set1_epi16(128);
+    int c = 0;
+    for (; c + 8 <= cols; c += 8) {
+        __m128i sum = binomial5(load16(h[0] + c), load16(h[1] + c),
+                                load16(h[2] + c), load16(h[3] + c),
+                                load16(h[4] + c));
+        __m128i blurred = _mm_srli_epi16(_mm_add_epi16(sum, half), 8);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(target + c),
+                         _mm_packus_epi16(blurred, blurred));
+    }
+    return c;
+}
+#endif
+
+// Horizontal [1 4 6 4 1] pass of the blur, kept unscaled. The 8-bit
+// gaussian blur rounds only the full 2D sum.
+void blurRowH(const uchar *gray, uint16_t *target, int cols) {
+    auto tap = [&](int c) {
+        return static_cast<uint16_t>(
+                    gray[reflect101(c - 2, cols)]
+                + 4 * (gray[reflect101(c - 1, cols)]
+                       + gray[reflect101(c + 1, cols)])
+                + 6 * gray[c] + gray[reflect101(c + 2, cols)]);
+    };
+    int lo = min(2, cols);
+    int hi = max(cols - 2, lo);
+    for (int c = 0; c < lo; c++)
+        target[c] = tap(c);
+    int c0 = lo;
+#ifdef CARVER_SSE2_KERNELS
+    c0 = blurRowHSse2(gray, target, lo, hi);
+#endif
+    for (int c = c0; c < hi; c++) {
+        target[c] = static_cast<uint16_t>(
+                    gray[c - 2] + 4 * (gray[c - 1] + gray[c + 1])
+                + 6 * gray[c] + gray[c + 2]);
+    }
+    for (int c = hi; c < cols; c++)
+        target[c] = tap(c);
+}
+
+// Vertical [1 4 6 4 1] pass of the blur, rounding the 2D sum / 256
+void blurRowV(const uint16_t *const h[5], uchar *target, int cols) {
+    int c0 = 0;
+#ifdef CARVER_SSE2_KERNELS
+    c0 = blurRowVSse2(h, target, cols);
+#endif
+    for (int c = c0; c < cols; c++) {
+        unsigned sum = h[0][c] + 4u * (h[1][c] + h[3][c]) + 6u * h[2][c]
+                + h[4][c];
+        target[c] = static_cast<uchar>((sum + 128) >> 8);
+    }
+}
+
+template<typename T> inline T energyValue(int e);
+template<> inline double energyValue(int e) {
+    return e * (1.0 / 255.0);
+}
+template<> inline float energyValue(int e) {
+    return e * static_cast<float>(1.0 / 255.0);
+}
+template<> inline uchar energyValue(int e) {
+    return static_cast<uchar>(e);
+}
+template<> inline uint16_t energyValue(int e) {
+    return static_cast<uint16_t>(e);
+}
+template<> inline int32_t energyValue(int e) {
+    return e;
+}
+
+/**
+ * @brief energyCell combines the sobel responses of a pixel like
+ * convertScaleAbs followed by addWeighted(0.5, 0.5), which rounds halves
+ * to even
+ */
+template<typename T>
+inline T energyCell(const uchar *up, const uchar *mid, const uchar *down,
+                    int left, int c, int right, int shift) {
+    int gx = (up[right] - up[left]) + 2 * (mid[right] - mid[left])
+            + (down[right] - down[left]);
+    int gy = (down[left] + 2 * down[c] + down[right])
+            - (up[left] + 2 * up[c] + up[right]);
+    int s = min(abs(gx), 255) + min(abs(gy), 255);
+    return energyValue<T>(((s >> 1) + (s & (s >> 1) & 1)) >> shift);
+}
+
+#ifdef CARVER_SSE2_KERNELS
+// Stores eight energies held in 16-bit lanes like energyValue
+template<typename T> inline void storeEnergies(T *target, __m128i e);
+template<> inline void storeEnergies(double *target, __m128i e) {
+    __m128i e32 = _mm_unpacklo_epi16(e, _mm_setzero_si128());
+    __m128i high = _mm_unpackhi_epi16(e, _mm_setzero_si128());
+    const __m128d scale = _mm_set1_pd(1.0 / 255.0);
+    _mm_storeu_pd(target, _mm_mul_pd(_mm_cvtepi32_pd(e32), scale));
+    _mm_storeu_pd(target + 2, _mm_mul_pd(
+                      _mm_cvtepi32_pd(_mm_srli_si128(e32, 8)), scale));
+    _mm_storeu_pd(target + 4, _mm_mul_pd(_mm_cvtepi32_pd(high), scale));
+    _mm_storeu_pd(target + 6, _mm_mul_pd(
+                      _mm_cvtepi32_pd(_mm_srli_si128(high, 8)), scale));
+}
+template<> inline void storeEnergies(float *target, __m128i e) {
+    const __m128 scale = _mm_set1_ps(static_cast<float>(1.0 / 255.0));
+    _mm_storeu_ps(target, _mm_mul_ps(_mm_cvtepi32_ps(
+            _mm_unpacklo_epi16(e, _mm_setzero_si128())), scale));
+    _mm_storeu_ps(target + 4, _mm_mul_ps(_mm_cvtepi32_ps(
+            _mm_unpackhi_epi16(e, _mm_setzero_si128())), scale));
+}
+template<> inline void storeEnergies(uchar *target, __m128i e) {
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(target),
+                     _mm_packus_epi16(e, e));
+}
+template<> inline void storeEnergies(uint16_t *target, __m128i e) {
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(target), e);
+}
+template<> inline void storeEnergies(int32_t *target, __m128i e) {
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(target),
+                     _mm_unpacklo_epi16(e, _mm_setzero_si128()));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(target + 4),
+                     _mm_unpackhi_epi16(e, _mm_setzero_si128()));
+}
+
+inline __m128i saturatedAbs(__m128i v) {
+    return _mm_min_epi16(_mm_max_epi16(v, _mm_sub_epi16(_mm_setzero_si128(),
+                                                        v)),
+                         _mm_set1_epi16(255));
+}
+
+// Eight interior energies at a time in 16-bit lanes, which hold the sobel
+// responses of 8-bit rows. Returns the first column left.
+template<typename T>
+int energyRowSse2(const uchar *up, const uchar *mid, const uchar *down,
+                  T *target, int cols, int shift) {
+    __m128i count = _mm_cvtsi32_si128(shift);
+    int c = 1;
+    for (; c + 8 <= cols - 1; c += 8) {
+        __m128i upLeft = load8(up + c - 1);
+        __m128i upRight = load8(up + c + 1);
+        __m128i downLeft = load8(down + c - 1);
+        __m128i downRight = load8(down + c + 1);
+        __m128i gx = _mm_add_epi16(
+                    _mm_add_epi16(_mm_sub_epi16(upRight, upLeft),
+                                  _mm_sub_epi16(downRight, downLeft)),
+                    _mm_slli_epi16(_mm_sub_epi16(load8(mid + c + 1),
+                                                 load8(mid + c - 1)), 1));
+        __m128i gy = _mm_add_epi16(
+                    _mm_sub_epi16(_mm_add_epi16(downLeft, downRight),
+                                  _mm_add_epi16(upLeft, upRight)),
+                    _mm_slli_epi16(_mm_sub_epi16(load8(down + c),
+                                                 load8(up + c)), 1));
+        // Halves round to even like addWeighted
+        __m128i sum = _mm_add_epi16(saturatedAbs(gx), saturatedAbs(gy));
+        __m128i half = _mm_srli_epi16(sum, 1);
+        __m128i e = _mm_add_epi16(half, _mm_and_si128(
+                                      _mm_and_si128(sum, half),
+                                      _mm_set1_epi16(1)));
+        storeEnergies(target + c, _mm_srl_epi16(e, count));
+    }
+    return c;
+}
+#endif
+
+template<typename T>
+void energyRow(const uchar *up, const uchar *mid, const uchar *down,
+               T *target, int cols, int shift) {
+    if (cols < 3) {
+        for (int c = 0; c < cols; c++) {
+            target[c] = energyCell<T>(up, mid, down, reflect101(c - 1, cols),
+                                      c, reflect101(c + 1, cols), shift);
+        }
+        return;
+    }
+    target[0] = energyCell<T>(up, mid, down, 1, 0, 1, shift);
+    int c0 = 1;
+#ifdef CARVER_SSE2_KERNELS
+    c0 = energyRowSse2(up, mid, down, target, cols, shift);
+#endif
+    for (int c = c0; c < cols - 1; c++)
+        target[c] = energyCell<T>(up, mid, down, c - 1, c, c + 1, shift);
+    target[cols - 1] = energyCell<T>(up, mid, down, cols - 2, cols - 1,
+                                     cols - 2, shift);
+}
+
+/**
+ * @brief energyTile calculates the energy rows [r0, r1). Blurred rows are
+ * produced in order into a ring of three, each from a ring of five
+ * horizontally blurred grayscale rows, so every intermediate row is
+ * computed once per tile.
+ */
+template<typename T>
+void energyTile(const cv::Mat &source, cv::Mat &energyMap,
+                cv::Mat *grayscale, int r0, int r1, int shift) {
+    int rows = source.rows;
+    int cols = source.cols;
+    bool bgr = source.channels() == 3;
+
+    // Row buffers stay with the thread and only grow, repeated calls on
+    // smaller images do not allocate
+    thread_local vector<uchar> grayBuffer;
+    thread_local vector<uint16_t> hRing;
+    thread_local vector<uchar> blurRing;
+    size_t width = static_cast<size_t>(cols);
+    if (grayBuffer.size() < width) {
+        grayBuffer.resize(width);
+        hRing.resize(5 * width);
+        blurRing.resize(3 * width);
+    }
+    auto hSlot = [&](int v) { return &hRing[((v + 10) % 5) * width]; };
+    auto blurSlot = [&](int r) { return &blurRing[(r % 3) * width]; };
+
+    // Blurred rows run over the tile and one halo row on each side,
+    // horizontal passes over two more. Virtual rows above and below the
+    // image reflect back into it.
+    int next = max(r0 - 1, 0);
+    int nextH = next - 2;
+    for (int y = r0; y < r1; y++) {
+        for (int need = min(y + 1, rows - 1); next <= need; next++) {
+            for (; nextH <= next + 2; nextH++) {
+                int r = reflect101(nextH, rows);
+                const uchar *gray = source.ptr<uchar>(r);
+                if (bgr) {
+                    uchar *target = grayscale && r >= r0 && r < r1
+                            ? grayscale->ptr<uchar>(r) : grayBuffer.data();
+                    grayRow(gray, target, cols);
+                    gray = target;
+                }
+                blurRowH(gray, hSlot(nextH), cols);
+            }
+            const uint16_t *h[5] = {hSlot(next - 2), hSlot(next - 1),
+                                    hSlot(next), hSlot(next + 1),
+                                    hSlot(next + 2)};
+            blurRowV(h, blurSlot(next), cols);
+        }
+        energyRow(blurSlot(reflect101(y - 1, rows)), blurSlot(y),
+                  blurSlot(reflect101(y + 1, rows)), energyMap.ptr<T>(y),
+                  cols, shift);
+    }
+}
+
+template<typename T>
+void energyTiles(const cv::Mat &source, cv::Mat &energyMap,
+                 cv::Mat *grayscale, ThreadPool *pool, int shift) {
+    int rows = source.rows;
+    if (!pool || static_cast<long>(rows) * source.cols < minParallelPixels
+            || rows < 2 * minTileRows) {
+        energyTile<T>(source, energyMap, grayscale, 0, rows, shift);
+        return;
+    }
+    int tileRows = max(minTileRows,
+                       (rows + 4 * pool->concurrency() - 1)
+                       / (4 * pool->concurrency()));
+    int tiles = (rows + tileRows - 1) / tileRows;
+    pool->parallelFor(tiles, [&](int t) {
+        energyTile<T>(source, energyMap, grayscale, t * tileRows,
+                      min((t + 1) * tileRows, rows), shift);
+    });
+}
+} // namespace
+
+void fusedEnergy(const cv::Mat &source, cv::Mat &energyMap, int depth,
+                 cv::Mat *grayscale, ThreadPool *pool, int shift) {
+    if (source.type() != CV_8UC3 && source.type() != CV_8UC1) {
+        throw invalid_argument("Fused energy needs an 8-bit BGR or "
+                               "grayscale image");
+    }
+    if (depth != CV_64F && depth != CV_32F && depth != CV_8U
+            && depth != CV_16U && depth != CV_32S) {
+        throw invalid_argument("Unsupported energy map type");
+    }
+    if (shift < 0 || shift > 8
+            || (shift > 0 && (depth == CV_64F || depth == CV_32F))) {
+        throw invalid_argument("Invalid energy shift");
+    }
+    energyMap.create(source.rows, source.cols, depth);
+    if (grayscale && source.channels() == 3)
+        grayscale->create(source.rows, source.cols, CV_8U);
+    else
+        grayscale = nullptr;
+    if (source.empty())
+        return;
+
+    switch (depth) {
+    case CV_64F:
+        energyTiles<double>(source, energyMap, grayscale, pool, shift);
+        break;
+    case CV_32F:
+        energyTiles<float>(source, energyMap, grayscale, pool, shift);
+        break;
+    case CV_8U:
+        energyTiles<uchar>(source, energyMap, grayscale, pool, shift);
+        break;
+    case CV_16U:
+        energyTiles<uint16_t>(source, energyMap, grayscale, pool, shift);
+        break;
+    default:
+        energyTiles<int32_t>(source, energyMap, grayscale, pool, shift);
+    }
+}
+} // namespace carver
@@ -3,6 +3,11 @@
 #include <algorithm>
 
 #include <carver.hpp>
+#include <batch.hpp>
+#include <server.hpp>
+#include <video.hpp>
+
+#include <unistd.h>
 
 using namespace std;
 
@@ -10,12 +15,42 @@ void usage() {
     cout << "Usage: carver OPTION... INPUT" << endl;
     cout << "Mandatory arguments:" << endl;
     cout << "-m        carve mode (both/vertical/horizontal)" << endl;
-    cout << "-o        output path" << endl;
-    cout << "input path has to be given as the last argument" << endl;
+    cout << "-o        output path, output directory in batch mode" << endl;
+    cout << "input path has to be given as the last argument unless running in batch mode" << endl;
     cout << "Optional arguments:" << endl;
     cout << "-p        carve amount, removes given proportion of pixels from " << endl;
     cout << "          side length (0-1)" << endl;
     cout << "-c        carve amount, removes given number of pixels from side length" << endl;
+    cout << "--energy  energy map type (double/float/fixed16/fixed32), defaults to double" << endl;
+    cout << "-e        seam engine (exact/pyramid/banded), pyramid and banded are" << endl;
+    cout << "          approximate but faster, defaults to exact" << endl;
+    cout << "--band    banded engine search distance from the previous seam," << endl;
+    cout << "          defaults to 32" << endl;
+    cout << "--memory  memory limit in MiB, images that need more are carved out of" << endl;
+    cout << "          core through a scratch file in $TMPDIR" << endl;
+    cout << "--deadline time limit in milliseconds, seams left when it nears are" << endl;
+    cout << "          resized away instead of carved" << endl;
+    cout << "--hybrid  mean seam energy (0-1) above which carving stops and the rest" << endl;
+    cout << "          is resized away, speeds up large reductions" << endl;
+    cout << "-t        number of threads to use, defaults to all hardware threads" << endl;
+    cout << "-b        number of seams removed per energy evaluation, values above 1" << endl;
+    cout << "          trade quality for speed, defaults to 1" << endl;
+    cout << "--batch   carve all images of a directory or a glob pattern" << endl;
+    cout << "--manifest carve the images listed in a file, one \"input [output]\" per line" << endl;
+    cout << "-j        number of images carved at once in batch or server mode," << endl;
+    cout << "          defaults to 2" << endl;
+    cout << "--serve   keep running and carve images sent over a Unix socket at the" << endl;
+    cout << "          given path, or over stdin/stdout when the path is -" << endl;
+    cout << "--video   carve every frame of a video, the output path names the carved" << endl;
+    cout << "          video" << endl;
+    cout << "--queue   number of jobs that may wait in server mode before new ones" << endl;
+    cout << "          are rejected as busy, defaults to 64" << endl;
+    cout << "--connections number of socket clients served at once in server mode," << endl;
+    cout << "          defaults to 16" << endl;
+    cout << "--root    directory server mode path requests may read images from," << endl;
+    cout << "          path requests are refused without it" << endl;
+    cout << "--stats   print stage timings and counters after carving, the only" << endl;
+    cout << "          format is json and needs a build with -DCARVER_STATS=ON" << endl;
     cout << "-v        add verbosity" << endl;
     cout << "-h        print this help" << endl;
 }
@@ -53,6 +88,172 @@ void setCmdOptionsAndRun(carver::Carver &carver, int argc, char *argv[]) {
             exit(0);
     }
 
+    // Energy type
+    char* energyTypeOpt = getCmdOption(argv, argv+argc, "--energy", false);
+    if (energyTypeOpt) {
+        string energyTypeStr(energyTypeOpt);
+        optionCount+=2;
+        if (energyTypeStr == "double")
+            carver.setEnergyType(carver::ENERGY_DOUBLE);
+        else if (energyTypeStr == "float")
+            carver.setEnergyType(carver::ENERGY_FLOAT);
+        else if (energyTypeStr == "fixed16")
+            carver.setEnergyType(carver::ENERGY_FIXED16);
+        else if (energyTypeStr == "fixed32")
+            carver.setEnergyType(carver::ENERGY_FIXED32);
+        else
+            terminate(1, "Energy type value invalid");
+    }
+
+    // Seam engine
+    char* seamEngineOpt = getCmdOption(argv, argv+argc, "-e", false);
+    if (seamEngineOpt) {
+        string seamEngineStr(seamEngineOpt);
+        optionCount+=2;
+        if (seamEngineStr == "exact")
+            carver.setSeamEngine(carver::ENGINE_EXACT);
+        else if (seamEngineStr == "pyramid")
+            carver.setSeamEngine(carver::ENGINE_PYRAMID);
+        else if (seamEngineStr == "banded")
+            carver.setSeamEngine(carver::ENGINE_BANDED);
+        else
+            terminate(1, "Seam engine value invalid");
+    }
+
+    // Band width
+    char* bandWidthOpt = getCmdOption(argv, argv+argc, "--band", false);
+    if (bandWidthOpt) {
+        int bandWidth = atoi(bandWidthOpt);
+        optionCount+=2;
+        if (bandWidth < 1) {
+            terminate(1, "Invalid argument for band width");
+        }
+        carver.setBandWidth(bandWidth);
+    }
+
+    // Thread count
+    char* threadCountOpt = getCmdOption(argv, argv+argc, "-t", false);
+    if (threadCountOpt) {
+        int threadCount = atoi(threadCountOpt);
+        optionCount+=2;
+        if (threadCount < 1) {
+            terminate(1, "Invalid argument for thread count");
+        }
+        carver.setThreadCount(threadCount);
+    }
+
+    // Memory limit
+    char* memoryLimitOpt = getCmdOption(argv, argv+argc, "--memory", false);
+    if (memoryLimitOpt) {
+        int memoryLimit = atoi(memoryLimitOpt);
+        optionCount+=2;
+        if (memoryLimit < 1) {
+            terminate(1, "Invalid argument for memory limit");
+        }
+        carver.setMemoryLimit(static_cast<size_t>(memoryLimit) << 20);
+    }
+
+    // Deadline, counted from the start of the run
+    char* deadlineOpt = getCmdOption(argv, argv+argc, "--deadline", false);
+    if (deadlineOpt) {
+        int deadline = atoi(deadlineOpt);
+        optionCount+=2;
+        if (deadline < 1) {
+            terminate(1, "Invalid argument for deadline");
+        }
+        carver.setDeadline(chrono::steady_clock::now()
+                           + chrono::milliseconds(deadline));
+    }
+
+    // Hybrid carving threshold
+    char* hybridOpt = getCmdOption(argv, argv+argc, "--hybrid", false);
+    if (hybridOpt) {
+        double threshold = atof(hybridOpt);
+        optionCount+=2;
+        if (threshold <= 0 || threshold > 1) {
+            terminate(1, "Invalid argument for hybrid threshold");
+        }
+        carver.setHybridThreshold(threshold);
+    }
+
+    // Seam batch size
+    char* seamBatchSizeOpt = getCmdOption(argv, argv+argc, "-b", false);
+    if (seamBatchSizeOpt) {
+        int seamBatchSize = atoi(seamBatchSizeOpt);
+        optionCount+=2;
+        if (seamBatchSize < 1) {
+            terminate(1, "Invalid argument for seam batch size");
+        }
+        carver.setSeamBatchSize(seamBatchSize);
+    }
+
+    // Verbosity
+    bool verbose = false;
+    if(cmdOptionExists(argv, argv+argc, "-v")) {
+        verbose = true;
+        optionCount++;
+    }
+    carver.setVerbosity(verbose);
+
+    // Statistics output
+    bool printStats = false;
+    char* statsOpt = getCmdOption(argv, argv+argc, "--stats", false);
+    if (statsOpt) {
+        optionCount+=2;
+        if (string(statsOpt) != "json")
+            terminate(1, "Statistics format invalid");
+        if (!carver.getStats().enabled)
+            terminate(1, "Statistics not built in, rebuild with -DCARVER_STATS=ON");
+        printStats = true;
+    }
+
+    // Server mode, jobs carry their own carve mode and amount
+    char* serveOpt = getCmdOption(argv, argv+argc, "--serve", false);
+    if (serveOpt) {
+        string socketPath(serveOpt);
+        carver::CarveServer server(carver);
+        // Responses go to stdout in stream mode
+        server.setVerbosity(verbose && socketPath != "-");
+        char* concurrentJobsOpt = getCmdOption(argv, argv+argc, "-j", false);
+        if (concurrentJobsOpt) {
+            int concurrentJobs = atoi(concurrentJobsOpt);
+            if (concurrentJobs < 1) {
+                terminate(1, "Invalid argument for concurrent jobs");
+            }
+            server.setConcurrentJobs(concurrentJobs);
+        }
+        char* queueSizeOpt = getCmdOption(argv, argv+argc, "--queue", false);
+        if (queueSizeOpt) {
+            int queueSize = atoi(queueSizeOpt);
+            if (queueSize < 1) {
+                terminate(1, "Invalid argument for queue size");
+            }
+            server.setQueueSize(queueSize);
+        }
+        char* connectionsOpt = getCmdOption(argv, argv+argc, "--connections",
+                                            false);
+        if (connectionsOpt) {
+            int connections = atoi(connectionsOpt);
+            if (connections < 1) {
+                terminate(1, "Invalid argument for connection limit");
+            }
+            server.setMaxConnections(connections);
+        }
+        char* rootOpt = getCmdOption(argv, argv+argc, "--root", false);
+
+        try {
+            if (rootOpt)
+                server.setFileRoot(rootOpt);
+            if (socketPath == "-")
+                server.serveStream(STDIN_FILENO, STDOUT_FILENO);
+            else
+                server.serveSocket(socketPath);
+        } catch (exception &e) {
+            terminate(1, e.what());
+        }
+        exit(0);
+    }
+
     // Carve mode
     carver::CarveMode carveMode;
     char* carveModeOpt = getCmdOption(argv, argv+argc, "-m", true);
@@ -113,24 +314,82 @@ void setCmdOptionsAndRun(carver::Carver &carver, int argc, char *argv[]) {
     carver.setCarveCount(carveCount);
 
 
-    // Verbosity
-    bool verbose = false;
-    if(cmdOptionExists(argv, argv+argc, "-v")) {
-        verbose = true;
+    // Video mode
+    if (cmdOptionExists(argv, argv+argc, "--video")) {
         optionCount++;
+        if (argc < optionCount + 2)
+            terminate(1, "input path not provided");
+        string inputStr = argv[optionCount + 1];
+
+        carver::VideoCarver video(carver);
+        video.setVerbosity(verbose);
+        carver::VideoResult result;
+        try {
+            result = video.run(inputStr, outputStr);
+        } catch (exception &e) {
+            terminate(2, e.what());
+        }
+        cout << "Carved " << result.frames << " frames to " << result.size.width
+             << "x" << result.size.height << " in " << result.seconds << " s, "
+             << result.sceneChanges << " full searches" << endl;
+        return;
+    }
+
+    // Batch mode
+    char* batchOpt = getCmdOption(argv, argv+argc, "--batch", false);
+    char* manifestOpt = getCmdOption(argv, argv+argc, "--manifest", false);
+    if (batchOpt || manifestOpt) {
+        if (batchOpt && manifestOpt)
+            terminate(1, "Invalid combination of arguments --batch and --manifest");
+
+        carver::BatchCarver batch(carver);
+        batch.setVerbosity(verbose);
+        char* concurrentImagesOpt = getCmdOption(argv, argv+argc, "-j", false);
+        if (concurrentImagesOpt) {
+            int concurrentImages = atoi(concurrentImagesOpt);
+            if (concurrentImages < 1) {
+                terminate(1, "Invalid argument for concurrent images");
+            }
+            batch.setConcurrentImages(concurrentImages);
+        }
+
+        vector<carver::BatchJob> jobs;
+        try {
+            jobs = batchOpt
+                    ? carver::BatchCarver::jobsFromPattern(batchOpt, outputStr)
+                    : carver::BatchCarver::jobsFromManifest(manifestOpt,
+                                                            outputStr);
+        } catch (runtime_error &e) {
+            terminate(1, e.what());
+        }
+        if (jobs.empty())
+            terminate(1, "No images to carve");
+
+        carver::BatchResult result = batch.run(jobs);
+        for (auto &failure : result.failures) {
+            cout << failure.first.inputPath << ": " << failure.second << endl;
+        }
+        if (!result.failures.empty())
+            terminate(2, to_string(result.failures.size()) + " of " +
+                      to_string(jobs.size()) + " images failed");
+        return;
     }
-    carver.setVerbosity(verbose);
 
     // Load target image
     if (argc < optionCount + 2)
         terminate(1, "input path not provided");
     string filename = argv[optionCount + 1];
 
-    if(!carver.loadTargetImage(filename)) {
+    // The image is carved once, in place, which keeps a single copy of
+    // it in memory
+    if(!carver.loadTargetImage(filename, true)) {
         terminate(1, "Image loading failed, please provide path as the last argument");
     }
 
     carver.carveImage(outputStr);
+
+    if (printStats)
+        cout << carver.getStats().toJson() << endl;
 }
 
 int main(int argc, char *argv[]) {
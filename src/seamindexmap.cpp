@@ -0,0 +1,158 @@
+#include <seamindexmap.hpp>
+
+
+namespace carver {
+SeamIndexMap::SeamIndexMap(CarveMode direction, cv::Mat order, int seamCount)
+    : direction_(direction), seamCount_(seamCount), order_(order) {
+    if (direction != VERTICAL && direction != HORIZONTAL) {
+        throw invalid_argument("Seam index map direction must be VERTICAL "
+                               "or HORIZONTAL");
+    }
+    if (order.type() != CV_32S) {
+        throw invalid_argument("Seam index map order must be CV_32S");
+    }
+    int width = direction == VERTICAL ? order.cols : order.rows;
+    if (seamCount < 0 || seamCount >= max(width, 1)) {
+        throw out_of_range("Seam index map seam count out of range");
+    }
+
+    // Every recorded seam removes exactly one pixel of every line, so
+    // retargeting always fills the reduced image exactly. A line is a row
+    // of the map for vertical seams and a column for horizontal ones.
+    int length = direction == VERTICAL ? order.rows : order.cols;
+    vector<int> seen(static_cast<size_t>(seamCount), -1);
+    for (int i = 0; i < length; i++) {
+        int removed = 0;
+        for (int j = 0; j < width; j++) {
+            int s = direction == VERTICAL ? order.at<int>(i, j)
+                                          : order.at<int>(j, i);
+            if (s < 0 || s > seamCount) {
+                throw out_of_range("Seam index map order out of range");
+            }
+            if (s == seamCount)
+                continue;
+            if (seen[s] == i) {
+                throw invalid_argument("Seam index map removes a pixel "
+                                       "twice from a line");
+            }
+            seen[s] = i;
+            removed++;
+        }
+        if (removed != seamCount) {
+            throw invalid_argument("Seam index map misses a pixel of a "
+                                   "seam");
+        }
+    }
+}
+
+CarveMode SeamIndexMap::direction() const {
+    return direction_;
+}
+
+int SeamIndexMap::seamCount() const {
+    return seamCount_;
+}
+
+const cv::Mat &SeamIndexMap::order() const {
+    return order_;
+}
+
+bool SeamIndexMap::empty() const {
+    return order_.empty();
+}
+
+cv::Mat SeamIndexMap::retarget(const cv::Mat &image, int seams) const {
+    if (image.size() != order_.size()) {
+        throw invalid_argument("Image size does not match the seam index map");
+    }
+    if (seams < 0 || seams > seamCount_) {
+        throw out_of_range("Number of seams to remove out of range");
+    }
+
+    size_t pixelSize = image.elemSize();
+    cv::Mat target;
+
+    // A pixel survives as long as the seam that removed it has not been
+    // reached yet. The order was checked on construction, but it shares
+    // its buffer with the caller, so writes are still bounded.
+    const char *corrupt = "Seam index map order was modified";
+    if (direction_ == VERTICAL) {
+        target.create(image.rows, image.cols - seams, image.type());
+        size_t rowSize = target.cols * pixelSize;
+        for (int r = 0; r < image.rows; r++) {
+            const int *order = order_.ptr<int>(r);
+            const uchar *source = image.ptr(r);
+            uchar *row = target.ptr(r);
+            uchar *end = row + rowSize;
+            for (int c = 0; c < image.cols; c++) {
+                if (order[c] >= seams) {
+                    if (row == end) {
+                        throw runtime_error(corrupt);
+                    }
+                    memcpy(row, source + c * pixelSize, pixelSize);
+                    row += pixelSize;
+                }
+            }
+            if (row != end) {
+                throw runtime_error(corrupt);
+            }
+        }
+        return target;
+    }
+
+    // Horizontal seams remove rows per column, keep a write row for every
+    // column and stream over the source rows
+    target.create(image.rows - seams, image.cols, image.type());
+    vector<int> next(image.cols, 0);
+    for (int r = 0; r < image.rows; r++) {
+        const int *order = order_.ptr<int>(r);
+        const uchar *source = image.ptr(r);
+        for (int c = 0; c < image.cols; c++) {
+            if (order[c] >= seams) {
+                if (next[c] == target.rows) {
+                    throw runtime_error(corrupt);
+                }
+                memcpy(target.ptr(next[c]++) + c * pixelSize,
+                       source + c * pixelSize, pixelSize);
+            }
+        }
+    }
+    for (int c = 0; c < image.cols; c++) {
+        if (next[c] != target.rows) {
+            throw runtime_error(corrupt);
+        }
+    }
+    return target;
+}
+
+void SeamIndexMap::save(const string &filepath) const {
+    cv::FileStorage storage(filepath, cv::FileStorage::WRITE);
+    if (!storage.isOpened()) {
+        throw runtime_error("Could not open " + filepath + " for writing");
+    }
+    storage << "direction" << (direction_ == VERTICAL ? "vertical"
+                                                      : "horizontal");
+    storage << "seamCount" << seamCount_;
+    storage << "order" << order_;
+}
+
+SeamIndexMap SeamIndexMap::load(const string &filepath) {
+    cv::FileStorage storage(filepath, cv::FileStorage::READ);
+    if (!storage.isOpened()) {
+        throw runtime_error("Could not open " + filepath + " for reading");
+    }
+
+    string direction;
+    int seamCount = 0;
+    cv::Mat order;
+    storage["direction"] >> direction;
+    storage["seamCount"] >> seamCount;
+    storage["order"] >> order;
+
+    if (direction != "vertical" && direction != "horizontal") {
+        throw invalid_argument("Invalid seam index map in " + filepath);
+    }
+    return SeamIndexMap(direction == "vertical" ? VERTICAL : HORIZONTAL,
+                        order, seamCount);
+}
+} // namespace carver
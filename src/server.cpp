@@ -0,0 +1,461 @@
+#include <server.hpp>
+
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstdlib>
+#include <sstream>
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+namespace carver {
+namespace {
+bool readFully(int fd, void *buffer, size_t size) {
+    char *target = static_cast<char *>(buffer);
+    while (size > 0) {
+        ssize_t n = read(fd, target, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        target += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Pipes have no MSG_NOSIGNAL, threads writing responses block SIGPIPE
+// instead, see writeResponses_()
+bool writeFully(int fd, const void *buffer, size_t size) {
+    const char *source = static_cast<const char *>(buffer);
+    while (size > 0) {
+        ssize_t n = send(fd, source, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == ENOTSOCK)
+            n = write(fd, source, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        source += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool readPart(int fd, vector<uchar> &part, uint32_t maxSize) {
+    uint32_t size;
+    if (!readFully(fd, &size, sizeof(size)))
+        return false;
+    size = ntohl(size);
+    if (size > maxSize)
+        return false;
+    part.resize(size);
+    return size == 0 || readFully(fd, part.data(), size);
+}
+
+bool writePart(int fd, const void *data, size_t size) {
+    uint32_t networkSize = htonl(static_cast<uint32_t>(size));
+    return writeFully(fd, &networkSize, sizeof(networkSize)) &&
+            (size == 0 || writeFully(fd, data, size));
+}
+
+// A socket whose peer has closed it, or a pipe without a reader, can no
+// longer take the response
+bool hungUp(int fd) {
+    pollfd watched = {};
+    watched.fd = fd;
+    return poll(&watched, 1, 0) > 0
+            && (watched.revents & (POLLHUP | POLLERR));
+}
+
+/**
+ * @brief resolvePath resolves symbolic links and relative components of a
+ * path, relative paths start from the given directory
+ * @return absolute path, empty if it does not exist
+ */
+string resolvePath(const string &path, const string &directory) {
+    string joined = path.empty() || path[0] == '/' || directory.empty()
+            ? path : directory + "/" + path;
+    char resolved[PATH_MAX];
+    return realpath(joined.c_str(), resolved) ? string(resolved) : string();
+}
+} // namespace
+
+CarveServer::CarveServer(const Carver &prototype)
+    : prototype_(prototype), active_(0), completed_(0), rejected_(0),
+      stopping_(false), listenFd_(-1), openConnections_(0) {
+    // Jobs run side by side, their progress lines would interleave
+    prototype_.setVerbosity(false);
+}
+
+void CarveServer::setVerbosity(bool verbose) {
+    this->verbose_ = verbose;
+}
+
+void CarveServer::setConcurrentJobs(int concurrentJobs) {
+    if (concurrentJobs < 1) {
+        throw out_of_range("Concurrent job count out of range");
+    }
+    this->concurrentJobs_ = concurrentJobs;
+}
+
+void CarveServer::setQueueSize(int queueSize) {
+    if (queueSize < 1) {
+        throw out_of_range("Queue size out of range");
+    }
+    this->queueSize_ = queueSize;
+}
+
+void CarveServer::setMaxConnections(int maxConnections) {
+    if (maxConnections < 1) {
+        throw out_of_range("Connection limit out of range");
+    }
+    this->maxConnections_ = maxConnections;
+}
+
+void CarveServer::setFileRoot(const string &fileRoot) {
+    if (fileRoot.empty()) {
+        this->fileRoot_.clear();
+        return;
+    }
+    string resolved = resolvePath(fileRoot, "");
+    if (resolved.empty()) {
+        throw invalid_argument("File root " + fileRoot + " does not exist");
+    }
+    this->fileRoot_ = resolved;
+}
+
+int CarveServer::queueDepth() const {
+    return jobs_ ? static_cast<int>(jobs_->size()) : 0;
+}
+
+int CarveServer::activeJobs() const {
+    return active_;
+}
+
+void CarveServer::log_(const string &message) {
+    if (verbose_)
+        cout << message << endl;
+}
+
+CarveServer::Response CarveServer::errorResponse_(const string &message) {
+    Response response;
+    response.header = "status=error\nmessage=" + message + "\n";
+    return response;
+}
+
+void CarveServer::startWorkers_() {
+    jobs_.reset(new BoundedQueue<Job>(queueSize_));
+    for (int i = 0; i < concurrentJobs_; i++) {
+        workers_.push_back(thread([this] { workerLoop_(); }));
+    }
+}
+
+void CarveServer::stopWorkers_() {
+    jobs_->close();
+    for (auto &worker : workers_) {
+        worker.join();
+    }
+    workers_.clear();
+}
+
+void CarveServer::workerLoop_() {
+    // Each worker reuses its carver and thus its buffers across jobs
+    Carver carver = prototype_;
+    Job job;
+    while (jobs_->pop(job)) {
+        active_++;
+        Response response = carve_(carver, job);
+        active_--;
+        completed_++;
+        job.response.set_value(std::move(response));
+    }
+}
+
+CarveServer::Response CarveServer::carve_(Carver &carver, Job &job) {
+    try {
+        cv::Mat image;
+        auto path = job.header.find("path");
+        if (path != job.header.end()) {
+            // Files are only read from inside the configured root, the
+            // resolved path cannot escape it through links or ..
+            if (fileRoot_.empty())
+                return errorResponse_("path requests are disabled");
+            string file = resolvePath(path->second, fileRoot_);
+            if (file.empty())
+                return errorResponse_("file not found");
+            if (file.compare(0, fileRoot_.size() + 1, fileRoot_ + "/") != 0)
+                return errorResponse_("path outside of the file root");
+            image = cv::imread(file, cv::IMREAD_COLOR);
+        } else if (!job.payload.empty())
+            image = cv::imdecode(job.payload, cv::IMREAD_COLOR);
+        if (image.empty())
+            return errorResponse_("image decoding failed");
+
+        string mode = job.header["mode"];
+        if (mode == "both")
+            carver.setCarveMode(BOTH);
+        else if (mode == "vertical")
+            carver.setCarveMode(VERTICAL);
+        else if (mode == "horizontal")
+            carver.setCarveMode(HORIZONTAL);
+        else
+            return errorResponse_("carve mode value invalid");
+
+        auto count = job.header.find("count");
+        auto amount = job.header.find("amount");
+        carver.setCarveCount(count != job.header.end() ? stoi(count->second)
+                                                       : 0);
+        carver.setCarveAmount(amount != job.header.end()
+                              ? stof(amount->second) : 0.15f);
+
+        auto hybrid = job.header.find("hybrid");
+        carver.setHybridThreshold(hybrid != job.header.end()
+                                  ? stod(hybrid->second) : 0);
+
+        carver.setCancelToken(job.cancelToken);
+        if (job.hasDeadline)
+            carver.setDeadline(job.deadline);
+        else
+            carver.clearDeadline();
+        int resized = 0;
+        carver.setProgressCallback([&resized](const CarveProgress &progress) {
+            resized = progress.resizedSeams;
+        });
+
+        // The decoded image is private to the job, carve it in place
+        carver.setTargetImage(image, true);
+        cv::Size size = carver.getResultSize();
+
+        auto format = job.header.find("format");
+        Response response;
+        if (!carver.carveImageEncoded(format != job.header.end()
+                                      ? format->second : ".png",
+                                      response.payload))
+            return errorResponse_("image encoding failed");
+        response.header = "status=ok\nwidth=" + to_string(size.width) +
+                "\nheight=" + to_string(size.height) + "\n";
+        if (resized > 0)
+            response.header += "resized=" + to_string(resized) + "\n";
+        return response;
+    } catch (exception &e) {
+        return errorResponse_(e.what());
+    }
+}
+
+future<CarveServer::Response> CarveServer::submit_(Header header,
+                                                  vector<uchar> payload,
+                                                  CancelToken cancelToken) {
+    auto received = chrono::steady_clock::now();
+    promise<Response> immediate;
+    if (header["command"] == "stats") {
+        Response response;
+        response.header = "status=ok\nqueued=" + to_string(queueDepth()) +
+                "\nactive=" + to_string(activeJobs()) +
+                "\ncompleted=" + to_string(completed_) +
+                "\nrejected=" + to_string(rejected_) + "\n";
+        immediate.set_value(std::move(response));
+        return immediate.get_future();
+    }
+
+    Job job;
+    auto deadline = header.find("deadline");
+    if (deadline != header.end()) {
+        try {
+            job.deadline = received + chrono::milliseconds(
+                        stol(deadline->second));
+            job.hasDeadline = true;
+        } catch (exception &) {
+            immediate.set_value(errorResponse_("deadline value invalid"));
+            return immediate.get_future();
+        }
+    }
+    job.header = std::move(header);
+    job.payload = std::move(payload);
+    job.cancelToken = cancelToken;
+    future<Response> response = job.response.get_future();
+    if (!jobs_->tryPush(std::move(job))) {
+        rejected_++;
+        immediate.set_value(errorResponse_("server busy"));
+        return immediate.get_future();
+    }
+    return response;
+}
+
+void CarveServer::writeResponses_(BoundedQueue<future<Response>> &pending,
+                                  int inputFd, int outputFd,
+                                  CancelToken cancelToken) {
+    // A write to a pipe without a reader raises SIGPIPE in the writing
+    // thread, blocked here it fails with EPIPE instead and the signal is
+    // discarded with the thread
+    sigset_t pipeSignal;
+    sigemptyset(&pipeSignal);
+    sigaddset(&pipeSignal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipeSignal, nullptr);
+
+    // Responses go out in request order. Nobody reads the results of a
+    // client that went away, its jobs stop at their next seam or are
+    // dropped before they start. The rest of the queue is still drained
+    // so that the reader never blocks on it.
+    bool open = true;
+    chrono::milliseconds interval(hangupPollMilliseconds_);
+    future<Response> next;
+    while (pending.pop(next)) {
+        while (next.wait_for(interval) != future_status::ready) {
+            if (!cancelToken.cancelled() && hungUp(outputFd)) {
+                log_("Client hung up, cancelling its jobs");
+                cancelToken.cancel();
+            }
+        }
+        Response response = next.get();
+        if (open && !(writePart(outputFd, response.header.data(),
+                                response.header.size()) &&
+                      writePart(outputFd, response.payload.data(),
+                                response.payload.size()))) {
+            open = false;
+            cancelToken.cancel();
+            shutdown(inputFd, SHUT_RD);
+        }
+    }
+}
+
+void CarveServer::serveConnection_(int inputFd, int outputFd) {
+    // The connection reads ahead while earlier requests are carved, at
+    // most as many as there are workers wait for their responses
+    BoundedQueue<future<Response>> pending(concurrentJobs_);
+    CancelToken cancelToken;
+    thread writer([&] {
+        writeResponses_(pending, inputFd, outputFd, cancelToken);
+    });
+
+    vector<uchar> headerPart;
+    vector<uchar> payload;
+    while (readPart(inputFd, headerPart, maxHeaderSize_) &&
+           readPart(inputFd, payload, maxPayloadSize_)) {
+        Header header;
+        istringstream lines(string(headerPart.begin(), headerPart.end()));
+        string line;
+        while (getline(lines, line)) {
+            size_t separator = line.find('=');
+            if (separator != string::npos)
+                header[line.substr(0, separator)] = line.substr(separator + 1);
+        }
+
+        if (!pending.push(submit_(std::move(header), std::move(payload),
+                                  cancelToken)))
+            break;
+    }
+    pending.close();
+    writer.join();
+}
+
+void CarveServer::serveStream(int inputFd, int outputFd) {
+    startWorkers_();
+    serveConnection_(inputFd, outputFd);
+    stopWorkers_();
+}
+
+void CarveServer::connectionLoop_(BoundedQueue<int> &connections) {
+    int client;
+    while (connections.pop(client)) {
+        serveConnection_(client, client);
+        {
+            lock_guard<mutex> lock(clientLock_);
+            clientFds_.erase(client);
+        }
+        close(client);
+        openConnections_--;
+    }
+}
+
+void CarveServer::serveSocket(const string &socketPath) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        throw invalid_argument("Socket path too long");
+    }
+    socketPath.copy(address.sun_path, socketPath.size());
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        throw runtime_error("Could not create socket");
+    }
+    unlink(socketPath.c_str());
+    if (bind(listener, reinterpret_cast<sockaddr *>(&address),
+             sizeof(address)) < 0 || listen(listener, SOMAXCONN) < 0) {
+        close(listener);
+        throw runtime_error("Could not listen on " + socketPath);
+    }
+
+    stopping_ = false;
+    listenFd_ = listener;
+    startWorkers_();
+    log_("Listening on " + socketPath);
+
+    // A fixed set of threads serves the connections. Clients beyond the
+    // limit get an error response and are closed right away, so the queue
+    // never holds more connections than there are threads.
+    BoundedQueue<int> connections(maxConnections_);
+    vector<thread> connectionThreads;
+    for (int i = 0; i < maxConnections_; i++) {
+        connectionThreads.push_back(thread([this, &connections] {
+            connectionLoop_(connections);
+        }));
+    }
+    while (!stopping_) {
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR && !stopping_)
+                continue;
+            break;
+        }
+
+        if (openConnections_ >= maxConnections_) {
+            log_("Connection limit reached, refusing a client");
+            Response response = errorResponse_("too many connections");
+            if (writePart(client, response.header.data(),
+                          response.header.size()))
+                writePart(client, nullptr, 0);
+            close(client);
+            continue;
+        }
+        openConnections_++;
+        {
+            lock_guard<mutex> lock(clientLock_);
+            clientFds_.insert(client);
+        }
+        connections.push(client);
+    }
+
+    // Connections wait for their jobs, so the workers go last
+    stop();
+    connections.close();
+    for (auto &connection : connectionThreads) {
+        connection.join();
+    }
+    stopWorkers_();
+    listenFd_ = -1;
+    close(listener);
+    unlink(socketPath.c_str());
+    log_("Stopped listening on " + socketPath);
+}
+
+void CarveServer::stop() {
+    stopping_ = true;
+    int listener = listenFd_;
+    if (listener >= 0)
+        shutdown(listener, SHUT_RDWR);
+
+    // Unblock connections waiting for their next request
+    lock_guard<mutex> lock(clientLock_);
+    for (int client : clientFds_) {
+        shutdown(client, SHUT_RD);
+    }
+}
+} // namespace carver
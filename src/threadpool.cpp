@@ -0,0 +1,170 @@
+#include <threadpool.hpp>
+
+
+namespace carver {
+namespace {
+// Identifies the pool and queue owned by the current worker thread
+thread_local const ThreadPool *currentPool = nullptr;
+thread_local int currentQueue = -1;
+}
+
+ThreadPool::ThreadPool(int workerCount)
+    : stop_(false), pending_(0), nextQueue_(0) {
+    workerCount = max(workerCount, 0);
+    // The calling threads share one extra queue
+    for (int i = 0; i < workerCount + 1; i++) {
+        queues_.push_back(unique_ptr<TaskQueue>(new TaskQueue));
+    }
+    for (int i = 0; i < workerCount; i++) {
+        workers_.push_back(thread([this, i] { workerLoop_(i); }));
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        lock_guard<mutex> lock(sleepMutex_);
+        stop_ = true;
+    }
+    wakeCondition_.notify_all();
+    for (auto &worker : workers_) {
+        worker.join();
+    }
+    // Anything left over runs on the destroying thread
+    while (runPendingTask()) {}
+}
+
+shared_ptr<ThreadPool> ThreadPool::sharedPool() {
+    static shared_ptr<ThreadPool> pool = make_shared<ThreadPool>(
+                static_cast<int>(thread::hardware_concurrency()) - 1);
+    return pool;
+}
+
+int ThreadPool::concurrency() const {
+    return static_cast<int>(workers_.size()) + 1;
+}
+
+void ThreadPool::push_(function<void()> task) {
+    int index;
+    if (currentPool == this) {
+        index = currentQueue;
+    } else {
+        index = static_cast<int>(nextQueue_++ % queues_.size());
+    }
+
+    {
+        lock_guard<mutex> lock(queues_[index]->lock);
+        queues_[index]->tasks.push_back(std::move(task));
+    }
+    pending_++;
+
+    {
+        lock_guard<mutex> lock(sleepMutex_);
+    }
+    wakeCondition_.notify_one();
+}
+
+bool ThreadPool::pop_(function<void()> &task) {
+    int own = currentPool == this ? currentQueue : -1;
+
+    // Own queue first, newest task for cache locality
+    if (own >= 0) {
+        lock_guard<mutex> lock(queues_[own]->lock);
+        if (!queues_[own]->tasks.empty()) {
+            task = std::move(queues_[own]->tasks.back());
+            queues_[own]->tasks.pop_back();
+            pending_--;
+            return true;
+        }
+    }
+
+    // Steal the oldest task from someone else
+    int n = static_cast<int>(queues_.size());
+    int start = own >= 0 ? own + 1 : 0;
+    for (int i = 0; i < n; i++) {
+        int index = (start + i) % n;
+        if (index == own)
+            continue;
+        lock_guard<mutex> lock(queues_[index]->lock);
+        if (!queues_[index]->tasks.empty()) {
+            task = std::move(queues_[index]->tasks.front());
+            queues_[index]->tasks.pop_front();
+            pending_--;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ThreadPool::runPendingTask() {
+    function<void()> task;
+    if (!pop_(task))
+        return false;
+    task();
+    return true;
+}
+
+void ThreadPool::workerLoop_(int index) {
+    currentPool = this;
+    currentQueue = index;
+
+    while (true) {
+        if (runPendingTask())
+            continue;
+
+        unique_lock<mutex> lock(sleepMutex_);
+        wakeCondition_.wait(lock, [this] { return stop_ || pending_ > 0; });
+        if (stop_ && pending_ == 0)
+            return;
+    }
+}
+
+void ThreadPool::parallelFor(int n, const function<void(int)> &body) {
+    if (n <= 0)
+        return;
+    if (n == 1 || workers_.empty()) {
+        for (int i = 0; i < n; i++) {
+            body(i);
+        }
+        return;
+    }
+
+    // Helper tasks may still be dequeued after we return, so everything
+    // they touch before checking the index lives in shared state
+    struct LoopState {
+        atomic<int> next{0};
+        atomic<int> done{0};
+        mutex errorLock;
+        exception_ptr error;
+    };
+    auto state = make_shared<LoopState>();
+    const function<void(int)> *loopBody = &body;
+
+    auto run = [state, loopBody, n] {
+        int i;
+        while ((i = state->next++) < n) {
+            try {
+                (*loopBody)(i);
+            } catch (...) {
+                lock_guard<mutex> lock(state->errorLock);
+                if (!state->error)
+                    state->error = current_exception();
+            }
+            state->done++;
+        }
+    };
+
+    int helpers = min(n, concurrency()) - 1;
+    for (int i = 0; i < helpers; i++) {
+        push_(run);
+    }
+    run();
+
+    while (state->done < n) {
+        if (!runPendingTask())
+            this_thread::yield();
+    }
+
+    if (state->error)
+        rethrow_exception(state->error);
+}
+} // namespace carver
@@ -0,0 +1,397 @@
+#include <tiledcarver.hpp>
+#include <dpkernel.hpp>
+#include <energykernel.hpp>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+namespace carver {
+ScratchRows::ScratchRows(const string &directory, int rows, int cols)
+    : cols_(cols) {
+    // Pixels, energies and four back-pointers per byte, records aligned
+    // to cache lines
+    size_t bytes = 4 * static_cast<size_t>(cols) + (cols + 3) / 4;
+    rowBytes_ = (bytes + 63) / 64 * 64;
+
+    string path = directory + "/carver-XXXXXX";
+    vector<char> name(path.begin(), path.end());
+    name.push_back('\0');
+    fd_ = mkstemp(name.data());
+    if (fd_ < 0) {
+        throw runtime_error("Could not create a scratch file in "
+                            + directory);
+    }
+    // Nobody else needs the file, it goes away with the descriptor
+    unlink(name.data());
+
+    // Reserve the space up front, running out of it later would fault
+    // inside a mapping instead of failing here
+    off_t size = static_cast<off_t>(rowBytes_) * rows;
+    if (posix_fallocate(fd_, 0, size) != 0) {
+        close(fd_);
+        throw runtime_error("Not enough space for a scratch file in "
+                            + directory);
+    }
+}
+
+ScratchRows::~ScratchRows() {
+    unmap();
+    close(fd_);
+}
+
+void ScratchRows::map(int r0, int r1) {
+    unmap();
+    static const size_t pageSize =
+            static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t offset = static_cast<size_t>(r0) * rowBytes_;
+    size_t start = offset - offset % pageSize;
+    size_t bytes = static_cast<size_t>(r1 - r0) * rowBytes_ + offset - start;
+    void *mapping = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         fd_, static_cast<off_t>(start));
+    if (mapping == MAP_FAILED) {
+        throw runtime_error("Could not map scratch rows");
+    }
+    mapping_ = static_cast<uchar *>(mapping);
+    mappingBytes_ = bytes;
+    firstRow_ = mapping_ + (offset - start);
+    r0_ = r0;
+}
+
+void ScratchRows::unmap() {
+    if (mapping_) {
+        munmap(mapping_, mappingBytes_);
+        mapping_ = nullptr;
+    }
+}
+
+size_t ScratchRows::rowBytes() const {
+    return rowBytes_;
+}
+
+uchar *ScratchRows::pixels(int row) {
+    return firstRow_ + static_cast<size_t>(row - r0_) * rowBytes_;
+}
+
+uchar *ScratchRows::energies(int row) {
+    return pixels(row) + 3 * static_cast<size_t>(cols_);
+}
+
+uchar *ScratchRows::pointers(int row) {
+    return pixels(row) + 4 * static_cast<size_t>(cols_);
+}
+
+cv::Mat ScratchRows::pixelRows(int r0, int r1, int width) {
+    return cv::Mat(r1 - r0, width, CV_8UC3, pixels(r0), rowBytes_);
+}
+
+TiledCarver::TiledCarver(const string &scratchDirectory, size_t memoryLimit,
+                         ThreadPool *pool)
+    : scratchDirectory_(scratchDirectory), memoryLimit_(memoryLimit),
+      pool_(pool) {}
+
+cv::Mat TiledCarver::carve(const cv::Mat &image, int columns, int rows,
+                           bool inPlace,
+                           const function<bool(int, int)> &progress) {
+    if (image.empty() || image.type() != CV_8UC3) {
+        throw invalid_argument("Target image must be a non-empty 8-bit BGR "
+                               "image");
+    }
+    if (columns < 0 || rows < 0 || columns >= image.cols
+            || rows >= image.rows) {
+        throw out_of_range("Number of seams out of range for the image");
+    }
+
+    // Results are written into the top left corner of an in-place
+    // source, only after each pass has copied its input out. The
+    // horizontal pass does the same with the vertical result, so a carve
+    // never holds more than one result buffer.
+    cv::Mat reduced = image;
+    int removed = 0;
+    if (columns > 0) {
+        cv::Mat target;
+        if (inPlace)
+            target = image(cv::Rect(0, 0, image.cols - columns, image.rows));
+        removed = carveLines_(reduced, columns, false, target, [&](int v) {
+            return !progress || progress(v, 0);
+        });
+        reduced = target;
+    }
+    // A stopped vertical pass leaves the horizontal seams alone
+    if (rows > 0 && removed == columns) {
+        cv::Mat target;
+        if (inPlace || columns > 0)
+            target = reduced(cv::Rect(0, 0, reduced.cols,
+                                      reduced.rows - rows));
+        carveLines_(reduced, rows, true, target, [&](int h) {
+            return !progress || progress(columns, h);
+        });
+        reduced = target;
+    }
+    if (!columns && !rows && !inPlace)
+        reduced = image.clone();
+    return reduced;
+}
+
+double TiledCarver::seamEnergy() const {
+    return seamEnergy_;
+}
+
+int TiledCarver::carveLines_(const cv::Mat &source, int count, bool rotated,
+                             cv::Mat &target,
+                             const function<bool(int)> &progress) {
+    int lines = rotated ? source.cols : source.rows;
+    int width = rotated ? source.rows : source.cols;
+    ScratchRows scratch(scratchDirectory_, lines, width);
+    int stripRows = stripRows_(scratch, lines, width);
+
+    size_t rowSize = static_cast<size_t>(width);
+    energyRow_.resize(rowSize);
+    previousRow_.resize(rowSize);
+    currentRow_.resize(rowSize);
+    directionRow_.resize(rowSize);
+    seam_.resize(lines);
+    // Every chunk of a band gets its own halo columns
+    int chunks = pool_ ? pool_->concurrency() : 1;
+    energyBand_.create(1, (energyBandRows_ + 2 * halo_)
+                       * (width + 2 * halo_ * chunks), CV_8U);
+
+    load_(scratch, source, rotated, stripRows);
+    int removed = 0;
+    while (removed < count) {
+        int end = forwardPass_(scratch, lines, width - removed, stripRows,
+                               removed == 0);
+        seamEnergy_ = previousRow_[end] / (255.0 * lines);
+        backwardPass_(scratch, lines, width - removed, stripRows, end);
+        removed++;
+        if (!progress(removed))
+            break;
+    }
+
+    // A stopped carve is larger than an in-place target and gets its own
+    store_(scratch, lines, width - removed, rotated, stripRows, target);
+    return removed;
+}
+
+int TiledCarver::stripRows_(const ScratchRows &scratch, int lines,
+                            int width) const {
+    // Memory outside the strips: DP rows, the seam and the energy band
+    int chunks = pool_ ? pool_->concurrency() : 1;
+    size_t fixed = 13 * static_cast<size_t>(width)
+            + sizeof(int) * static_cast<size_t>(lines)
+            + static_cast<size_t>(energyBandRows_ + 2 * halo_)
+            * (width + 2 * halo_ * chunks);
+    size_t available = memoryLimit_ > fixed ? memoryLimit_ - fixed : 0;
+    size_t rows = available / scratch.rowBytes();
+    rows = rows > 2 * halo_ ? rows - 2 * halo_ : 0;
+    return static_cast<int>(min(max(rows, static_cast<size_t>(minStripRows_)),
+                                static_cast<size_t>(lines)));
+}
+
+void TiledCarver::forChunks_(int n, int minChunk,
+                             const function<void(int, int, int)> &function) {
+    int chunks = pool_ ? min(pool_->concurrency(), n / minChunk) : 1;
+    if (chunks <= 1) {
+        function(0, 0, n);
+        return;
+    }
+    int chunkSize = n / chunks / 4 * 4;
+    pool_->parallelFor(chunks, [&](int k) {
+        function(k, k * chunkSize,
+                 k == chunks - 1 ? n : (k + 1) * chunkSize);
+    });
+}
+
+void TiledCarver::load_(ScratchRows &scratch, const cv::Mat &source,
+                        bool rotated, int stripRows) {
+    int lines = rotated ? source.cols : source.rows;
+    int width = rotated ? source.rows : source.cols;
+    for (int r0 = 0; r0 < lines; r0 += stripRows) {
+        int r1 = min(r0 + stripRows, lines);
+        scratch.map(r0, r1);
+        if (!rotated) {
+            forChunks_(r1 - r0, 1, [&](int, int i0, int i1) {
+                for (int r = r0 + i0; r < r0 + i1; r++) {
+                    memcpy(scratch.pixels(r), source.ptr(r),
+                           3 * static_cast<size_t>(width));
+                }
+            });
+            continue;
+        }
+
+        // Row r of the image rotated clockwise is column r read from the
+        // bottom up. Columns are gathered a block at a time, transposed
+        // and mirrored while the block is in cache.
+        cv::Mat strip = scratch.pixelRows(r0, r1, width);
+        forChunks_(r1 - r0, transposeBlock_, [&](int, int i0, int i1) {
+            for (int x0 = r0 + i0; x0 < r0 + i1; x0 += transposeBlock_) {
+                int x1 = min(x0 + transposeBlock_, r0 + i1);
+                for (int y0 = 0; y0 < width; y0 += transposeBlock_) {
+                    int y1 = min(y0 + transposeBlock_, width);
+                    cv::Mat block = strip(cv::Rect(width - y1, x0 - r0,
+                                                   y1 - y0, x1 - x0));
+                    cv::transpose(source(cv::Rect(x0, y0, x1 - x0,
+                                                  y1 - y0)), block);
+                    cv::flip(block, block, 1);
+                }
+            }
+        });
+    }
+    scratch.unmap();
+}
+
+void TiledCarver::store_(ScratchRows &scratch, int lines, int width,
+                         bool rotated, int stripRows, cv::Mat &target) {
+    target.create(rotated ? width : lines, rotated ? lines : width, CV_8UC3);
+    for (int r0 = 0; r0 < lines; r0 += stripRows) {
+        int r1 = min(r0 + stripRows, lines);
+        scratch.map(r0, r1);
+        if (!rotated) {
+            forChunks_(r1 - r0, 1, [&](int, int i0, int i1) {
+                for (int r = r0 + i0; r < r0 + i1; r++) {
+                    memcpy(target.ptr(r), scratch.pixels(r),
+                           3 * static_cast<size_t>(width));
+                }
+            });
+            continue;
+        }
+
+        // Rotating counterclockwise turns row r into column r of the
+        // target, read from the bottom up, block by block as in load_
+        cv::Mat strip = scratch.pixelRows(r0, r1, width);
+        forChunks_(r1 - r0, transposeBlock_, [&](int, int i0, int i1) {
+            for (int y0 = r0 + i0; y0 < r0 + i1; y0 += transposeBlock_) {
+                int y1 = min(y0 + transposeBlock_, r0 + i1);
+                for (int x0 = 0; x0 < width; x0 += transposeBlock_) {
+                    int x1 = min(x0 + transposeBlock_, width);
+                    cv::Mat block = target(cv::Rect(y0, width - x1,
+                                                    y1 - y0, x1 - x0));
+                    cv::transpose(strip(cv::Rect(x0, y0 - r0, x1 - x0,
+                                                 y1 - y0)), block);
+                    cv::flip(block, block, 0);
+                }
+            }
+        });
+    }
+    scratch.unmap();
+}
+
+void TiledCarver::updateEnergy_(ScratchRows &scratch, int r0, int r1,
+                                int lines, int width, bool full) {
+    for (int b0 = r0; b0 < r1; b0 += energyBandRows_) {
+        int b1 = min(b0 + energyBandRows_, r1);
+        int y0 = max(b0 - halo_, 0);
+        int y1 = min(b1 + halo_, lines);
+
+        // Removing a seam changes the energies within halo_ columns of it
+        // on the rows within halo_ rows of it
+        int lo = 0;
+        int hi = width;
+        if (!full) {
+            auto range = minmax_element(seam_.begin() + y0,
+                                        seam_.begin() + y1);
+            lo = max(*range.first - halo_, 0);
+            hi = min(*range.second + halo_, width);
+        }
+        if (lo >= hi)
+            continue;
+
+        cv::Mat pixels = scratch.pixelRows(y0, y1, width);
+        forChunks_(hi - lo, minChunkWidth_, [&](int k, int c0, int c1) {
+            c0 += lo;
+            c1 += lo;
+            int x0 = max(c0 - halo_, 0);
+            int x1 = min(c1 + halo_, width);
+            cv::Mat band(y1 - y0, x1 - x0, CV_8U, energyBand_.data
+                         + (energyBandRows_ + 2 * halo_)
+                         * (c0 - lo + 2 * halo_ * k));
+            fusedEnergy(pixels(cv::Rect(x0, 0, x1 - x0, y1 - y0)), band,
+                        CV_8U, nullptr, nullptr);
+            for (int y = b0; y < b1; y++) {
+                memcpy(scratch.energies(y) + c0, band.ptr(y - y0) + c0 - x0,
+                       c1 - c0);
+            }
+        });
+    }
+}
+
+int TiledCarver::forwardPass_(ScratchRows &scratch, int lines, int width,
+                              int stripRows, bool full) {
+    for (int r0 = 0; r0 < lines; r0 += stripRows) {
+        int r1 = min(r0 + stripRows, lines);
+        scratch.map(max(r0 - halo_, 0), min(r1 + halo_, lines));
+        updateEnergy_(scratch, r0, r1, lines, width, full);
+
+        for (int r = r0; r < r1; r++) {
+            const uchar *energies = scratch.energies(r);
+            uchar *pointers = scratch.pointers(r);
+            forChunks_(width, minChunkWidth_, [&](int, int c0, int c1) {
+                for (int c = c0; c < c1; c++)
+                    energyRow_[c] = energies[c];
+                if (r == 0) {
+                    copy(energyRow_.begin() + c0, energyRow_.begin() + c1,
+                         currentRow_.begin() + c0);
+                    return;
+                }
+                cumulativeRow(energyRow_.data(), previousRow_.data(),
+                              currentRow_.data(), directionRow_.data(), c0,
+                              c1, width);
+                // Chunks start at multiples of four and own whole bytes
+                for (int c = c0; c < c1; c += 4) {
+                    uchar packed = 0;
+                    for (int k = 0; k < 4 && c + k < c1; k++) {
+                        packed |= static_cast<uchar>(
+                                    (directionRow_[c + k] + 1) << (2 * k));
+                    }
+                    pointers[c / 4] = packed;
+                }
+            });
+            swap(previousRow_, currentRow_);
+        }
+    }
+    scratch.unmap();
+
+    // Ties resolve to the left like on every other row
+    return static_cast<int>(min_element(previousRow_.begin(),
+                                        previousRow_.begin() + width)
+                            - previousRow_.begin());
+}
+
+void TiledCarver::backwardPass_(ScratchRows &scratch, int lines, int width,
+                                int stripRows, int end) {
+    int position = end;
+    for (int r0 = (lines - 1) / stripRows * stripRows; r0 >= 0;
+         r0 -= stripRows) {
+        int r1 = min(r0 + stripRows, lines);
+        scratch.map(r0, r1);
+        for (int r = r1 - 1; r >= r0; r--) {
+            seam_[r] = position;
+            if (r > 0) {
+                int pointer = (scratch.pointers(r)[position / 4]
+                               >> (2 * (position % 4))) & 3;
+                position += pointer - 1;
+            }
+        }
+
+        // Shift the row tails over the seam, the back-pointers are
+        // rewritten by the next forward pass anyway
+        forChunks_(r1 - r0, 1, [&](int, int i0, int i1) {
+            for (int r = r0 + i0; r < r0 + i1; r++) {
+                int p = seam_[r];
+                uchar *pixels = scratch.pixels(r);
+                uchar *energies = scratch.energies(r);
+                memmove(pixels + 3 * p, pixels + 3 * (p + 1),
+                        3 * static_cast<size_t>(width - 1 - p));
+                memmove(energies + p, energies + p + 1, width - 1 - p);
+            }
+        });
+    }
+    scratch.unmap();
+}
+} // namespace carver
@@ -0,0 +1,202 @@
+#include <video.hpp>
+
+#include <chrono>
+#include <thread>
+
+
+namespace carver {
+namespace {
+// Scene changes are detected on thumbnails of this size, small enough to
+// ignore noise and compression artifacts
+const cv::Size thumbnailSize(64, 36);
+constexpr double defaultFps = 25.0;
+
+cv::Mat thumbnail(const cv::Mat &frame) {
+    cv::Mat gray;
+    cv::Mat small;
+    cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
+    cv::resize(gray, small, thumbnailSize, 0, 0, cv::INTER_AREA);
+    return small;
+}
+} // namespace
+
+VideoCarver::VideoCarver(const Carver &prototype) : prototype_(prototype) {
+    // Per-frame progress lines would drown the frame counter
+    prototype_.setVerbosity(false);
+}
+
+void VideoCarver::setVerbosity(bool verbose) {
+    this->verbose_ = verbose;
+}
+
+void VideoCarver::setQueueSize(int queueSize) {
+    if (queueSize < 1) {
+        throw out_of_range("Queue size out of range");
+    }
+    this->queueSize_ = queueSize;
+}
+
+void VideoCarver::setTemporalBand(int band) {
+    if (band < 1) {
+        throw out_of_range("Temporal band out of range");
+    }
+    this->temporalBand_ = band;
+}
+
+void VideoCarver::setSceneThreshold(double sceneThreshold) {
+    if (sceneThreshold <= 0 || sceneThreshold > 1) {
+        throw out_of_range("Scene threshold out of range");
+    }
+    this->sceneThreshold_ = sceneThreshold;
+}
+
+void VideoCarver::setCodec(const string &fourcc) {
+    if (fourcc.size() != 4) {
+        throw invalid_argument("Codec has to be a four character code");
+    }
+    this->fourcc_ = cv::VideoWriter::fourcc(fourcc[0], fourcc[1], fourcc[2],
+                                            fourcc[3]);
+}
+
+void VideoCarver::fail_(BoundedQueue<Frame> &decoded,
+                        BoundedQueue<Frame> &carved) {
+    {
+        lock_guard<mutex> lock(errorLock_);
+        if (!error_)
+            error_ = current_exception();
+    }
+    // Unblocks the other stages, they drop whatever is left
+    decoded.close();
+    carved.close();
+}
+
+void VideoCarver::decodeStage_(cv::VideoCapture &capture,
+                               BoundedQueue<Frame> &decoded) {
+    cv::Mat previous;
+    Frame frame;
+    while (capture.read(frame.image)) {
+        if (frame.image.empty())
+            break;
+        cv::Mat current = thumbnail(frame.image);
+        frame.sceneChange = previous.empty()
+                || cv::norm(current, previous, cv::NORM_L1)
+                   / (current.total() * 255.0) > sceneThreshold_;
+        previous = current;
+        if (!decoded.push(std::move(frame)))
+            return;
+        // The queued frame keeps its pixels, the next one gets a new buffer
+        frame = Frame();
+    }
+}
+
+void VideoCarver::carveStage_(BoundedQueue<Frame> &decoded,
+                              BoundedQueue<Frame> &carved,
+                              VideoResult &result, int frameCount) {
+    Carver carver = prototype_;
+    carver.setSeamRecording(true);
+    Frame frame;
+    while (decoded.pop(frame)) {
+        // Guides only make sense within one scene and for frames of the
+        // same size, the carver itself falls back on a mismatch
+        if (frame.sceneChange) {
+            carver.clearSeamGuides();
+            result.sceneChanges++;
+        } else {
+            carver.setSeamGuides(carver.getCarvedSeams(), temporalBand_);
+        }
+        carver.setTargetImage(frame.image, true);
+        frame.image = carver.carveImage();
+        result.frames++;
+        result.size = frame.image.size();
+
+        if (verbose_) {
+            cout << "\rCarved frame " << result.frames;
+            if (frameCount > 0)
+                cout << "/" << frameCount;
+            cout << flush;
+        }
+        if (!carved.push(std::move(frame)))
+            return;
+    }
+}
+
+void VideoCarver::encodeStage_(cv::VideoWriter &writer,
+                               const string &outputPath, int fourcc,
+                               double fps, BoundedQueue<Frame> &carved) {
+    Frame frame;
+    cv::Size size;
+    while (carved.pop(frame)) {
+        if (!writer.isOpened()) {
+            size = frame.image.size();
+            if (!writer.open(outputPath, fourcc, fps, size)) {
+                throw runtime_error("Could not open output video "
+                                    + outputPath);
+            }
+        } else if (frame.image.size() != size) {
+            throw runtime_error("Frame size changed within the video");
+        }
+        writer.write(frame.image);
+    }
+}
+
+VideoResult VideoCarver::run(const string &inputPath,
+                             const string &outputPath) {
+    auto start = chrono::steady_clock::now();
+    VideoResult result;
+    error_ = nullptr;
+
+    cv::VideoCapture capture(inputPath);
+    if (!capture.isOpened()) {
+        throw runtime_error("Could not open input video " + inputPath);
+    }
+    double fps = capture.get(cv::CAP_PROP_FPS);
+    if (!(fps > 0))
+        fps = defaultFps;
+    int frameCount = static_cast<int>(capture.get(cv::CAP_PROP_FRAME_COUNT));
+    int fourcc = fourcc_ ? fourcc_
+                         : cv::VideoWriter::fourcc('m', 'p', '4', 'v');
+
+    // Carving is sequential, each frame is guided by the seams of the one
+    // before it. Decoding and encoding overlap with it instead.
+    BoundedQueue<Frame> decoded(queueSize_);
+    BoundedQueue<Frame> carved(queueSize_);
+    cv::VideoWriter writer;
+
+    thread decoder([&] {
+        try {
+            decodeStage_(capture, decoded);
+        } catch (...) {
+            fail_(decoded, carved);
+        }
+        decoded.close();
+    });
+    thread carverThread([&] {
+        try {
+            carveStage_(decoded, carved, result, frameCount);
+        } catch (...) {
+            fail_(decoded, carved);
+        }
+        carved.close();
+    });
+    try {
+        encodeStage_(writer, outputPath, fourcc, fps, carved);
+    } catch (...) {
+        fail_(decoded, carved);
+    }
+
+    decoder.join();
+    carverThread.join();
+    writer.release();
+    if (verbose_)
+        cout << endl;
+    if (error_)
+        rethrow_exception(error_);
+    if (result.frames == 0) {
+        throw runtime_error("No frames could be read from " + inputPath);
+    }
+
+    result.seconds = chrono::duration<double>(
+                chrono::steady_clock::now() - start).count();
+    return result;
+}
+} // namespace carver
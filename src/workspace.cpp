@@ -0,0 +1,83 @@
+#include <workspace.hpp>
+
+
+namespace carver {
+namespace {
+constexpr int blockWidth = 4096;
+} // namespace
+
+Workspace::Workspace(const Workspace &) {}
+
+Workspace &Workspace::operator=(const Workspace &) {
+    // Keep our own buffers, they are never handed out to the other one
+    return *this;
+}
+
+void Workspace::reserve(WorkspaceBuffer buffer, size_t bytes) {
+    // Rows of a fixed width keep large buffers within the int dimensions
+    if (bytes > blocks_[buffer].total()) {
+        blocks_[buffer].create(static_cast<int>((bytes + blockWidth - 1)
+                                                / blockWidth),
+                               blockWidth, CV_8U);
+    }
+}
+
+void Workspace::reserveLines(int lines) {
+    for (int d = 0; d < 2; d++) {
+        seams_[d].reserve(lines);
+        bandStarts_[d].reserve(lines);
+        bandCentre_[d].reserve(lines);
+    }
+    footprint_.reserve(lines);
+}
+
+cv::Mat Workspace::view(WorkspaceBuffer buffer, int rows, int cols,
+                        int type, size_t offset) {
+    cv::Mat &block = blocks_[buffer];
+    size_t bytes = static_cast<size_t>(rows) * cols * CV_ELEM_SIZE(type);
+    if (block.empty() || offset + bytes > block.total())
+        return cv::Mat();
+    return cv::Mat(rows, cols, type, block.data + offset);
+}
+
+const cv::Mat &Workspace::block(WorkspaceBuffer buffer) const {
+    return blocks_[buffer];
+}
+
+vector<int> &Workspace::seam(int direction) {
+    return seams_[direction];
+}
+
+vector<cv::Range> &Workspace::footprint() {
+    return footprint_;
+}
+
+vector<int> &Workspace::bandStarts(int direction) {
+    return bandStarts_[direction];
+}
+
+vector<int> &Workspace::bandCentre(int direction) {
+    return bandCentre_[direction];
+}
+
+vector<cv::Mat> &Workspace::pyramid(int direction) {
+    return pyramid_[direction];
+}
+
+size_t Workspace::size() const {
+    size_t total = 0;
+    for (const cv::Mat &block : blocks_) {
+        total += block.total();
+    }
+    return total;
+}
+
+void Workspace::release() {
+    for (cv::Mat &block : blocks_) {
+        block.release();
+    }
+    for (vector<cv::Mat> &levels : pyramid_) {
+        levels.clear();
+    }
+}
+} // namespace carver